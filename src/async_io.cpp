@@ -0,0 +1,638 @@
+#include "async_io.hpp"
+#include "stage_memory.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#ifdef VINYL_POSIX_IO
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define VINYL_HAVE_URING 1
+#endif
+
+IOBackend parse_io_backend(const std::string &name) {
+  if (name == "sync") {
+    return IOBackend::sync;
+  } else if (name == "threads") {
+    return IOBackend::threads;
+  } else if (name == "uring") {
+    return IOBackend::uring;
+  }
+  throw "Unknown I/O backend (use sync, threads or uring).\n";
+}
+
+// Bandwidth measurement
+
+IOStats AsyncIO::stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  return totals;
+}
+
+void AsyncIO::begin_transfer(bool write) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  if (active[write]++ == 0) {
+    since[write] = Clock::now();
+  }
+}
+
+void AsyncIO::end_transfer(bool write, uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  (write ? totals.bytes_written : totals.bytes_read) += bytes;
+  if (--active[write] == 0) {
+    std::chrono::duration<double> busy = Clock::now() - since[write];
+    (write ? totals.write_seconds : totals.read_seconds) += busy.count();
+  }
+}
+
+void output_io_stats(const AsyncIO &io) {
+  IOStats stats = io.stats();
+  auto bandwidth = [](uint64_t bytes, double seconds) {
+    return seconds > 0 ? bytes / seconds / (1 << 20) : 0.0;
+  };
+  std::cerr << "I/O Backend: " << io.name() << std::endl;
+  std::cerr << "Read: " << stats.bytes_read / (1 << 20) << " MiB in "
+            << stats.read_seconds << " s ("
+            << bandwidth(stats.bytes_read, stats.read_seconds) << " MiB/s)"
+            << std::endl;
+  std::cerr << "Write: " << stats.bytes_written / (1 << 20) << " MiB in "
+            << stats.write_seconds << " s ("
+            << bandwidth(stats.bytes_written, stats.write_seconds)
+            << " MiB/s)" << std::endl;
+  return;
+}
+
+// Backend with pread / pwrite on a pool of threads
+
+static std::vector<char> read_whole_file(const std::string &file_path,
+                                         bool direct_io) {
+  std::vector<char> contents;
+
+  // The aligned buffer is copied as the interface hands out vectors
+  AlignedBuffer aligned;
+  size_t size = 0;
+  if (direct_io && read_file_direct(file_path, aligned, size)) {
+    contents.assign(aligned.data(), aligned.data() + size);
+    return contents;
+  }
+
+#ifdef VINYL_POSIX_IO
+  int fd = open(file_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw "Failed to open input file.\n";
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw "Failed to open input file.\n";
+  }
+  contents.resize(static_cast<size_t>(info.st_size));
+
+  size_t done = 0;
+  while (done < contents.size()) {
+    ssize_t count = pread(fd, contents.data() + done, contents.size() - done,
+                          static_cast<off_t>(done));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      close(fd);
+      throw "Error reading the WAV file data.\n";
+    }
+    done += static_cast<size_t>(count);
+  }
+  close(fd);
+#else
+  std::ifstream file(file_path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    throw "Failed to open input file.\n";
+  }
+  contents.resize(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  if (!file.read(contents.data(), contents.size())) {
+    throw "Error reading the WAV file data.\n";
+  }
+#endif
+  return contents;
+}
+
+static uint64_t slices_size(const std::vector<IOSlice> &slices) {
+  uint64_t size = 0;
+  for (const auto &slice : slices) {
+    size += slice.size;
+  }
+  return size;
+}
+
+class ThreadPoolIO : public AsyncIO {
+public:
+  ThreadPoolIO(unsigned num_threads, bool direct_io) : direct_io(direct_io) {
+    for (unsigned i = 0; i < num_threads; ++i) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ~ThreadPoolIO() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  std::future<std::vector<char>>
+  read_file(const std::string &file_path) override {
+    auto promise = std::make_shared<std::promise<std::vector<char>>>();
+    enqueue([this, promise, file_path] {
+      StageScope stage(Stage::read);
+      begin_transfer(false);
+      try {
+        std::vector<char> contents = read_whole_file(file_path, direct_io);
+        end_transfer(false, contents.size());
+        promise->set_value(std::move(contents));
+      } catch (...) {
+        end_transfer(false, 0);
+        promise->set_exception(std::current_exception());
+      }
+    });
+    return promise->get_future();
+  }
+
+  std::future<void> write_file(const std::string &file_path,
+                               std::vector<IOSlice> slices,
+                               std::shared_ptr<const void> owner) override {
+    auto promise = std::make_shared<std::promise<void>>();
+    enqueue([this, promise, file_path, slices, owner] {
+      begin_transfer(true);
+      try {
+        uint64_t size = slices_size(slices);
+        OutputFile out_file(file_path, direct_io);
+        out_file.preallocate(size);
+        out_file.write(slices);
+        out_file.close();
+        end_transfer(true, size);
+        promise->set_value();
+      } catch (...) {
+        end_transfer(true, 0);
+        promise->set_exception(std::current_exception());
+      }
+    });
+    return promise->get_future();
+  }
+
+  const char *name() const override { return "threads"; }
+
+private:
+  void enqueue(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+  }
+
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+  bool direct_io;
+};
+
+// Backend with io_uring
+
+#ifdef VINYL_HAVE_URING
+
+class UringIO : public AsyncIO {
+public:
+  // Large files are split into operations of this size
+  static constexpr size_t operation_size = 1 << 20;
+
+  explicit UringIO(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) {
+      throw "io_uring is not available.\n";
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring
+                          : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring_fd,
+                                 IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+        sqes_ptr == MAP_FAILED) {
+      close(ring_fd);
+      throw "io_uring is not available.\n";
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    char *cq = static_cast<char *>(cq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    cq_entries = params.cq_entries;
+
+    reaper = std::thread([this] { reap(); });
+  }
+
+  // Waits for the operations in flight and in the backlog, the kernel must not
+  // write into the buffers of the requests after they are freed.
+  ~UringIO() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      if (!broken) {
+        submit();
+      }
+    }
+    reaper.join();
+
+    munmap(sqes, sqes_size);
+    if (!single_mmap) {
+      munmap(cq_ring, cq_size);
+    }
+    munmap(sq_ring, sq_size);
+    close(ring_fd);
+  }
+
+  std::future<std::vector<char>>
+  read_file(const std::string &file_path) override {
+    StageScope stage(Stage::read);
+    auto request = std::make_shared<Request>();
+    request->write = false;
+    std::future<std::vector<char>> result =
+        request->read_promise.get_future();
+
+    try {
+      request->fd = open(file_path.c_str(), O_RDONLY);
+      struct stat info;
+      if (request->fd < 0 || fstat(request->fd, &info) != 0) {
+        throw "Failed to open input file.\n";
+      }
+      request->contents.resize(static_cast<size_t>(info.st_size));
+    } catch (...) {
+      if (request->fd >= 0) {
+        close(request->fd);
+      }
+      request->read_promise.set_exception(std::current_exception());
+      return result;
+    }
+
+    begin_transfer(false);
+    for (size_t offset = 0; offset < request->contents.size();
+         offset += operation_size) {
+      request->operations.push_back(
+          {request.get(), request->contents.data() + offset,
+           std::min(operation_size, request->contents.size() - offset),
+           offset});
+    }
+    start(request);
+    return result;
+  }
+
+  std::future<void> write_file(const std::string &file_path,
+                               std::vector<IOSlice> slices,
+                               std::shared_ptr<const void> owner) override {
+    auto request = std::make_shared<Request>();
+    request->write = true;
+    request->owner = std::move(owner);
+    std::future<void> result = request->write_promise.get_future();
+
+    uint64_t size = slices_size(slices);
+    request->path = file_path;
+    request->fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // Without native support the file grows as usual, other errors (e.g. a
+    // full disk) fail before anything is written
+    if (request->fd >= 0 && size > 0 &&
+        fallocate(request->fd, 0, 0, static_cast<off_t>(size)) != 0 &&
+        errno != EOPNOTSUPP) {
+      close(request->fd);
+      unlink(file_path.c_str());
+      request->fd = -1;
+    }
+    if (request->fd < 0) {
+      request->write_promise.set_exception(
+          std::make_exception_ptr("Error creating new file\n"));
+      return result;
+    }
+
+    begin_transfer(true);
+    uint64_t file_offset = 0;
+    for (const auto &slice : slices) {
+      for (size_t offset = 0; offset < slice.size; offset += operation_size) {
+        request->operations.push_back(
+            {request.get(), const_cast<char *>(slice.data) + offset,
+             std::min(operation_size, slice.size - offset),
+             file_offset + offset});
+      }
+      file_offset += slice.size;
+    }
+    start(request);
+    return result;
+  }
+
+  const char *name() const override { return "uring"; }
+
+private:
+  struct Request;
+
+  // A read or write of one contiguous piece of a file
+  struct Operation {
+    Request *request;
+    char *buffer;
+    size_t length;   // Bytes that are still missing
+    uint64_t offset; // Position in the file
+  };
+
+  struct Request {
+    bool write;
+    int fd = -1;
+    std::vector<Operation> operations;
+    size_t pending = 0; // Operations that are not done yet
+    bool failed = false;
+    uint64_t bytes = 0;
+    std::vector<char> contents;          // Buffer of a read
+    std::shared_ptr<const void> owner;   // Memory of a write
+    std::string path;                    // File of a write
+    std::promise<std::vector<char>> read_promise;
+    std::promise<void> write_promise;
+  };
+
+  void start(const std::shared_ptr<Request> &request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    request->pending = request->operations.size();
+    if (broken) {
+      request->failed = true;
+      request->pending = 0;
+    }
+    if (request->pending == 0) {
+      finish(*request);
+      return;
+    }
+    requests.push_back(request);
+    for (auto &operation : request->operations) {
+      backlog.push_back(&operation);
+    }
+    submit();
+  }
+
+  // Moves operations from the backlog into the submission queue. The mutex has
+  // to be held.
+  void submit() {
+    unsigned tail = *sq_tail;
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+
+    auto next_sqe = [&]() {
+      unsigned index = tail & sq_mask;
+      io_uring_sqe *sqe = &sqes[index];
+      std::memset(sqe, 0, sizeof(*sqe));
+      sq_array[index] = index;
+      ++tail;
+      ++count;
+      return sqe;
+    };
+
+    while (!backlog.empty() && in_flight < cq_entries &&
+           tail - head < sq_entries) {
+      Operation *operation = backlog.front();
+      backlog.pop_front();
+
+      io_uring_sqe *sqe = next_sqe();
+      sqe->opcode =
+          operation->request->write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = operation->request->fd;
+      sqe->addr = reinterpret_cast<uint64_t>(operation->buffer);
+      sqe->len = static_cast<uint32_t>(operation->length);
+      sqe->off = operation->offset;
+      sqe->user_data = reinterpret_cast<uint64_t>(operation);
+      ++in_flight;
+    }
+
+    // A no-op without user data tells the reaper to stop
+    if (stopping && !stop_submitted && tail - head < sq_entries) {
+      io_uring_sqe *sqe = next_sqe();
+      sqe->opcode = IORING_OP_NOP;
+      sqe->user_data = 0;
+      stop_submitted = true;
+    }
+
+    if (count == 0) {
+      return;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring_fd, count, 0, 0, nullptr, 0) <
+               0 &&
+           errno == EINTR) {
+    }
+  }
+
+  // Stops after the no-op of the destructor, once no operation is left.
+  void reap() {
+    bool stopped = false;
+    while (true) {
+      if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                  nullptr, 0) < 0 &&
+          errno != EINTR) {
+        std::cerr << "io_uring failed: " << std::strerror(errno) << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        fail_all();
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      unsigned head = *cq_head;
+      unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        io_uring_cqe &cqe = cqes[head & cq_mask];
+        if (cqe.user_data == 0) {
+          stopped = true;
+          continue;
+        }
+        complete(reinterpret_cast<Operation *>(cqe.user_data), cqe.res);
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      if (stopped && in_flight == 0 && backlog.empty()) {
+        return;
+      }
+      submit();
+    }
+  }
+
+  // Fails every request that is not done when the ring stops working, later
+  // requests fail at once. The requests are kept until the ring is closed, as
+  // operations may still be in flight. The mutex has to be held.
+  void fail_all() {
+    broken = true;
+    backlog.clear();
+    for (auto &request : requests) {
+      if (request->pending != 0) {
+        request->pending = 0;
+        request->failed = true;
+        finish(*request);
+      }
+    }
+  }
+
+  // Handles the completion of an operation. The mutex has to be held.
+  void complete(Operation *operation, int result) {
+    --in_flight;
+    Request &request = *operation->request;
+
+    if (result == -EINTR || result == -EAGAIN) {
+      backlog.push_back(operation);
+      return;
+    }
+    if (result <= 0) {
+      request.failed = true;
+    } else if (static_cast<size_t>(result) < operation->length) {
+      // Short transfer, the rest is submitted again
+      operation->buffer += result;
+      operation->length -= static_cast<size_t>(result);
+      operation->offset += static_cast<uint64_t>(result);
+      request.bytes += static_cast<uint64_t>(result);
+      backlog.push_back(operation);
+      return;
+    } else {
+      request.bytes += static_cast<uint64_t>(result);
+    }
+
+    if (--request.pending == 0) {
+      finish(request);
+      requests.erase(std::find_if(
+          requests.begin(), requests.end(),
+          [&](const std::shared_ptr<Request> &r) { return r.get() == &request; }));
+    }
+  }
+
+  void finish(Request &request) {
+    end_transfer(request.write, request.bytes);
+    bool closed = close(request.fd) == 0;
+    if (request.write) {
+      if (request.failed || !closed) {
+        // The file was preallocated, a part of it would be zeros
+        unlink(request.path.c_str());
+        request.write_promise.set_exception(
+            std::make_exception_ptr("Error writing to new file\n"));
+      } else {
+        request.write_promise.set_value();
+      }
+      request.owner.reset();
+    } else {
+      if (request.failed) {
+        request.read_promise.set_exception(
+            std::make_exception_ptr("Error reading the WAV file data.\n"));
+      } else {
+        request.read_promise.set_value(std::move(request.contents));
+      }
+    }
+  }
+
+  int ring_fd = -1;
+  void *sq_ring = nullptr;
+  void *cq_ring = nullptr;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  size_t sqes_size = 0;
+  bool single_mmap = false;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  unsigned cq_entries;
+  io_uring_cqe *cqes;
+
+  std::mutex mutex;
+  std::deque<Operation *> backlog; // Operations waiting for a free entry
+  std::vector<std::shared_ptr<Request>> requests; // Requests in flight
+  unsigned in_flight = 0;
+  bool stopping = false;
+  bool stop_submitted = false;
+  bool broken = false; // The ring failed, no more operations are submitted
+  std::thread reaper;
+};
+
+#endif
+
+std::unique_ptr<AsyncIO> make_async_io(IOBackend backend, bool direct_io) {
+  // The buffers of the io_uring backend are not aligned for direct I/O
+  if (backend == IOBackend::uring && direct_io) {
+    std::cerr << "io_uring does not support direct I/O.\n"
+              << "Falling back to the thread pool.\n";
+    return std::make_unique<ThreadPoolIO>(4, direct_io);
+  }
+
+#ifdef VINYL_HAVE_URING
+  if (backend == IOBackend::uring) {
+    try {
+      return std::make_unique<UringIO>(64);
+    } catch (const char *error) {
+      std::cerr << error << "Falling back to the thread pool.\n";
+    }
+  }
+#else
+  if (backend == IOBackend::uring) {
+    std::cerr << "io_uring is not available.\n"
+              << "Falling back to the thread pool.\n";
+  }
+#endif
+  return std::make_unique<ThreadPoolIO>(4, direct_io);
+}
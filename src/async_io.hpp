@@ -0,0 +1,113 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+#include "filehandler.hpp"
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * The I/O backends for the batch mode
+ */
+enum class IOBackend {
+  sync,    // Read, filter and write one file after the other
+  threads, // pread / pwrite on a pool of threads
+  uring,   // io_uring (Linux only, falls back to threads)
+};
+
+/**
+ * A function that converts the name of a backend from the command line.
+ *
+ * @param[in] name "sync", "threads" or "uring"
+ * @return The backend
+ */
+IOBackend parse_io_backend(const std::string &name);
+
+/**
+ * The amount of data an AsyncIO transferred and the time in which at least
+ * one transfer of the direction was in flight.
+ */
+struct IOStats {
+  uint64_t bytes_read = 0;    // in 1B
+  uint64_t bytes_written = 0; // in 1B
+  double read_seconds = 0;    // in 1s
+  double write_seconds = 0;   // in 1s
+};
+
+/**
+ * A backend that reads and writes whole files in the background, so that the
+ * next files can be loaded and the last results stored while a file is
+ * filtered.
+ */
+class AsyncIO {
+public:
+  virtual ~AsyncIO() = default;
+
+  /**
+   * A function that starts to read a whole file.
+   *
+   * @param[in] file_path The path to the file.
+   * @return The contents of the file once they are read.
+   */
+  virtual std::future<std::vector<char>>
+  read_file(const std::string &file_path) = 0;
+
+  /**
+   * A function that starts to write a new file.
+   *
+   * @param[in] file_path The path of the new file.
+   * @param[in] slices The contents of the file in order.
+   * @param[in] owner Keeps the memory of the slices alive until the write is
+   * done.
+   * @return Becomes ready when the file is written and closed.
+   */
+  virtual std::future<void> write_file(const std::string &file_path,
+                                       std::vector<IOSlice> slices,
+                                       std::shared_ptr<const void> owner) = 0;
+
+  /**
+   * @return The name of the backend for reports.
+   */
+  virtual const char *name() const = 0;
+
+  /**
+   * @return The transferred bytes and the time it took.
+   */
+  IOStats stats() const;
+
+protected:
+  // Called by the backends around every transfer to measure the bandwidth
+  void begin_transfer(bool write);
+  void end_transfer(bool write, uint64_t bytes);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  mutable std::mutex stats_mutex;
+  IOStats totals;
+  int active[2] = {0, 0};      // Transfers in flight (read, write)
+  Clock::time_point since[2];  // Start of the current busy period
+};
+
+/**
+ * A function that creates the I/O backend. If io_uring is not available or
+ * direct I/O is requested the thread pool is used.
+ *
+ * @param[in] backend The requested backend (not sync)
+ * @param[in] direct_io Whether to bypass the page cache
+ * @return The backend
+ */
+std::unique_ptr<AsyncIO> make_async_io(IOBackend backend,
+                                       bool direct_io = false);
+
+/**
+ * A function that prints the bandwidth an AsyncIO achieved (to stderr).
+ *
+ * @param[in] io The backend
+ */
+void output_io_stats(const AsyncIO &io);
+
+#endif
@@ -1,17 +1,143 @@
+#include "async_io.hpp"
+#include "buffer_pool.hpp"
 #include "filehandler.hpp"
 #include "filters.hpp"
+#include "random.hpp"
+#include "sample_format.hpp"
+#include "sample_memory.hpp"
+#include "stage_memory.hpp"
+#include "wav_stream.hpp"
 #include <argparse/argparse.hpp>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <vector>
+
+/**
+ * A function that prints the allocations of every stage since the file was
+ * started, if a report was requested.
+ */
+void output_file_memory_report(const std::string &file,
+                               const Settings &settings) {
+  if (settings.memory_report != StageReportFormat::off) {
+    output_stage_memory_report(file == "-" ? "stdin" : base_name(file),
+                               stage_memory_report(), settings.memory_report);
+  }
+}
+
+/**
+ * A function that checks whether a file can only be read once from the start
+ * (stdin, named pipes and process substitutions).
+ */
+bool is_pipe(const std::string &file) {
+  std::error_code error;
+  return file == "-" || !std::filesystem::is_regular_file(file, error);
+}
+
+/**
+ * A function that returns the name of an input file. Pipes without the
+ * extension of a WAV file (e.g. /dev/fd/63) are named like stdin.
+ */
+std::string input_name(const std::string &file) {
+  if (is_pipe(file) && std::filesystem::path(file).extension() != ".wav") {
+    return "stdin.wav";
+  }
+  return base_name(file);
+}
+
+/**
+ * A function that returns the settings of a file: its noise is keyed by its
+ * name, so every file of a folder gets its own noise.
+ */
+Settings settings_for_file(const Settings &settings, const std::string &file) {
+  Settings keyed = settings;
+  keyed.file_name = input_name(file);
+  return keyed;
+}
+
+void run_stream_procedure(std::string file, std::string output_path,
+                          const Settings &settings) {
+  reset_stage_memory();
+
+  // 64k frames per block keep the buffers at a few MB
+  constexpr size_t block_frames = 1 << 16;
+
+  // "-" reads from stdin / writes to stdout
+  std::string output =
+      output_path == "-"
+          ? output_path
+          : generate_file_name(output_path, input_name(file));
+
+  WavStreamReader reader(file, settings.direct_io);
+  VinylStream vinyl(reader.header(), settings_for_file(settings, file));
+  WavStreamWriter writer(output, vinyl.header(), settings.direct_io);
+
+  // An excerpt only reads the frames it needs
+  reader.seek(vinyl.first_input_frame());
+  writer.start_at(vinyl.first_output_frame());
+
+  const uint16_t channels = reader.header().num_channels;
+  SampleBuffer<float> block(channels, block_frames);
+  SampleBuffer<float> filtered(channels, 0);
+
+  while (!vinyl.done()) {
+    size_t frames = reader.read(block, block_frames);
+    if (frames == 0) {
+      break;
+    }
+    filtered.clear();
+    vinyl.process(block, frames, filtered);
+    writer.write(filtered);
+  }
+
+  filtered.clear();
+  vinyl.finish(filtered);
+  writer.write(filtered);
+  writer.close();
+  output_file_memory_report(file, settings);
+  return;
+}
+
+/**
+ * A function that checks whether filtering a file as a whole would exceed the
+ * memory budget. Only the header of the file is read.
+ */
+bool exceeds_memory_budget(const std::string &file, const Settings &settings,
+                           uint64_t buffered_bytes = 0) {
+  if (settings.memory_budget == 0) {
+    return false;
+  }
+
+  WavStreamReader reader(file);
+  uint64_t working_set = estimate_working_set(reader.header(), settings);
+  if (working_set == unknown_data_size ||
+      working_set + buffered_bytes > settings.memory_budget) {
+    std::cerr << base_name(file) << " exceeds the memory budget ("
+              << (working_set + buffered_bytes) / (1 << 20)
+              << " MiB), it is processed block by block.\n";
+    return true;
+  }
+  return false;
+}
 
 void run_procedure(std::string file, std::string output_path,
                    const Settings &settings) {
-  WAVHeader file_data;
+  if (settings.stream || is_excerpt(settings) || is_pipe(file) ||
+      output_path == "-" || exceeds_memory_budget(file, settings)) {
+    run_stream_procedure(file, output_path, settings);
+    return;
+  }
+
+  reset_stage_memory();
+  std::optional<MappedWAV> input;
   try {
-    file_data = read_wav_file(file);
+    input.emplace(file, settings.direct_io);
   } catch (const std::exception &err) {
     std::cerr << err.what() << std::endl;
     std::exit(1);
@@ -25,25 +151,108 @@ void run_procedure(std::string file, std::string output_path,
     std::exit(1);
   }
 
-  double track_length =
-      calc_audio_length(file_data); // for the shortening later
+  // Apply filters, the needle sounds and the track are written without
+  // concatenating them
+  WAVHeader file_data;
+  Timeline timeline =
+      build_vinyl_timeline(*input, file_data, settings_for_file(settings, file));
 
-  // Apply filters
-  add_crackle_noise(file_data, settings.crackling_noise_lvl);
-  add_pop_click_noise(file_data, settings.general_noise_lvl);
-  limit_bit_depth(file_data, settings.bit_depth);
-  adjust_sampling_rate(file_data, settings.sample_rate);
-  resize_audio(file_data, track_length);
+  // Write the data to a file
+  write_wav_file(file_data, timeline, output, settings.direct_io);
 
-  /*
-   * important to apply the needle sounds after limiting the original audio as
-   * the realworld sounds should not be limited
-   */
-  add_start_needle(file_data, settings.needle_drop_duration);
-  add_end_needle(file_data, settings.needle_lift_duration);
+  // The next file of a folder reuses the buffers
+  local_buffer_pool().release(std::move(file_data.data));
+  output_file_memory_report(file, settings);
+  return;
+}
 
-  // Write the data to a file
-  write_wav_file(file_data, output);
+/**
+ * The output of a file that is written in the background
+ */
+struct PendingOutput {
+  std::unique_ptr<MappedWAV> input; // Kept if the samples were filtered in place
+  WAVHeader wav;
+  std::vector<char> header;
+  EncodedTimeline samples;
+  std::vector<char> trailer;
+};
+
+void run_batch_procedure(const std::vector<std::string> &files,
+                         std::string output_path, const Settings &settings,
+                         IOBackend backend) {
+  // Files that are read ahead / written behind the one that is filtered
+  constexpr size_t queue_depth = 2;
+
+  std::unique_ptr<AsyncIO> io = make_async_io(backend, settings.direct_io);
+  std::deque<std::future<std::vector<char>>> reads;
+  std::deque<std::pair<std::future<void>, std::shared_ptr<PendingOutput>>>
+      writes;
+  size_t next_read = 0;
+
+  // Files that do not fit into the memory budget with their contents are not
+  // read ahead but processed block by block
+  std::vector<bool> block_wise(files.size(), false);
+  for (size_t i = 0; i < files.size(); ++i) {
+    block_wise[i] = exceeds_memory_budget(
+        files[i], settings, std::filesystem::file_size(files[i]));
+  }
+
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string &file = files[i];
+    while (next_read < files.size() && reads.size() <= queue_depth) {
+      reads.push_back(block_wise[next_read]
+                          ? std::future<std::vector<char>>()
+                          : io->read_file(files[next_read]));
+      ++next_read;
+    }
+    std::future<std::vector<char>> read = std::move(reads.front());
+    reads.pop_front();
+    if (block_wise[i]) {
+      run_stream_procedure(file, output_path, settings);
+      continue;
+    }
+    reset_stage_memory();
+    std::vector<char> contents = read.get();
+
+    std::string output = generate_file_name(output_path, base_name(file));
+    auto pending = std::make_shared<PendingOutput>();
+    pending->input = std::make_unique<MappedWAV>(std::move(contents));
+    bool packed = can_filter_packed(pending->input->header(), settings);
+
+    Timeline timeline = build_vinyl_timeline(
+        *pending->input, pending->wav, settings_for_file(settings, file));
+    if (!packed) {
+      pending->input.reset();
+    }
+
+    pending->header = serialize_wav_header(pending->wav);
+    pending->samples = encode_timeline(pending->wav, timeline);
+    pending->trailer = serialize_wav_trailer(pending->wav);
+    local_buffer_pool().release(std::move(pending->wav.data));
+    std::vector<IOSlice> slices = {
+        {pending->header.data(), pending->header.size()}};
+    slices.insert(slices.end(), pending->samples.slices.begin(),
+                  pending->samples.slices.end());
+    slices.push_back({pending->trailer.data(), pending->trailer.size()});
+    writes.emplace_back(io->write_file(output, slices, pending), pending);
+    output_file_memory_report(file, settings);
+
+    // Limit the memory that is held by outputs that are not written yet. The
+    // samples of written files go back to the pool.
+    while (writes.size() > queue_depth) {
+      writes.front().first.get();
+      writes.front().second->samples.release();
+      writes.pop_front();
+    }
+  }
+
+  for (auto &write : writes) {
+    write.first.get();
+    write.second->samples.release();
+  }
+  if (settings.verbose) {
+    output_io_stats(*io);
+  }
   return;
 }
 
@@ -56,10 +265,10 @@ int main(int argc, char *argv[]) {
 
   // Required arguments
   program.add_argument("Sourcepath")
-      .help("The path to the file(s) you want to convert.")
+      .help("The path to the file(s) you want to convert (\"-\" for stdin).")
       .required();
   program.add_argument("Outputpath")
-      .help("The path to the output folder")
+      .help("The path to the output folder (\"-\" for stdout)")
       .required();
 
   // Optional arguments
@@ -73,16 +282,19 @@ int main(int argc, char *argv[]) {
       .nargs(1)
       .default_value(settings.bit_depth)
       .scan<'i', uint16_t>();
+  program.add_argument("-dT", "--dither")
+      .help("Add TPDF dither when the samples are rounded to the bit depth")
+      .flag();
   program.add_argument("-cNL", "--cracklingNoiseLvl")
       .help("The amount of crackling noise you want in 0.01%")
       .nargs(1)
       .default_value(settings.crackling_noise_lvl)
-      .scan<'i', int>();
+      .scan<'i', uint16_t>();
   program.add_argument("-gNL", "--generalNoiseLvl")
       .help("The amount of white noise you want in 0.001%")
       .nargs(1)
       .default_value(settings.general_noise_lvl)
-      .scan<'i', int>();
+      .scan<'i', uint16_t>();
   program.add_argument("-nDD", "--needleDropDuration")
       .help("The duration of the needle sound in 1s (at start of file)")
       .nargs(1)
@@ -93,6 +305,77 @@ int main(int argc, char *argv[]) {
       .nargs(1)
       .default_value(settings.needle_lift_duration)
       .scan<'g', float>();
+  program.add_argument("-rQ", "--resampleQuality")
+      .help("The quality of the resampler: linear, low, medium or high "
+            "(polyphase sinc filters with 32, 64 or 256 taps, half-band "
+            "filters for ratios of 2, 4, 8, ...)")
+      .nargs(1)
+      .default_value(std::string("linear"))
+      .choices("linear", "low", "medium", "high");
+  program.add_argument("-st", "--start")
+      .help("The start of the excerpt that is rendered in 1s (from the start "
+            "of the track)")
+      .nargs(1)
+      .default_value(0.0)
+      .scan<'g', double>();
+  program.add_argument("-du", "--duration")
+      .help("The duration of the excerpt that is rendered in 1s (0 for up to "
+            "the end of the track)")
+      .nargs(1)
+      .default_value(0.0)
+      .scan<'g', double>();
+  program.add_argument("-sd", "--seed")
+      .help("The seed of the noise and the needle sounds, an excerpt has "
+            "the same noise as the complete file with the same seed (0 for a "
+            "random seed)")
+      .nargs(1)
+      .default_value(uint64_t(0))
+      .scan<'i', uint64_t>();
+  program.add_argument("-S", "--stream")
+      .help("Process the file(s) block by block with constant memory")
+      .flag();
+  program.add_argument("-ioB", "--ioBackend")
+      .help("The I/O backend for folders: sync, threads or uring (read ahead "
+            "and write behind while a file is filtered)")
+      .nargs(1)
+      .default_value(std::string("sync"))
+      .choices("sync", "threads", "uring");
+  program.add_argument("-D", "--directIO")
+      .help("Read and write with direct I/O, so that large files do not fill "
+            "the page cache")
+      .flag();
+  program.add_argument("-M", "--memoryBudget")
+      .help("The memory for samples in 1MiB (0 for no limit). Files that need "
+            "more are processed block by block, buffers beyond it are spilled "
+            "to temporary files")
+      .nargs(1)
+      .default_value(uint64_t(0))
+      .scan<'i', uint64_t>();
+  program.add_argument("-P", "--pages")
+      .help("The pages of large sample buffers: normal, thp (transparent huge "
+            "pages) or hugetlb (reserved huge pages)")
+      .nargs(1)
+      .default_value(std::string("normal"))
+      .choices("normal", "thp", "hugetlb");
+  program.add_argument("-N", "--numa")
+      .help("Place large sample buffers on the NUMA node of the thread that "
+            "filters them")
+      .flag();
+  program.add_argument("-mR", "--memoryReport")
+      .help("Print the allocations of every stage for every file (to stderr): "
+            "off, table or json")
+      .nargs(1)
+      .default_value(std::string("off"))
+      .choices("off", "table", "json");
+  program.add_argument("-bK", "--benchmarkKernels")
+      .help("Print how many samples per second the bit depth, resampler and "
+            "random number kernels process with every instruction set of the "
+            "CPU (to stderr)")
+      .flag();
+  program.add_argument("-V", "--verbose")
+      .help("Print where the sample buffers were placed, how many were reused "
+            "and the bandwidth of the I/O backend (to stderr)")
+      .flag();
 
   // Check if arguments where passed correctly
   try {
@@ -113,18 +396,56 @@ int main(int argc, char *argv[]) {
    */
   settings.sample_rate = program.get<uint32_t>("--samples");
   settings.bit_depth = program.get<uint16_t>("--bitDepth");
+  settings.dither = program.get<bool>("--dither");
   settings.crackling_noise_lvl = program.get<uint16_t>("--cracklingNoiseLvl");
   settings.general_noise_lvl = program.get<uint16_t>("--generalNoiseLvl");
   settings.needle_drop_duration = program.get<float>("--needleDropDuration");
   settings.needle_lift_duration = program.get<float>("--needleLiftDuration");
+  settings.resample_quality = parse_resample_quality(
+      program.get<std::string>("--resampleQuality"));
+  settings.start = program.get<double>("--start");
+  settings.duration = program.get<double>("--duration");
+  settings.seed = program.get<uint64_t>("--seed");
+  if (settings.seed == 0) {
+    settings.seed = std::random_device()();
+  }
+  settings.stream = program.get<bool>("--stream");
+  settings.direct_io = program.get<bool>("--directIO");
+  settings.memory_budget = program.get<uint64_t>("--memoryBudget") << 20;
+  settings.memory_report =
+      parse_stage_report_format(program.get<std::string>("--memoryReport"));
+  settings.verbose = program.get<bool>("--verbose");
+  IOBackend backend = parse_io_backend(program.get<std::string>("--ioBackend"));
+
+  SampleMemoryPolicy memory_policy;
+  memory_policy.pages = parse_page_mode(program.get<std::string>("--pages"));
+  memory_policy.numa_local = program.get<bool>("--numa");
+  set_sample_memory_policy(memory_policy);
+  set_sample_memory_budget(settings.memory_budget);
+  if (settings.memory_report != StageReportFormat::off) {
+    enable_stage_memory();
+  }
 
   // Run main logic
   try {
     if (std::filesystem::is_directory(file)) {
+      std::vector<std::string> files;
       for (const auto &entry : std::filesystem::directory_iterator(file)) {
         if (entry.is_regular_file() && entry.path().extension() == ".wav") {
-          run_procedure(entry.path().string(), output_path, settings);
+          files.push_back(entry.path().string());
+        }
+      }
+
+      if (backend == IOBackend::sync || settings.stream ||
+          is_excerpt(settings)) {
+        for (const auto &path : files) {
+          run_procedure(path, output_path, settings);
         }
+      } else {
+        run_batch_procedure(files, output_path, settings, backend);
+      }
+      if (settings.verbose && !settings.stream) {
+        output_pool_stats(local_buffer_pool());
       }
     } else {
       run_procedure(file, output_path, settings);
@@ -133,5 +454,15 @@ int main(int argc, char *argv[]) {
     std::cerr << "Error: " << error << std::endl;
   }
 
+  if (settings.verbose) {
+    std::cerr << "Seed of the noise: " << settings.seed << std::endl;
+    output_sample_memory_stats();
+  }
+  if (program.get<bool>("--benchmarkKernels")) {
+    output_quantizer_benchmark(settings.bit_depth, settings.dither);
+    output_resampler_benchmark();
+    output_random_benchmark();
+  }
+
   return 0;
 }
@@ -0,0 +1,168 @@
+#include "buffer_pool.hpp"
+#include <algorithm>
+#include <iostream>
+
+// Buffers beyond this number are freed, so the pool does not grow without end
+constexpr size_t max_pooled_buffers = 8;
+
+static uint64_t reserved_bytes(const SampleBuffer<float> &buffer) {
+  return static_cast<uint64_t>(buffer.capacity()) * buffer.channels() *
+         sizeof(float);
+}
+
+static uint64_t reserved_bytes(const std::vector<char> &buffer) {
+  return buffer.capacity();
+}
+
+/*
+ * Returns the index of the smallest buffer that fits or else of the largest
+ * buffer (it has to grow) or pool.size() if no buffer is usable
+ */
+template <typename Buffer, typename Usable, typename Capacity>
+static size_t best_fit(const std::vector<Buffer> &pool, size_t needed,
+                       Usable usable, Capacity capacity) {
+  size_t best = pool.size();
+  for (size_t i = 0; i < pool.size(); ++i) {
+    if (!usable(pool[i])) {
+      continue;
+    }
+    if (best == pool.size()) {
+      best = i;
+      continue;
+    }
+
+    size_t current = capacity(pool[i]);
+    size_t chosen = capacity(pool[best]);
+    bool fits = current >= needed;
+    bool chosen_fits = chosen >= needed;
+    if ((fits && (!chosen_fits || current < chosen)) ||
+        (!fits && !chosen_fits && current > chosen)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+template <typename Buffer, typename Capacity>
+static void keep_largest(std::vector<Buffer> &pool, Capacity capacity,
+                         uint64_t &pooled_bytes) {
+  while (pool.size() > max_pooled_buffers) {
+    auto smallest = std::min_element(
+        pool.begin(), pool.end(), [&](const Buffer &a, const Buffer &b) {
+          return capacity(a) < capacity(b);
+        });
+    pooled_bytes -= reserved_bytes(*smallest);
+    pool.erase(smallest);
+  }
+}
+
+void BufferPool::hand_out(uint64_t bytes, bool reused) {
+  ++totals.requests;
+  totals.reused += reused ? 1 : 0;
+  totals.in_use_bytes += bytes;
+  totals.high_water_bytes =
+      std::max(totals.high_water_bytes, totals.in_use_bytes);
+  return;
+}
+
+void BufferPool::take_back(uint64_t bytes) {
+  totals.in_use_bytes -= std::min(totals.in_use_bytes, bytes);
+  totals.pooled_bytes += bytes;
+  return;
+}
+
+SampleBuffer<float> BufferPool::acquire(uint16_t channels, size_t frames) {
+  auto capacity = [](const SampleBuffer<float> &buffer) {
+    return buffer.capacity();
+  };
+  size_t index = best_fit(
+      sample_buffers, frames,
+      [channels](const SampleBuffer<float> &buffer) {
+        return buffer.channels() == channels;
+      },
+      capacity);
+
+  if (index == sample_buffers.size()) {
+    SampleBuffer<float> buffer(channels, 0);
+    buffer.reserve(frames);
+    hand_out(reserved_bytes(buffer), false);
+    return buffer;
+  }
+
+  SampleBuffer<float> buffer = std::move(sample_buffers[index]);
+  sample_buffers.erase(sample_buffers.begin() + index);
+  totals.pooled_bytes -= reserved_bytes(buffer);
+  bool reused = buffer.capacity() >= frames;
+
+  buffer.clear();
+  buffer.reserve(frames);
+  hand_out(reserved_bytes(buffer), reused);
+  return buffer;
+}
+
+std::vector<char> BufferPool::acquire_bytes(size_t size) {
+  auto capacity = [](const std::vector<char> &buffer) {
+    return buffer.capacity();
+  };
+  size_t index = best_fit(
+      byte_buffers, size, [](const std::vector<char> &) { return true; },
+      capacity);
+
+  std::vector<char> buffer;
+  bool reused = false;
+  if (index < byte_buffers.size()) {
+    buffer = std::move(byte_buffers[index]);
+    byte_buffers.erase(byte_buffers.begin() + index);
+    totals.pooled_bytes -= reserved_bytes(buffer);
+    reused = buffer.capacity() >= size;
+  }
+
+  buffer.resize(size);
+  hand_out(reserved_bytes(buffer), reused);
+  return buffer;
+}
+
+void BufferPool::release(SampleBuffer<float> &&buffer) {
+  if (buffer.capacity() == 0) {
+    return;
+  }
+  take_back(reserved_bytes(buffer));
+  sample_buffers.push_back(std::move(buffer));
+  buffer = SampleBuffer<float>();
+  keep_largest(
+      sample_buffers,
+      [](const SampleBuffer<float> &pooled) {
+        return reserved_bytes(pooled);
+      },
+      totals.pooled_bytes);
+  return;
+}
+
+void BufferPool::release(std::vector<char> &&buffer) {
+  if (buffer.capacity() == 0) {
+    return;
+  }
+  take_back(reserved_bytes(buffer));
+  byte_buffers.push_back(std::move(buffer));
+  buffer = std::vector<char>();
+  keep_largest(
+      byte_buffers,
+      [](const std::vector<char> &pooled) { return pooled.capacity(); },
+      totals.pooled_bytes);
+  return;
+}
+
+BufferPool &local_buffer_pool() {
+  thread_local BufferPool pool;
+  return pool;
+}
+
+void output_pool_stats(const BufferPool &pool) {
+  const BufferPoolStats &stats = pool.stats();
+  std::cerr << "Buffers: " << stats.reused << " of " << stats.requests
+            << " requests reused" << std::endl;
+  std::cerr << "Buffer high water mark: "
+            << stats.high_water_bytes / (1 << 20) << " MiB ("
+            << stats.pooled_bytes / (1 << 20) << " MiB pooled)" << std::endl;
+  return;
+}
@@ -0,0 +1,81 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+#include "sample_buffer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The statistics of a BufferPool. Sizes count the reserved memory of the
+ * buffers when they are handed out.
+ */
+struct BufferPoolStats {
+  uint64_t requests = 0;         // Buffers handed out
+  uint64_t reused = 0;           // Requests served without allocating
+  uint64_t in_use_bytes = 0;     // Bytes handed out and not returned yet
+  uint64_t high_water_bytes = 0; // Peak of in_use_bytes
+  uint64_t pooled_bytes = 0;     // Bytes kept in the pool for reuse
+};
+
+/**
+ * A pool of sample and byte buffers that are recycled from one file to the
+ * next. After the first files of a folder the pool holds buffers of the right
+ * size, so filtering further files does not allocate. Every thread has its own
+ * pool (see local_buffer_pool), so no locking is needed.
+ */
+class BufferPool {
+public:
+  /**
+   * A function that returns an empty buffer with memory for at least the
+   * given number of frames. Pooled buffers are preferred.
+   *
+   * @param[in] channels The number of channels.
+   * @param[in] frames The number of frames to reserve memory for.
+   * @return The buffer with 0 frames.
+   */
+  SampleBuffer<float> acquire(uint16_t channels, size_t frames);
+
+  /**
+   * A function that returns a byte buffer of the given size. Pooled buffers
+   * are preferred.
+   *
+   * @param[in] size The size in bytes.
+   * @return The buffer.
+   */
+  std::vector<char> acquire_bytes(size_t size);
+
+  /**
+   * A function that returns a buffer to the pool for later requests.
+   *
+   * @param[in] buffer The buffer (it is empty afterwards).
+   */
+  void release(SampleBuffer<float> &&buffer);
+  void release(std::vector<char> &&buffer);
+
+  /**
+   * @return The statistics of the pool.
+   */
+  const BufferPoolStats &stats() const { return totals; }
+
+private:
+  void hand_out(uint64_t bytes, bool reused);
+  void take_back(uint64_t bytes);
+
+  std::vector<SampleBuffer<float>> sample_buffers;
+  std::vector<std::vector<char>> byte_buffers;
+  BufferPoolStats totals;
+};
+
+/**
+ * @return The buffer pool of the calling thread.
+ */
+BufferPool &local_buffer_pool();
+
+/**
+ * A function that prints the statistics of a buffer pool (to stderr).
+ *
+ * @param[in] pool The pool
+ */
+void output_pool_stats(const BufferPool &pool);
+
+#endif
@@ -1,9 +1,24 @@
 #include "filehandler.hpp"
+#include "buffer_pool.hpp"
+#include "sample_format.hpp"
+#include "stage_memory.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 
+#ifdef VINYL_POSIX_IO
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 void output_wav_data(WAVHeader &wav) {
   std::cout << "RIFF Header: " << std::string(wav.riff_header, 4) << std::endl;
   std::cout << "File Size: " << wav.wav_size << std::endl;
@@ -16,124 +31,926 @@ void output_wav_data(WAVHeader &wav) {
   std::cout << "Byte Rate: " << wav.byte_rate << std::endl;
   std::cout << "Block Align: " << wav.block_align << std::endl;
   std::cout << "Bits Per Sample: " << wav.bits_per_sample << std::endl;
+  if (wav.audio_format == wave_format_extensible) {
+    std::cout << "Valid Bits Per Sample: " << wav.valid_bits_per_sample
+              << std::endl;
+    std::cout << "Channel Mask: " << wav.channel_mask << std::endl;
+    std::cout << "Sub Format: " << wav.sub_format << std::endl;
+  }
   std::cout << "Data Header: " << std::string(wav.data_header, 4) << std::endl;
   std::cout << "Data Size: " << wav.data_size << std::endl;
   return;
 }
 
-WAVHeader read_wav_file(std::string file) {
-  WAVHeader wav;
+// Aligned buffers and direct I/O
+
+AlignedBuffer::AlignedBuffer(size_t size, size_t alignment) : length(size) {
+  // Rounded up as aligned_alloc needs a multiple of the alignment
+  size_t capacity = (std::max<size_t>(size, 1) + alignment - 1) /
+                    alignment * alignment;
+  memory = static_cast<char *>(std::aligned_alloc(alignment, capacity));
+  if (memory == nullptr) {
+    throw "Failed to allocate memory.\n";
+  }
+}
+
+AlignedBuffer::~AlignedBuffer() { std::free(memory); }
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer &&other) noexcept
+    : memory(other.memory), length(other.length) {
+  other.memory = nullptr;
+  other.length = 0;
+}
 
-  // All checks for correct wav file
-  std::ifstream wave_file(file, std::ios::binary);
-  if (!wave_file) {
+AlignedBuffer &AlignedBuffer::operator=(AlignedBuffer &&other) noexcept {
+  if (this != &other) {
+    std::free(memory);
+    memory = other.memory;
+    length = other.length;
+    other.memory = nullptr;
+    other.length = 0;
+  }
+  return *this;
+}
+
+static uint64_t align_up(uint64_t value) {
+  return (value + direct_io_alignment - 1) / direct_io_alignment *
+         direct_io_alignment;
+}
+
+#if defined(VINYL_POSIX_IO) && defined(O_DIRECT)
+// Opens a regular file with O_DIRECT, -1 if that is not supported
+static int open_direct(const std::string &file_path, uint64_t &size) {
+  int fd = open(file_path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    if (errno == EINVAL) {
+      return -1;
+    }
     throw "Failed to open input file.\n";
   }
 
-  wave_file.read(wav.riff_header, 4);
-  if (std::strncmp(wav.riff_header, "RIFF", 4) != 0) {
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  size = static_cast<uint64_t>(info.st_size);
+  return fd;
+}
+
+// Reads aligned blocks up to the end of the buffer or the end of the file
+static size_t read_direct(int fd, char *buffer, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = pread(fd, buffer + done, size - done,
+                          static_cast<off_t>(offset + done));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      throw "Error reading the WAV file data.\n";
+    }
+    if (count == 0) {
+      break;
+    }
+    done += static_cast<size_t>(count);
+  }
+  return done;
+}
+#endif
+
+bool read_file_direct(const std::string &file_path, AlignedBuffer &buffer,
+                      size_t &size) {
+#if defined(VINYL_POSIX_IO) && defined(O_DIRECT)
+  uint64_t file_size = 0;
+  int fd = open_direct(file_path, file_size);
+  if (fd < 0) {
+    return false;
+  }
+
+  // The last request is rounded up, the read then ends at the end of the file
+  constexpr size_t request_size = 8 << 20;
+  try {
+    buffer = AlignedBuffer(static_cast<size_t>(align_up(file_size)),
+                           direct_io_alignment);
+    size_t done = 0;
+    while (done < file_size) {
+      size_t count = read_direct(
+          fd, buffer.data() + done,
+          std::min<size_t>(request_size, buffer.size() - done), done);
+      if (count == 0) {
+        throw "Error reading the WAV file data.\n";
+      }
+      done += count;
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  size = static_cast<size_t>(file_size);
+  return true;
+#else
+  (void)file_path;
+  (void)buffer;
+  (void)size;
+  return false;
+#endif
+}
+
+DirectReadBuf::DirectReadBuf(const std::string &file_path) {
+#if defined(VINYL_POSIX_IO) && defined(O_DIRECT)
+  constexpr size_t block_size = 1 << 20;
+  fd = open_direct(file_path, file_size);
+  if (fd >= 0) {
+    block = AlignedBuffer(block_size, direct_io_alignment);
+    setg(block.data(), block.data(), block.data());
+  }
+#else
+  (void)file_path;
+#endif
+}
+
+DirectReadBuf::~DirectReadBuf() {
+#ifdef VINYL_POSIX_IO
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+}
+
+void DirectReadBuf::fill(uint64_t offset) {
+#if defined(VINYL_POSIX_IO) && defined(O_DIRECT)
+  uint64_t start = offset / direct_io_alignment * direct_io_alignment;
+  size_t count = read_direct(fd, block.data(), block.size(), start);
+  block_offset = start;
+  setg(block.data(),
+       block.data() + std::min<uint64_t>(offset - start, count),
+       block.data() + count);
+#else
+  (void)offset;
+#endif
+}
+
+DirectReadBuf::int_type DirectReadBuf::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  uint64_t next = block_offset + static_cast<uint64_t>(egptr() - eback());
+  if (fd < 0 || next >= file_size) {
+    return traits_type::eof();
+  }
+  fill(next);
+  return gptr() < egptr() ? traits_type::to_int_type(*gptr())
+                          : traits_type::eof();
+}
+
+DirectReadBuf::pos_type DirectReadBuf::seekoff(off_type offset,
+                                               std::ios_base::seekdir direction,
+                                               std::ios_base::openmode mode) {
+  uint64_t current = block_offset + static_cast<uint64_t>(gptr() - eback());
+  uint64_t base = direction == std::ios_base::beg   ? 0
+                  : direction == std::ios_base::cur ? current
+                                                    : file_size;
+  return seekpos(static_cast<off_type>(base) + offset, mode);
+}
+
+DirectReadBuf::pos_type DirectReadBuf::seekpos(pos_type position,
+                                               std::ios_base::openmode mode) {
+  if (fd < 0 || !(mode & std::ios_base::in) || position < 0) {
+    return pos_type(off_type(-1));
+  }
+
+  // Inside the current block only the read pointer moves, otherwise the
+  // block is read on the next access
+  uint64_t target = static_cast<uint64_t>(off_type(position));
+  uint64_t block_end = block_offset + static_cast<uint64_t>(egptr() - eback());
+  if (target >= block_offset && target <= block_end) {
+    setg(eback(), eback() + (target - block_offset), egptr());
+  } else {
+    block_offset = target;
+    setg(block.data(), block.data(), block.data());
+  }
+  return position;
+}
+
+// Parse the header of a wav-file that is completely in memory
+
+// The bytes of the KSDATAFORMAT_SUBTYPE GUIDs after the format code
+static const char ksdataformat_guid_tail[14] = {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, char(0x80),
+    0x00, 0x00, char(0xAA), 0x00, 0x38, char(0x9B), 0x71};
+
+template <typename T>
+static void read_field(const char *bytes, size_t &offset, T &field) {
+  std::memcpy(&field, bytes + offset, sizeof(field));
+  offset += sizeof(field);
+}
+
+void parse_riff_header(const char *bytes, WAVHeader &wav) {
+  size_t offset = 0;
+  std::memcpy(wav.riff_header, bytes, 4);
+  offset += 4;
+  if (std::strncmp(wav.riff_header, "RIFF", 4) != 0 &&
+      std::strncmp(wav.riff_header, "RF64", 4) != 0 &&
+      std::strncmp(wav.riff_header, "BW64", 4) != 0) {
     throw "File seams to be currupted!\n";
   }
 
-  wave_file.read(reinterpret_cast<char *>(&wav.wav_size), sizeof(wav.wav_size));
+  uint32_t wav_size;
+  read_field(bytes, offset, wav_size);
+  wav.wav_size = wav_size;
 
-  wave_file.read(wav.wave_header, 4);
+  std::memcpy(wav.wave_header, bytes + offset, 4);
+  offset += 4;
   if (std::strncmp(wav.wave_header, "WAVE", 4) != 0) {
     throw "Not a valid WAVE file.\n";
   }
+  return;
+}
 
-  wave_file.read(wav.fmt_header, 4);
-  if (std::strncmp(wav.fmt_header, "fmt ", 4) != 0) {
+void parse_wav_chunks(const char *fmt_payload, const char *ds64_payload,
+                      WAVHeader &wav) {
+  const RIFFChunk *fmt = find_riff_chunk(wav.chunks, "fmt ");
+  if (fmt == nullptr) {
     throw "Missing 'fmt ' subchunk.\n";
   }
-
-  wave_file.read(reinterpret_cast<char *>(&wav.fmt_chunk_size),
-                 sizeof(wav.fmt_chunk_size));
-  if (wav.fmt_chunk_size != 16) { // For PCM, the chunk size should be 16
+  std::memcpy(wav.fmt_header, fmt->id, 4);
+  wav.fmt_chunk_size = static_cast<uint32_t>(fmt->size);
+  if (wav.fmt_chunk_size < 16) { // PCM has 16, float 18, EXTENSIBLE 40
     throw "Unexpected fmt chunk size.\n";
   }
 
-  wave_file.read(reinterpret_cast<char *>(&wav.audio_format),
-                 sizeof(wav.audio_format));
-  if (wav.audio_format != 1) {
-    throw "Unsupported audio format (only PCM is supported).\n";
+  size_t offset = 0;
+  read_field(fmt_payload, offset, wav.audio_format);
+  read_field(fmt_payload, offset, wav.num_channels);
+  read_field(fmt_payload, offset, wav.sample_rate);
+  read_field(fmt_payload, offset, wav.byte_rate);
+  read_field(fmt_payload, offset, wav.block_align);
+  read_field(fmt_payload, offset, wav.bits_per_sample);
+
+  // The format code of EXTENSIBLE files are the first bytes of a GUID
+  if (wav.audio_format == wave_format_extensible) {
+    uint16_t extension_size = 0;
+    if (wav.fmt_chunk_size >= 18) {
+      read_field(fmt_payload, offset, extension_size);
+    }
+    if (extension_size < 22 || wav.fmt_chunk_size < 40) {
+      throw "Unexpected fmt chunk size.\n";
+    }
+    read_field(fmt_payload, offset, wav.valid_bits_per_sample);
+    read_field(fmt_payload, offset, wav.channel_mask);
+    read_field(fmt_payload, offset, wav.sub_format);
+    if (std::memcmp(fmt_payload + offset, ksdataformat_guid_tail,
+                    sizeof(ksdataformat_guid_tail)) != 0) {
+      throw "Unsupported audio format (unknown SubFormat GUID).\n";
+    }
   }
+  sample_format_of(wav); // Throws for unsupported formats
 
-  wave_file.read(reinterpret_cast<char *>(&wav.num_channels),
-                 sizeof(wav.num_channels));
-  wave_file.read(reinterpret_cast<char *>(&wav.sample_rate),
-                 sizeof(wav.sample_rate));
-  wave_file.read(reinterpret_cast<char *>(&wav.byte_rate), sizeof(wav.byte_rate));
-  wave_file.read(reinterpret_cast<char *>(&wav.block_align),
-                 sizeof(wav.block_align));
-  wave_file.read(reinterpret_cast<char *>(&wav.bits_per_sample),
-                 sizeof(wav.bits_per_sample));
-  if (wav.byte_rate !=
-      wav.sample_rate * wav.num_channels * wav.bits_per_sample / 8) {
+  if (wav.num_channels == 0) {
+    throw "Number of channels seams to be wrong\n";
+  } else if (wav.byte_rate !=
+             wav.sample_rate * wav.num_channels * wav.bits_per_sample / 8) {
     throw "Byte rate seams to be wrong\n";
   } else if (wav.block_align != wav.num_channels * wav.bits_per_sample / 8) {
     throw "Block align seams to be wrong\n";
   }
 
-  while (!wave_file.eof()) {
-    wave_file.read(wav.data_header, 4);
-    if (std::strncmp(wav.data_header, "data", 4) == 0) {
-      break;
+  const RIFFChunk *data = find_riff_chunk(wav.chunks, "data");
+  if (data == nullptr) {
+    throw "Missing 'data' subchunk.\n";
+  }
+  std::memcpy(wav.data_header, data->id, 4);
+  wav.data_size = data->size;
+
+  // The writer creates its own ds64 chunk and padding
+  const RIFFChunk *ds64 = find_riff_chunk(wav.chunks, "ds64");
+  if (ds64 != nullptr) {
+    wav.wav_size = ds64_payload ? parse_ds64_chunk(ds64_payload, ds64->size)
+                                      .riff_size
+                                : wav.wav_size;
+  }
+  wav.chunks.erase(std::remove_if(wav.chunks.begin(), wav.chunks.end(),
+                                  [](const RIFFChunk &chunk) {
+                                    return is_riff_chunk(chunk, "ds64") ||
+                                           is_riff_chunk(chunk, "JUNK");
+                                  }),
+                   wav.chunks.end());
+  return;
+}
+
+static size_t parse_wav_header(const char *bytes, size_t size,
+                               WAVHeader &wav) {
+  if (size < 12) {
+    throw "File seams to be currupted!\n";
+  }
+
+  parse_riff_header(bytes, wav);
+  wav.chunks = index_riff_chunks(bytes, size);
+
+  const RIFFChunk *fmt = find_riff_chunk(wav.chunks, "fmt ");
+  const RIFFChunk *ds64 = find_riff_chunk(wav.chunks, "ds64");
+  parse_wav_chunks(fmt ? bytes + fmt->offset : nullptr,
+                   ds64 ? bytes + ds64->offset : nullptr, wav);
+
+  // Keep the metadata chunks (LIST, bext, iXML, ...) for the writer
+  for (auto &chunk : wav.chunks) {
+    if (!is_riff_chunk(chunk, "fmt ") && !is_riff_chunk(chunk, "data")) {
+      chunk.payload.assign(bytes + chunk.offset,
+                           bytes + chunk.offset + chunk.size);
     }
-    wave_file.seekg(-3, std::ios_base::cur);
   }
 
-  wave_file.read(reinterpret_cast<char *>(&wav.data_size), sizeof(wav.data_size));
+  return find_riff_chunk(wav.chunks, "data")->offset;
+}
+
+MappedWAV::MappedWAV(const std::string &file, bool direct_io) {
+  StageScope stage(Stage::read);
+  size_t direct_size = 0;
+  if (direct_io && read_file_direct(file, aligned, direct_size)) {
+    bytes = aligned.data();
+    size = direct_size;
+    data_offset = parse_wav_header(bytes, size, wav);
+    return;
+  }
+
+#ifdef VINYL_POSIX_IO
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw "Failed to open input file.\n";
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    // Writable, so that the samples can be filtered in place (copy on write)
+    void *mapping =
+        mmap(nullptr, static_cast<size_t>(info.st_size),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      madvise(mapping, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+      bytes = static_cast<const char *>(mapping);
+      size = static_cast<size_t>(info.st_size);
+      mapped = true;
+    }
+  }
+  close(fd);
+#endif
+
+  // Fallback for pipes and other files that can not be mapped
+  if (!mapped) {
+    std::ifstream wave_file(file, std::ios::binary);
+    if (!wave_file) {
+      throw "Failed to open input file.\n";
+    }
+
+    constexpr size_t chunk_size = 1 << 20;
+    while (wave_file) {
+      size_t used = buffer.size();
+      buffer.resize(used + chunk_size);
+      wave_file.read(buffer.data() + used, chunk_size);
+      buffer.resize(used + static_cast<size_t>(wave_file.gcount()));
+    }
+    bytes = buffer.data();
+    size = buffer.size();
+  }
+
+  try {
+    data_offset = parse_wav_header(bytes, size, wav);
+  } catch (...) {
+    unmap();
+    throw;
+  }
+}
+
+MappedWAV::MappedWAV(std::vector<char> &&contents)
+    : buffer(std::move(contents)) {
+  bytes = buffer.data();
+  size = buffer.size();
+  data_offset = parse_wav_header(bytes, size, wav);
+}
+
+MappedWAV::MappedWAV(const char *contents, size_t contents_size)
+    : bytes(contents), size(contents_size) {
+  data_offset = parse_wav_header(bytes, size, wav);
+}
+
+MappedWAV::~MappedWAV() { unmap(); }
 
-  wav.data.resize(wav.data_size);
-  wave_file.read(reinterpret_cast<char *>(wav.data.data()), wav.data_size);
-  if (!wave_file) {
-    throw "Error reading the WAV file data.\n";
+void MappedWAV::unmap() {
+#ifdef VINYL_POSIX_IO
+  if (mapped) {
+    munmap(const_cast<char *>(bytes), size);
+    mapped = false;
   }
+#endif
+}
+
+char *MappedWAV::writable_samples() {
+  bool owned = mapped || (!buffer.empty() && bytes == buffer.data()) ||
+               (aligned.data() && bytes == aligned.data());
+  return owned ? const_cast<char *>(bytes) + data_offset : nullptr;
+}
+
+WAVView MappedWAV::view() const {
+  WAVView view;
+  view.samples = bytes + data_offset;
+  view.frames = wav.block_align ? wav.data_size / wav.block_align : 0;
+  view.audio_format = wav.audio_format;
+  view.num_channels = wav.num_channels;
+  view.sample_rate = wav.sample_rate;
+  view.block_align = wav.block_align;
+  view.bits_per_sample = wav.bits_per_sample;
+  return view;
+}
+
+WAVHeader read_wav_file(std::string file, bool direct_io) {
+  MappedWAV mapped(file, direct_io);
+  return read_wav_file(mapped);
+}
+
+WAVHeader read_wav_file(const char *bytes, size_t size) {
+  MappedWAV mapped(bytes, size);
+  return read_wav_file(mapped);
+}
 
-  wave_file.close();
+WAVHeader read_wav_file(const MappedWAV &mapped) {
+  StageScope stage(Stage::read);
+  WAVHeader wav = mapped.header();
+  WAVView view = mapped.view();
+
+  // data_size is in bytes, the buffer counts frames of all formats
+  wav.data = local_buffer_pool().acquire(view.num_channels, view.frames);
+  wav.data.resize(view.frames);
+  decode_samples(view.samples, view.frames, sample_format_of(wav), wav.data,
+                 0);
 
   return wav;
 }
 
-void write_wav_file(WAVHeader &wav, std::string filename) {
-  std::ofstream out_file(filename, std::ios::binary);
-  if (!out_file) {
+std::vector<char> encode_wav_data(const WAVHeader &wav) {
+  StageScope stage(Stage::write);
+  SampleFormat format = sample_format_of(wav);
+  std::vector<char> bytes = local_buffer_pool().acquire_bytes(
+      wav.data.size() * bytes_per_sample(format));
+  Quantizer quantizer(format, wav.quantize_bits, wav.dither, wav.dither_key);
+  quantizer.encode(wav.data, 0, wav.data.frames(), bytes.data());
+  return bytes;
+}
+
+void update_data_size(WAVHeader &wav) {
+  wav.data_size = static_cast<uint64_t>(wav.data.frames()) * wav.block_align;
+  update_wav_size(wav);
+  return;
+}
+
+void update_wav_size(WAVHeader &wav) {
+  if (wav.data_size == unknown_data_size) {
+    wav.wav_size = unknown_data_size;
+    return;
+  }
+
+  uint64_t size = 4; // "WAVE"
+  if (wav.chunks.empty()) {
+    size += 8 + riff_padded_size(wav.fmt_chunk_size);
+    size += 8 + riff_padded_size(wav.data_size);
+  }
+  for (const auto &chunk : wav.chunks) {
+    if (is_riff_chunk(chunk, "fmt ")) {
+      size += 8 + riff_padded_size(wav.fmt_chunk_size);
+    } else if (is_riff_chunk(chunk, "data")) {
+      size += 8 + riff_padded_size(wav.data_size);
+    } else {
+      size += 8 + riff_padded_size(chunk.payload.size());
+    }
+  }
+  wav.wav_size = size;
+  return;
+}
+
+// Files with more than 4 GiB need the 64 bit sizes of RF64
+static bool needs_rf64(const WAVHeader &wav) {
+  return wav.data_size >= riff_size_in_ds64 ||
+         wav.wav_size + 8 + ds64_payload_size >= riff_size_in_ds64;
+}
+
+// Serialize the header into one little-endian buffer
+
+static void append_bytes(std::vector<char> &buffer, const char *bytes,
+                         size_t size) {
+  buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+static void append_le(std::vector<char> &buffer, uint64_t value,
+                      size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+static void append_fmt_chunk(std::vector<char> &buffer, const WAVHeader &wav) {
+  append_bytes(buffer, wav.fmt_header, 4);
+  append_le(buffer, wav.fmt_chunk_size, 4);
+  append_le(buffer, wav.audio_format, 2);
+  append_le(buffer, wav.num_channels, 2);
+  append_le(buffer, wav.sample_rate, 4);
+  append_le(buffer, wav.byte_rate, 4);
+  append_le(buffer, wav.block_align, 2);
+  append_le(buffer, wav.bits_per_sample, 2);
+
+  // The extension of float (18 bytes) and EXTENSIBLE (40 bytes) files
+  size_t end = buffer.size() - 16 + wav.fmt_chunk_size;
+  if (wav.fmt_chunk_size >= 18) {
+    append_le(buffer, wav.fmt_chunk_size - 18, 2);
+  }
+  if (wav.audio_format == wave_format_extensible) {
+    append_le(buffer, wav.valid_bits_per_sample, 2);
+    append_le(buffer, wav.channel_mask, 4);
+    append_le(buffer, wav.sub_format, 2);
+    append_bytes(buffer, ksdataformat_guid_tail,
+                 sizeof(ksdataformat_guid_tail));
+  }
+  buffer.resize(end, 0);
+  if (wav.fmt_chunk_size & 1) {
+    buffer.push_back(0);
+  }
+}
+
+static void append_ds64_chunk(std::vector<char> &buffer, const WAVHeader &wav,
+                              bool rf64) {
+  // Without RF64 the space is kept free for a later promotion
+  append_bytes(buffer, rf64 ? "ds64" : "JUNK", 4);
+  append_le(buffer, ds64_payload_size, 4);
+  if (!rf64) {
+    buffer.resize(buffer.size() + ds64_payload_size, 0);
+    return;
+  }
+  append_le(buffer, wav.wav_size + 8 + ds64_payload_size, 8);
+  append_le(buffer, wav.data_size, 8);
+  append_le(buffer, wav.block_align ? wav.data_size / wav.block_align : 0, 8);
+  append_le(buffer, 0, 4); // No table for other chunks
+}
+
+static void append_metadata_chunk(std::vector<char> &buffer,
+                                  const RIFFChunk &chunk) {
+  append_bytes(buffer, chunk.id, 4);
+  append_le(buffer, chunk.payload.size(), 4);
+  append_bytes(buffer, chunk.payload.data(), chunk.payload.size());
+  if (chunk.payload.size() & 1) {
+    buffer.push_back(0);
+  }
+}
+
+std::vector<char> serialize_wav_header(WAVHeader &wav, bool reserve_ds64) {
+  // Streams of unknown length get placeholders that readers take as "up to
+  // the end of the file"
+  bool unknown = wav.data_size == unknown_data_size;
+  bool rf64 = !unknown && needs_rf64(wav);
+  bool with_ds64 = rf64 || reserve_ds64;
+  std::memcpy(wav.riff_header, rf64 ? "RF64" : "RIFF", 4);
+
+  std::vector<char> buffer;
+  buffer.reserve(128);
+
+  // The RIFF header
+  append_bytes(buffer, wav.riff_header, 4);
+  append_le(buffer,
+            rf64 || unknown
+                ? riff_size_in_ds64
+                : wav.wav_size + (with_ds64 ? 8 + ds64_payload_size : 0),
+            4);
+  append_bytes(buffer, wav.wave_header, 4);
+  if (with_ds64) {
+    append_ds64_chunk(buffer, wav, rf64);
+  }
+
+  // The chunks in the order of the index up to the data chunk
+  if (wav.chunks.empty()) {
+    append_fmt_chunk(buffer, wav);
+  }
+  for (const auto &chunk : wav.chunks) {
+    if (is_riff_chunk(chunk, "data")) {
+      break;
+    } else if (is_riff_chunk(chunk, "fmt ")) {
+      append_fmt_chunk(buffer, wav);
+    } else {
+      append_metadata_chunk(buffer, chunk);
+    }
+  }
+
+  append_bytes(buffer, wav.data_header, 4);
+  append_le(buffer, rf64 || unknown ? riff_size_in_ds64 : wav.data_size, 4);
+  return buffer;
+}
+
+std::vector<char> serialize_wav_trailer(const WAVHeader &wav) {
+  std::vector<char> buffer;
+  if (wav.data_size & 1) {
+    buffer.push_back(0);
+  }
+
+  // The chunks that follow the data chunk
+  bool after_data = false;
+  for (const auto &chunk : wav.chunks) {
+    if (is_riff_chunk(chunk, "data")) {
+      after_data = true;
+    } else if (after_data) {
+      append_metadata_chunk(buffer, chunk);
+    }
+  }
+  return buffer;
+}
+
+// Write files with vectored writes
+
+OutputFile::OutputFile(const std::string &file_path, bool direct_io) {
+#ifdef VINYL_POSIX_IO
+#ifdef O_DIRECT
+  // File systems without direct I/O reject O_DIRECT with EINVAL
+  if (direct_io && file_path != "-") {
+    constexpr size_t staging_size = 4 << 20;
+    fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+              0644);
+    if (fd >= 0) {
+      direct = true;
+      staging = AlignedBuffer(staging_size, direct_io_alignment);
+      return;
+    }
+  }
+#else
+  (void)direct_io;
+#endif
+
+  // stdout is duplicated so that closing the file does not close stdout
+  fd = file_path == "-" ? dup(STDOUT_FILENO)
+                        : open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                               0644);
+  if (fd < 0) {
+    throw "Error creating new file\n";
+  }
+#else
+  (void)direct_io;
+  stream = &std::cout;
+  if (file_path != "-") {
+    file.open(file_path, std::ios::binary);
+    stream = &file;
+  }
+  if (!*stream) {
     throw "Error creating new file\n";
   }
+#endif
+}
+
+OutputFile::~OutputFile() {
+#ifdef VINYL_POSIX_IO
+  if (fd >= 0) {
+    ::close(fd);
+  }
+#endif
+}
+
+void OutputFile::preallocate(uint64_t size) {
+#if defined(VINYL_POSIX_IO) && defined(__linux__)
+  // File systems without native support (e.g. NFSv3) and pipes fail with
+  // EOPNOTSUPP or ESPIPE and the file grows as usual. posix_fallocate would
+  // write a byte into every block instead, which doubles the traffic.
+  if (size > 0 && fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) {
+    allocated = size;
+  }
+#else
+  (void)size;
+#endif
+}
+
+#ifdef VINYL_POSIX_IO
+static void write_all_at(int fd, const char *data, size_t size,
+                         uint64_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw "Error writing to new file\n";
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+    offset += static_cast<uint64_t>(written);
+  }
+}
+
+void OutputFile::stage(const char *data, size_t size) {
+  // Full staging buffers are aligned in memory, size and file offset
+  while (size > 0) {
+    size_t count = std::min(size, staging.size() - staged);
+    std::memcpy(staging.data() + staged, data, count);
+    staged += count;
+    data += count;
+    size -= count;
+    position += count;
+
+    if (staged == staging.size()) {
+      write_all_at(fd, staging.data(), staged, flushed);
+      flushed += staged;
+      staged = 0;
+    }
+  }
+}
+
+void OutputFile::finish_direct() {
+  if (!direct) {
+    return;
+  }
 
-  // Write the WAV file header
-  out_file.write(wav.riff_header, 4);
-  out_file.write(reinterpret_cast<char *>(&wav.wav_size), sizeof(wav.wav_size));
-  out_file.write(wav.wave_header, 4);
-  out_file.write(wav.fmt_header, 4);
-  out_file.write(reinterpret_cast<char *>(&wav.fmt_chunk_size),
-                 sizeof(wav.fmt_chunk_size));
-  out_file.write(reinterpret_cast<char *>(&wav.audio_format),
-                 sizeof(wav.audio_format));
-  out_file.write(reinterpret_cast<char *>(&wav.num_channels),
-                 sizeof(wav.num_channels));
-  out_file.write(reinterpret_cast<char *>(&wav.sample_rate),
-                 sizeof(wav.sample_rate));
-  out_file.write(reinterpret_cast<char *>(&wav.byte_rate), sizeof(wav.byte_rate));
-  out_file.write(reinterpret_cast<char *>(&wav.block_align),
-                 sizeof(wav.block_align));
-  out_file.write(reinterpret_cast<char *>(&wav.bits_per_sample),
-                 sizeof(wav.bits_per_sample));
-  out_file.write(wav.data_header, 4);
-  out_file.write(reinterpret_cast<char *>(&wav.data_size), sizeof(wav.data_size));
-
-  // Write the audio data
-  out_file.write(reinterpret_cast<char *>(wav.data.data()), wav.data_size);
-
-  if (!out_file) {
+  // The aligned part is written with direct I/O, the tail without
+  size_t aligned_size = staged / direct_io_alignment * direct_io_alignment;
+  write_all_at(fd, staging.data(), aligned_size, flushed);
+  flushed += aligned_size;
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0) {
     throw "Error writing to new file\n";
   }
+  write_all_at(fd, staging.data() + aligned_size, staged - aligned_size,
+               flushed);
+  flushed += staged - aligned_size;
+  staged = 0;
+  direct = false;
+  staging = AlignedBuffer();
 
-  out_file.close();
-  if (!out_file) {
+  // Later writes append with writev
+  if (lseek(fd, static_cast<off_t>(position), SEEK_SET) < 0) {
+    throw "Error writing to new file\n";
+  }
+}
+#endif
+
+void OutputFile::write(const std::vector<IOSlice> &slices) {
+#ifdef VINYL_POSIX_IO
+  if (direct) {
+    for (const auto &slice : slices) {
+      stage(slice.data, slice.size);
+    }
+    return;
+  }
+
+  std::vector<struct iovec> vectors;
+  vectors.reserve(slices.size());
+  for (const auto &slice : slices) {
+    if (slice.size > 0) {
+      vectors.push_back({const_cast<char *>(slice.data), slice.size});
+    }
+  }
+
+  // writev may write less than requested and takes at most IOV_MAX vectors
+  size_t first = 0;
+  while (first < vectors.size()) {
+    int count = static_cast<int>(std::min<size_t>(vectors.size() - first,
+                                                  IOV_MAX));
+    ssize_t written = writev(fd, vectors.data() + first, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw "Error writing to new file\n";
+    }
+    position += static_cast<uint64_t>(written);
+
+    size_t remaining = static_cast<size_t>(written);
+    while (first < vectors.size() && remaining >= vectors[first].iov_len) {
+      remaining -= vectors[first].iov_len;
+      ++first;
+    }
+    if (remaining > 0) {
+      vectors[first].iov_base =
+          static_cast<char *>(vectors[first].iov_base) + remaining;
+      vectors[first].iov_len -= remaining;
+    }
+  }
+#else
+  for (const auto &slice : slices) {
+    stream->write(slice.data, static_cast<std::streamsize>(slice.size));
+    position += slice.size;
+  }
+  if (!*stream) {
+    throw "Error writing to new file\n";
+  }
+#endif
+}
+
+void OutputFile::write_at(uint64_t offset, const char *data, size_t size) {
+#ifdef VINYL_POSIX_IO
+  // The staged data has to be in the file before it is overwritten
+  finish_direct();
+  write_all_at(fd, data, size, offset);
+#else
+  file.seekp(static_cast<std::streamoff>(offset));
+  file.write(data, static_cast<std::streamsize>(size));
+  file.seekp(static_cast<std::streamoff>(position));
+  if (!file) {
+    throw "Error writing to new file\n";
+  }
+#endif
+}
+
+void OutputFile::close() {
+#ifdef VINYL_POSIX_IO
+  if (fd < 0) {
+    return;
+  }
+  finish_direct();
+
+  // Drop the preallocated space that was not used
+  if (allocated > position &&
+      ftruncate(fd, static_cast<off_t>(position)) != 0) {
+    throw "Error closing new file\n";
+  }
+  int result = ::close(fd);
+  fd = -1;
+  if (result != 0) {
+    throw "Error closing new file\n";
+  }
+#else
+  stream->flush();
+  if (file.is_open()) {
+    file.close();
+  }
+  if (!*stream) {
     throw "Error closing new file\n";
   }
+#endif
+}
+
+bool OutputFile::seekable() const {
+#ifdef VINYL_POSIX_IO
+  struct stat info;
+  return fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+#else
+  return stream == &file;
+#endif
+}
+
+void write_wav_file(WAVHeader &wav, std::string filename, bool direct_io) {
+  StageScope stage(Stage::write);
+  OutputFile out_file(filename, direct_io);
+
+  update_wav_size(wav);
+  std::vector<char> header = serialize_wav_header(wav);
+  std::vector<char> samples = encode_wav_data(wav);
+  std::vector<char> trailer = serialize_wav_trailer(wav);
+
+  // Header, samples and trailing chunks in one system call
+  out_file.preallocate(header.size() + samples.size() + trailer.size());
+  out_file.write({{header.data(), header.size()},
+                  {samples.data(), samples.size()},
+                  {trailer.data(), trailer.size()}});
+  out_file.close();
+  local_buffer_pool().release(std::move(samples));
+  return;
+}
+
+// The sizes of a file in memory follow the samples that are encoded, not the
+// data size of the header, which the caller may not have updated.
+static void update_memory_file_size(WAVHeader &wav) {
+  if (wav.data_size == unknown_data_size) {
+    throw "The size of the WAV file is unknown\n";
+  }
+  update_data_size(wav);
+  return;
+}
+
+uint64_t wav_file_size(WAVHeader &wav) {
+  update_memory_file_size(wav);
+  return serialize_wav_header(wav).size() + wav.data_size +
+         serialize_wav_trailer(wav).size();
+}
+
+size_t write_wav_file(WAVHeader &wav, char *buffer, size_t capacity) {
+  StageScope stage(Stage::write);
+  update_memory_file_size(wav);
+  std::vector<char> header = serialize_wav_header(wav);
+  std::vector<char> trailer = serialize_wav_trailer(wav);
+
+  uint64_t size = header.size() + wav.data_size + trailer.size();
+  if (size > capacity) {
+    throw "The buffer is too small for the WAV file\n";
+  }
+
+  // The samples are encoded directly into the buffer
+  std::memcpy(buffer, header.data(), header.size());
+  Quantizer quantizer(sample_format_of(wav), wav.quantize_bits, wav.dither,
+                      wav.dither_key);
+  quantizer.encode(wav.data, 0, wav.data.frames(), buffer + header.size());
+  std::memcpy(buffer + header.size() + wav.data_size, trailer.data(),
+              trailer.size());
+  return static_cast<size_t>(size);
+}
+
+void write_wav_file(WAVHeader &wav, std::vector<char> &buffer) {
+  StageScope stage(Stage::write);
+  size_t used = buffer.size();
+  buffer.resize(used + wav_file_size(wav));
+  write_wav_file(wav, buffer.data() + used, buffer.size() - used);
   return;
 }
 
@@ -1,28 +1,295 @@
 #ifndef FILEHANDLER_H
 #define FILEHANDLER_H
+#include "riff.hpp"
+#include "sample_buffer.hpp"
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <streambuf>
 #include <string>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define VINYL_POSIX_IO 1 // mmap, file descriptors etc. are available
+#endif
+
+/**
+ * The data_size of a stream whose length is not known in advance
+ */
+constexpr uint64_t unknown_data_size = UINT64_MAX;
+
+/**
+ * The alignment of buffers, file offsets and sizes for direct I/O
+ */
+constexpr size_t direct_io_alignment = 4096;
+
+/**
+ * The format codes of the fmt chunk
+ */
+constexpr uint16_t wave_format_pcm = 0x0001;        // Integer samples
+constexpr uint16_t wave_format_ieee_float = 0x0003; // Float samples
+constexpr uint16_t wave_format_extensible = 0xFFFE; // Code in sub_format
+
 /**
  * A struct that can hold the data of a wav-file
  */
 struct WAVHeader {
-  char riff_header[4];       // "RIFF"
-  uint32_t wav_size;         // Size of the WAV file
+  char riff_header[4];       // "RIFF" (or "RF64" for files > 4 GiB)
+  uint64_t wav_size;         // Size of the WAV file (without ds64 chunk)
   char wave_header[4];       // "WAVE"
   char fmt_header[4];        // "fmt "
   uint32_t fmt_chunk_size;   // Size of the fmt chunk
-  uint16_t audio_format;     // Audio format (1 = PCM)
+  uint16_t audio_format;     // Audio format (1 = PCM, 3 = float)
   uint16_t num_channels;     // Number of channels
   uint32_t sample_rate;      // Sample rate
   uint32_t byte_rate;        // Byte rate
   uint16_t block_align;      // Block align
   uint16_t bits_per_sample;  // Bits per sample
+  uint16_t valid_bits_per_sample = 0; // EXTENSIBLE: Bits used of a sample
+  uint32_t channel_mask = 0;          // EXTENSIBLE: Speaker positions
+  uint16_t sub_format = 0;            // EXTENSIBLE: Format code of the GUID
   char data_header[4];       // "data"
-  uint32_t data_size;        // Size of the data section
-  std::vector<int16_t> data; // The actual data
+  uint64_t data_size;        // Size of the data section (encoded)
+  SampleBuffer<float> data;  // Planar samples, 1.0 is full scale
+  uint16_t quantize_bits = 0; // Bits kept on writing (0: all of the format)
+  bool dither = false;        // Whether to dither on writing
+  uint64_t dither_key = 0;    // The key of the dither (see random_key)
+  std::vector<RIFFChunk> chunks; // Index of all chunks in file order
+};
+
+/**
+ * A read-only view of the sample payload of a wav-file. The samples stay
+ * interleaved and in the byte layout of the file.
+ */
+struct WAVView {
+  const char *samples;      // Pointer to the first byte of the first sample
+  size_t frames;            // Number of frames (one sample per channel)
+  uint16_t audio_format;    // Audio format (1 = PCM)
+  uint16_t num_channels;    // Number of channels
+  uint32_t sample_rate;     // Sample rate
+  uint16_t block_align;     // Bytes per frame
+  uint16_t bits_per_sample; // Bits per sample
+};
+
+/**
+ * A buffer whose start is aligned, e.g. for direct I/O. It can only be moved.
+ */
+class AlignedBuffer {
+public:
+  AlignedBuffer() = default;
+
+  /**
+   * @param[in] size The size of the buffer in bytes.
+   * @param[in] alignment The alignment of the start (a power of two).
+   */
+  AlignedBuffer(size_t size, size_t alignment);
+  ~AlignedBuffer();
+
+  AlignedBuffer(AlignedBuffer &&other) noexcept;
+  AlignedBuffer &operator=(AlignedBuffer &&other) noexcept;
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+  char *data() const { return memory; }
+  size_t size() const { return length; }
+
+private:
+  char *memory = nullptr;
+  size_t length = 0;
+};
+
+/**
+ * A function that reads a whole file with direct I/O, so that it does not
+ * stay in the page cache.
+ *
+ * @param[in] file_path The path to the file.
+ * @param[out] buffer The buffer that receives the file (its size is rounded up
+ * to direct_io_alignment).
+ * @param[out] size The size of the file in bytes.
+ * @return false if the file or its file system does not support direct I/O.
+ */
+bool read_file_direct(const std::string &file_path, AlignedBuffer &buffer,
+                      size_t &size);
+
+/**
+ * A stream buffer that reads a file with direct I/O in aligned blocks. It
+ * supports seeking, so it can be used with an istream instead of an ifstream.
+ */
+class DirectReadBuf : public std::streambuf {
+public:
+  /**
+   * @param[in] file_path The path to the file.
+   */
+  explicit DirectReadBuf(const std::string &file_path);
+  ~DirectReadBuf() override;
+
+  DirectReadBuf(const DirectReadBuf &) = delete;
+  DirectReadBuf &operator=(const DirectReadBuf &) = delete;
+
+  /**
+   * @return false if the file or its file system does not support direct I/O.
+   */
+  bool is_open() const { return fd >= 0; }
+
+protected:
+  int_type underflow() override;
+  pos_type seekoff(off_type offset, std::ios_base::seekdir direction,
+                   std::ios_base::openmode mode) override;
+  pos_type seekpos(pos_type position, std::ios_base::openmode mode) override;
+
+private:
+  void fill(uint64_t offset);
+
+  int fd = -1;
+  uint64_t file_size = 0;
+  AlignedBuffer block;           // The block that is read at the moment
+  uint64_t block_offset = 0;     // Position of the block in the file
+};
+
+/**
+ * A wav-file that is mapped into memory. The header is parsed in place and the
+ * samples can be accessed without copying them. Regular files are mapped with
+ * mmap, everything else (pipes, devices or systems without mmap) is read into a
+ * buffer.
+ */
+class MappedWAV {
+public:
+  /**
+   * @param[in] file_path The path to the audiofile.
+   * @param[in] direct_io Whether to read the file with direct I/O into a
+   * buffer instead of mapping it through the page cache.
+   */
+  explicit MappedWAV(const std::string &file_path, bool direct_io = false);
+
+  /**
+   * @param[in] contents The contents of a wav-file that was already read.
+   */
+  explicit MappedWAV(std::vector<char> &&contents);
+
+  /**
+   * @param[in] bytes The contents of a wav-file in memory. They are not
+   * copied and have to outlive the MappedWAV.
+   * @param[in] size The size of the contents in bytes.
+   */
+  MappedWAV(const char *bytes, size_t size);
+  ~MappedWAV();
+
+  MappedWAV(const MappedWAV &) = delete;
+  MappedWAV &operator=(const MappedWAV &) = delete;
+
+  /**
+   * @return The parsed header (the data buffer stays empty).
+   */
+  const WAVHeader &header() const { return wav; }
+
+  /**
+   * @return A view of the sample payload.
+   */
+  WAVView view() const;
+
+  /**
+   * @return The first byte of the sample payload to change it in place, or
+   * nullptr if the contents belong to the caller. Changes of a mapped file are
+   * private to the process and not written back.
+   */
+  char *writable_samples();
+
+  /**
+   * @return true if the file is mapped, false if it was read into a buffer.
+   */
+  bool is_mapped() const { return mapped; }
+
+private:
+  void unmap();
+
+  const char *bytes = nullptr; // Start of the file contents
+  size_t size = 0;             // Size of the file contents in bytes
+  bool mapped = false;         // Whether bytes points into a mapping
+  std::vector<char> buffer;    // The file contents if it is not mapped
+  AlignedBuffer aligned;       // The file contents if read with direct I/O
+  size_t data_offset = 0;      // Offset of the first sample
+  WAVHeader wav;
+};
+
+/**
+ * A piece of memory that is written together with others in one system call
+ */
+struct IOSlice {
+  const char *data; // Start of the memory
+  size_t size;      // Size in bytes
+};
+
+/**
+ * A new file that is written with vectored writes. On POSIX systems the file
+ * is preallocated and written with writev / pwrite, elsewhere an ofstream is
+ * used. With direct I/O the data is collected in an aligned buffer and written
+ * in aligned blocks, the unaligned tail is written without direct I/O on
+ * close.
+ */
+class OutputFile {
+public:
+  /**
+   * @param[in] file_path The path of the new file ("-" for stdout).
+   * @param[in] direct_io Whether to bypass the page cache (if the file system
+   * supports it).
+   */
+  explicit OutputFile(const std::string &file_path, bool direct_io = false);
+  ~OutputFile();
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  /**
+   * A function that reserves space for the file so that large files are not
+   * fragmented (only on Linux and file systems that support it natively).
+   *
+   * @param[in] size The expected size of the file in bytes.
+   */
+  void preallocate(uint64_t size);
+
+  /**
+   * A function that appends the slices to the file in one system call.
+   *
+   * @param[in] slices The memory to write.
+   */
+  void write(const std::vector<IOSlice> &slices);
+
+  /**
+   * A function that overwrites a part of the file that was already written.
+   *
+   * @param[in] offset The position in the file.
+   * @param[in] data The bytes to write.
+   * @param[in] size The number of bytes.
+   */
+  void write_at(uint64_t offset, const char *data, size_t size);
+
+  /**
+   * A function that removes unused preallocated space and closes the file.
+   */
+  void close();
+
+  /**
+   * @return false for pipes, where write_at is not possible.
+   */
+  bool seekable() const;
+
+private:
+#ifdef VINYL_POSIX_IO
+  void stage(const char *data, size_t size);
+  void finish_direct();
+
+  int fd = -1;
+  bool direct = false;  // Whether fd was opened with O_DIRECT
+  AlignedBuffer staging; // Data that is not written yet (direct I/O)
+  size_t staged = 0;     // Bytes used of staging
+  uint64_t flushed = 0;  // Bytes written from staging
+#else
+  std::ofstream file;
+  std::ostream *stream; // file or stdout
+#endif
+  uint64_t position = 0;  // Bytes written with write()
+  uint64_t allocated = 0; // Bytes reserved with preallocate()
 };
 
 /**
@@ -36,18 +303,140 @@ void output_wav_data(WAVHeader &wav);
  * A function that outputs the data of the WAVHeader
  *
  * @param[in] file_path The path to the audiofile.
+ * @param[in] direct_io Whether to bypass the page cache.
  * @return wav The audio file written into the WAVHeader
  * struct.
  */
-WAVHeader read_wav_file(std::string file_path);
+WAVHeader read_wav_file(std::string file_path, bool direct_io = false);
+
+/**
+ * A function that copies the samples of a mapped file into a WAVHeader.
+ *
+ * @param[in] mapped The mapped audiofile.
+ * @return wav The audio file written into the WAVHeader struct.
+ */
+WAVHeader read_wav_file(const MappedWAV &mapped);
+
+/**
+ * A function that parses a wav-file that is already in memory (e.g. an upload)
+ * without touching the file system.
+ *
+ * @param[in] bytes The contents of the wav-file.
+ * @param[in] size The size of the contents in bytes.
+ * @return wav The audio file written into the WAVHeader struct.
+ */
+WAVHeader read_wav_file(const char *bytes, size_t size);
+
+/**
+ * A function that parses and checks the first 12 bytes of a wav-file ("RIFF",
+ * size, "WAVE").
+ *
+ * @param[in] bytes The first 12 bytes of the file.
+ * @param[out] wav The WAVHeader struct that receives the values.
+ */
+void parse_riff_header(const char *bytes, WAVHeader &wav);
+
+/**
+ * A function that fills the format and data size of the WAVHeader from its
+ * chunk index. The ds64 and JUNK chunks are removed from the index as the
+ * writer creates its own.
+ *
+ * @param[in] fmt_payload The payload of the fmt chunk.
+ * @param[in] ds64_payload The payload of the ds64 chunk or nullptr.
+ * @param[out] wav The WAVHeader struct with a filled chunk index.
+ */
+void parse_wav_chunks(const char *fmt_payload, const char *ds64_payload,
+                      WAVHeader &wav);
+
+/**
+ * A function that encodes the samples of the WAVHeader into the byte layout of
+ * its format. The samples are rounded to quantize_bits (with dither if set).
+ * The buffer is taken from the local_buffer_pool and can be returned to it.
+ *
+ * @param[in] wav The audiofile written into the WAVHeader struct.
+ * @return The encoded samples (data_size bytes).
+ */
+std::vector<char> encode_wav_data(const WAVHeader &wav);
+
+/**
+ * A function that serializes everything in front of the samples into one
+ * little-endian buffer: the RIFF header, the fmt chunk, the metadata chunks in
+ * front of the data chunk and the header of the data chunk. Files larger than
+ * 4 GiB are written as RF64 with a ds64 chunk.
+ *
+ * @param[in] wav The audiofile written into the WAVHeader struct.
+ * @param[in] reserve_ds64 Whether to keep space for a ds64 chunk (as JUNK
+ * chunk) so that the header can be promoted to RF64 later without moving the
+ * samples.
+ * @return The serialized header.
+ */
+std::vector<char> serialize_wav_header(WAVHeader &wav,
+                                       bool reserve_ds64 = false);
+
+/**
+ * A function that serializes everything after the samples: the pad byte of the
+ * data chunk and the metadata chunks that follow it.
+ *
+ * @param[in] wav The audiofile written into the WAVHeader struct.
+ * @return The serialized trailer.
+ */
+std::vector<char> serialize_wav_trailer(const WAVHeader &wav);
+
+/**
+ * A function that recalculates the data size from the frames in the data
+ * buffer and then the RIFF size.
+ *
+ * @param[out] wav The audiofile written into the WAVHeader struct.
+ */
+void update_data_size(WAVHeader &wav);
+
+/**
+ * A function that recalculates the RIFF size from the chunk index, the fmt
+ * chunk and the data size.
+ *
+ * @param[out] wav The audiofile written into the WAVHeader struct.
+ */
+void update_wav_size(WAVHeader &wav);
 
 /**
  * A function that writes the audiodata to a new wav file.
  *
  * @param[in] header The audiofile written into the WAVHeader struct.
  * @param[in] filename The name of the new file.
+ * @param[in] direct_io Whether to bypass the page cache.
+ */
+void write_wav_file(WAVHeader &header, std::string filename,
+                    bool direct_io = false);
+
+/**
+ * A function that returns the size of the wav-file write_wav_file would
+ * create, so that a buffer of the right size can be provided. The data size
+ * is updated from the samples, an unknown data size throws.
+ *
+ * @param[in] header The audiofile written into the WAVHeader struct.
+ * @return The size of the file in bytes.
+ */
+uint64_t wav_file_size(WAVHeader &header);
+
+/**
+ * A function that writes the audiodata as wav-file into a buffer of the
+ * caller. The data size is updated from the samples, an unknown data size
+ * throws.
+ *
+ * @param[in] header The audiofile written into the WAVHeader struct.
+ * @param[out] buffer The memory for the file.
+ * @param[in] capacity The size of the buffer in bytes.
+ * @return The number of bytes written.
+ */
+size_t write_wav_file(WAVHeader &header, char *buffer, size_t capacity);
+
+/**
+ * A function that appends the audiodata as wav-file to a buffer.
+ *
+ * @param[in] header The audiofile written into the WAVHeader struct.
+ * @param[out] buffer The buffer the file is appended to.
  */
-void write_wav_file(WAVHeader &header, std::string filename);
+void write_wav_file(WAVHeader &header, std::vector<char> &buffer);
 
 /**
  * A function that returns the file name of a given path with the given
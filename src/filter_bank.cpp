@@ -0,0 +1,448 @@
+#include "filter_bank.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The AVX2 and AVX-512 kernels are compiled for them and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VINYL_HAVE_X86_DISPATCH 1
+#endif
+
+// Ratios with more phases (e.g. 44.1kHz to 47.999kHz) interpolate between
+// this many rows
+constexpr size_t max_phases = 1024;
+
+/**
+ * The parameters of a quality
+ */
+struct FilterPreset {
+  size_t taps;   // Coefficients per row when upsampling
+  double beta;   // Of the Kaiser window
+  double cutoff; // Middle of the transition band (1.0: Nyquist)
+};
+
+ResampleQuality parse_resample_quality(const std::string &name) {
+  if (name == "linear") {
+    return ResampleQuality::linear;
+  } else if (name == "low") {
+    return ResampleQuality::low;
+  } else if (name == "medium") {
+    return ResampleQuality::medium;
+  } else if (name == "high") {
+    return ResampleQuality::high;
+  }
+  throw "Unknown resample quality (use linear, low, medium or high).\n";
+}
+
+// The transition band ends at the Nyquist frequency of the lower rate
+static FilterPreset filter_preset(ResampleQuality quality) {
+  switch (quality) {
+  case ResampleQuality::low:
+    return {32, 6.0, 0.87};
+  case ResampleQuality::medium:
+    return {64, 8.6, 0.91};
+  case ResampleQuality::high:
+  default:
+    return {256, 13.0, 0.96};
+  }
+}
+
+// The modified Bessel function of the first kind of order 0
+static double bessel_i0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 64 && term > sum * 1e-17; ++k) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+static std::shared_ptr<const FilterBank>
+design_filter_bank(uint64_t up, uint64_t down, ResampleQuality quality) {
+  const FilterPreset preset = filter_preset(quality);
+  const double pi = 3.14159265358979323846;
+
+  // Downsampling cuts at the Nyquist frequency of the output, so the filter
+  // gets longer by the same factor to keep the width of the transition band
+  const double scale = std::min(1.0, static_cast<double>(up) / down);
+  const double cutoff = preset.cutoff * scale;
+  size_t taps = static_cast<size_t>(std::ceil(preset.taps / scale));
+  taps = (taps + 15) / 16 * 16;
+  const double half = static_cast<double>(taps / 2);
+
+  auto bank = std::make_shared<FilterBank>();
+  bank->taps = taps;
+  bank->phases = static_cast<size_t>(std::min<uint64_t>(up, max_phases));
+  bank->coefficients.resize((bank->phases + 1) * taps);
+
+  const double window_norm = bessel_i0(preset.beta);
+  std::vector<double> row(taps);
+  for (size_t phase = 0; phase <= bank->phases; ++phase) {
+    const double fraction = static_cast<double>(phase) / bank->phases;
+    double sum = 0.0;
+    for (size_t j = 0; j < taps; ++j) {
+      // The distance of the tap to the position in input frames
+      double x = static_cast<double>(j) - (half - 1.0) - fraction;
+      double ratio = x / half;
+      double window =
+          std::abs(ratio) >= 1.0
+              ? 0.0
+              : bessel_i0(preset.beta * std::sqrt(1.0 - ratio * ratio)) /
+                    window_norm;
+      double sinc = x == 0.0 ? 1.0
+                             : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+      row[j] = cutoff * sinc * window;
+      sum += row[j];
+    }
+    float *target = bank->coefficients.data() + phase * taps;
+    for (size_t j = 0; j < taps; ++j) {
+      target[j] = static_cast<float>(row[j] / sum);
+    }
+  }
+  return bank;
+}
+
+std::shared_ptr<const FilterBank> filter_bank(uint64_t up, uint64_t down,
+                                              ResampleQuality quality) {
+  static std::mutex mutex;
+  static std::map<std::tuple<uint64_t, uint64_t, ResampleQuality>,
+                  std::shared_ptr<const FilterBank>>
+      banks;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &bank = banks[std::make_tuple(up, down, quality)];
+  if (!bank) {
+    bank = design_filter_bank(up, down, quality);
+  }
+  return bank;
+}
+
+static std::shared_ptr<const HalfBandFilter>
+design_half_band_filter(ResampleQuality quality) {
+  const FilterPreset preset = filter_preset(quality);
+  const double pi = 3.14159265358979323846;
+
+  // The sinc filter that halves the rate has 2 * taps taps, which span the
+  // distances up to taps on both sides
+  auto filter = std::make_shared<HalfBandFilter>();
+  filter->k = preset.taps / 2;
+  const double half = static_cast<double>(2 * filter->k);
+  const double window_norm = bessel_i0(preset.beta);
+
+  std::vector<double> taps(filter->k);
+  double sum = 0.0;
+  for (size_t i = 1; i <= filter->k; ++i) {
+    double x = static_cast<double>(2 * i - 1);
+    double ratio = x / half;
+    double window =
+        bessel_i0(preset.beta * std::sqrt(1.0 - ratio * ratio)) / window_norm;
+    taps[i - 1] = std::sin(pi * x / 2.0) / (pi * x) * window;
+    sum += taps[i - 1];
+  }
+
+  // A gain of 1: the centre (0.5) and the taps on both sides
+  for (size_t i = 0; i < filter->k; ++i) {
+    double tap = taps[i] * 0.25 / sum;
+    filter->coefficients.push_back(static_cast<float>(tap));
+    filter->interpolation.push_back(static_cast<float>(2.0 * tap));
+  }
+  return filter;
+}
+
+std::shared_ptr<const HalfBandFilter>
+half_band_filter(ResampleQuality quality) {
+  static std::mutex mutex;
+  static std::map<ResampleQuality, std::shared_ptr<const HalfBandFilter>>
+      filters;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &filter = filters[quality];
+  if (!filter) {
+    filter = design_half_band_filter(quality);
+  }
+  return filter;
+}
+
+// Half-band kernels: the vectors hold neighbouring output frames, so every
+// output frame sums its taps in the same order as the scalar kernel
+
+static void decimate_scalar(const float *even, const float *odd,
+                            const float *coefficients, size_t k, size_t count,
+                            float *out) {
+  for (size_t j = 0; j < count; ++j) {
+    float sum = 0.f;
+    for (size_t i = 1; i <= k; ++i) {
+      sum += coefficients[i - 1] * (*(odd + j + i - 1) + *(odd + j - i));
+    }
+    out[j] = 0.5f * even[j] + sum;
+  }
+}
+
+static void interpolate_scalar(const float *samples, const float *coefficients,
+                               size_t k, size_t count, float *out) {
+  for (size_t j = 0; j < count; ++j) {
+    float sum = 0.f;
+    for (size_t i = 1; i <= k; ++i) {
+      sum +=
+          coefficients[i - 1] * (*(samples + j + i) + *(samples + j + 1 - i));
+    }
+    out[j] = sum;
+  }
+}
+
+#if defined(__SSE2__)
+static void decimate_sse2(const float *even, const float *odd,
+                          const float *coefficients, size_t k, size_t count,
+                          float *out) {
+  const __m128 centre = _mm_set1_ps(0.5f);
+  size_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    __m128 sum = _mm_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m128 pair = _mm_add_ps(_mm_loadu_ps(odd + j + i - 1),
+                               _mm_loadu_ps(odd + j - i));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm_storeu_ps(out + j,
+                  _mm_add_ps(_mm_mul_ps(centre, _mm_loadu_ps(even + j)), sum));
+  }
+  decimate_scalar(even + j, odd + j, coefficients, k, count - j, out + j);
+}
+
+static void interpolate_sse2(const float *samples, const float *coefficients,
+                             size_t k, size_t count, float *out) {
+  size_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    __m128 sum = _mm_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m128 pair = _mm_add_ps(_mm_loadu_ps(samples + j + i),
+                               _mm_loadu_ps(samples + j + 1 - i));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm_storeu_ps(out + j, sum);
+  }
+  interpolate_scalar(samples + j, coefficients, k, count - j, out + j);
+}
+#endif
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+__attribute__((target("avx2"))) static void
+decimate_avx2(const float *even, const float *odd, const float *coefficients,
+              size_t k, size_t count, float *out) {
+  const __m256 centre = _mm256_set1_ps(0.5f);
+  size_t j = 0;
+  for (; j + 8 <= count; j += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m256 pair = _mm256_add_ps(_mm256_loadu_ps(odd + j + i - 1),
+                                  _mm256_loadu_ps(odd + j - i));
+      sum = _mm256_add_ps(
+          sum, _mm256_mul_ps(_mm256_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm256_storeu_ps(
+        out + j,
+        _mm256_add_ps(_mm256_mul_ps(centre, _mm256_loadu_ps(even + j)), sum));
+  }
+  _mm256_zeroupper();
+  decimate_scalar(even + j, odd + j, coefficients, k, count - j, out + j);
+}
+
+__attribute__((target("avx2"))) static void
+interpolate_avx2(const float *samples, const float *coefficients, size_t k,
+                 size_t count, float *out) {
+  size_t j = 0;
+  for (; j + 8 <= count; j += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m256 pair = _mm256_add_ps(_mm256_loadu_ps(samples + j + i),
+                                  _mm256_loadu_ps(samples + j + 1 - i));
+      sum = _mm256_add_ps(
+          sum, _mm256_mul_ps(_mm256_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm256_storeu_ps(out + j, sum);
+  }
+  _mm256_zeroupper();
+  interpolate_scalar(samples + j, coefficients, k, count - j, out + j);
+}
+
+__attribute__((target("avx512f"))) static void
+decimate_avx512(const float *even, const float *odd, const float *coefficients,
+                size_t k, size_t count, float *out) {
+  const __m512 centre = _mm512_set1_ps(0.5f);
+  size_t j = 0;
+  for (; j + 16 <= count; j += 16) {
+    __m512 sum = _mm512_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m512 pair = _mm512_add_ps(_mm512_loadu_ps(odd + j + i - 1),
+                                  _mm512_loadu_ps(odd + j - i));
+      sum = _mm512_add_ps(
+          sum, _mm512_mul_ps(_mm512_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm512_storeu_ps(
+        out + j,
+        _mm512_add_ps(_mm512_mul_ps(centre, _mm512_loadu_ps(even + j)), sum));
+  }
+  _mm256_zeroupper();
+  decimate_scalar(even + j, odd + j, coefficients, k, count - j, out + j);
+}
+
+__attribute__((target("avx512f"))) static void
+interpolate_avx512(const float *samples, const float *coefficients, size_t k,
+                   size_t count, float *out) {
+  size_t j = 0;
+  for (; j + 16 <= count; j += 16) {
+    __m512 sum = _mm512_setzero_ps();
+    for (size_t i = 1; i <= k; ++i) {
+      __m512 pair = _mm512_add_ps(_mm512_loadu_ps(samples + j + i),
+                                  _mm512_loadu_ps(samples + j + 1 - i));
+      sum = _mm512_add_ps(
+          sum, _mm512_mul_ps(_mm512_set1_ps(coefficients[i - 1]), pair));
+    }
+    _mm512_storeu_ps(out + j, sum);
+  }
+  _mm256_zeroupper();
+  interpolate_scalar(samples + j, coefficients, k, count - j, out + j);
+}
+#endif
+
+DecimateKernel decimate_kernel(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return decimate_sse2;
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return decimate_avx2;
+  case InstructionSet::avx512:
+    return decimate_avx512;
+#endif
+  default:
+    return decimate_scalar;
+  }
+}
+
+InterpolateKernel interpolate_kernel(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return interpolate_sse2;
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return interpolate_avx2;
+  case InstructionSet::avx512:
+    return interpolate_avx512;
+#endif
+  default:
+    return interpolate_scalar;
+  }
+}
+
+// Dot product kernels: 16 partial sums, lane k sums the products k, k + 16,
+// ... in order. They are added pairwise (k + 8, k + 4, k + 2, k + 1), which
+// is what the SIMD kernels do with their registers.
+
+static float dot_scalar(const float *samples, const float *coefficients,
+                        size_t taps) {
+  float sums[16] = {};
+  for (size_t i = 0; i < taps; i += 16) {
+    for (size_t k = 0; k < 16; ++k) {
+      sums[k] += samples[i + k] * coefficients[i + k];
+    }
+  }
+  for (size_t width = 8; width > 0; width /= 2) {
+    for (size_t k = 0; k < width; ++k) {
+      sums[k] += sums[k + width];
+    }
+  }
+  return sums[0];
+}
+
+#if defined(__SSE2__)
+static float dot_sse2(const float *samples, const float *coefficients,
+                      size_t taps) {
+  __m128 sums[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(),
+                    _mm_setzero_ps()};
+  for (size_t i = 0; i < taps; i += 16) {
+    for (size_t k = 0; k < 4; ++k) {
+      sums[k] = _mm_add_ps(sums[k],
+                           _mm_mul_ps(_mm_loadu_ps(samples + i + 4 * k),
+                                      _mm_loadu_ps(coefficients + i + 4 * k)));
+    }
+  }
+  __m128 sum = _mm_add_ps(_mm_add_ps(sums[0], sums[2]),
+                          _mm_add_ps(sums[1], sums[3]));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+#endif
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+__attribute__((target("avx2"))) static float
+dot_avx2(const float *samples, const float *coefficients, size_t taps) {
+  __m256 low = _mm256_setzero_ps();
+  __m256 high = _mm256_setzero_ps();
+  for (size_t i = 0; i < taps; i += 16) {
+    low = _mm256_add_ps(low, _mm256_mul_ps(_mm256_loadu_ps(samples + i),
+                                           _mm256_loadu_ps(coefficients + i)));
+    high = _mm256_add_ps(
+        high, _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8),
+                            _mm256_loadu_ps(coefficients + i + 8)));
+  }
+  __m256 sum8 = _mm256_add_ps(low, high);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8),
+                          _mm256_extractf128_ps(sum8, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  float result = _mm_cvtss_f32(sum);
+  _mm256_zeroupper();
+  return result;
+}
+
+__attribute__((target("avx512f"))) static float
+dot_avx512(const float *samples, const float *coefficients, size_t taps) {
+  __m512 sums = _mm512_setzero_ps();
+  for (size_t i = 0; i < taps; i += 16) {
+    sums = _mm512_add_ps(sums, _mm512_mul_ps(_mm512_loadu_ps(samples + i),
+                                             _mm512_loadu_ps(coefficients + i)));
+  }
+  __m256 low = _mm512_castps512_ps256(sums);
+  __m256 high =
+      _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(sums), 1));
+  __m256 sum8 = _mm256_add_ps(low, high);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8),
+                          _mm256_extractf128_ps(sum8, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  float result = _mm_cvtss_f32(sum);
+  _mm256_zeroupper();
+  return result;
+}
+#endif
+
+DotKernel dot_kernel(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return dot_sse2;
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return dot_avx2;
+  case InstructionSet::avx512:
+    return dot_avx512;
+#endif
+  default:
+    return dot_scalar;
+  }
+}
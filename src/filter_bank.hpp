@@ -0,0 +1,130 @@
+#ifndef FILTER_BANK_H
+#define FILTER_BANK_H
+#include "sample_buffer.hpp"
+#include "sample_format.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * The quality of the resampler: linear interpolation or a Kaiser windowed
+ * sinc filter. Longer filters keep more of the high frequencies and let less
+ * aliasing through, but cost more time.
+ */
+enum class ResampleQuality {
+  linear, // Interpolates between the two neighbouring frames
+  low,    // 32 taps, beta 6 (about 60dB stopband, passband to 0.75 Nyquist)
+  medium, // 64 taps, beta 8.6 (about 85dB, passband to 0.83 Nyquist)
+  high,   // 256 taps, beta 13 (about 125dB, passband to 0.92 Nyquist)
+};
+
+/**
+ * A function that converts the name of a quality from the command line.
+ *
+ * @param[in] name "linear", "low", "medium" or "high"
+ * @return The quality
+ */
+ResampleQuality parse_resample_quality(const std::string &name);
+
+/**
+ * The coefficients of a polyphase filter: one row of taps per phase, the
+ * output frame at the input position n + p / phases is the dot product of
+ * row p with the input frames [n - taps / 2 + 1, n + taps / 2]. Every row is
+ * normalised to a gain of 1. There is one more row for the phase 1, so the
+ * rows around a position between two phases can be interpolated.
+ */
+struct FilterBank {
+  size_t taps;   // Coefficients per row (a multiple of 16)
+  size_t phases; // Rows (without the extra row)
+  std::vector<float, AlignedAllocator<float>> coefficients; // Row by row
+
+  /**
+   * @param[in] phase The index of the row.
+   * @return The coefficients of the row.
+   */
+  const float *row(size_t phase) const {
+    return coefficients.data() + phase * taps;
+  }
+};
+
+/**
+ * A function that returns the filter bank for a ratio of sample rates. The
+ * banks are designed once and shared by all threads.
+ *
+ * @param[in] up The new sample rate divided by the gcd of both rates
+ * @param[in] down The old sample rate divided by the gcd of both rates
+ * @param[in] quality The quality (not linear)
+ * @return The filter bank
+ */
+std::shared_ptr<const FilterBank> filter_bank(uint64_t up, uint64_t down,
+                                              ResampleQuality quality);
+
+/**
+ * A half-band filter for halving or doubling the sample rate. Its transition
+ * band is centred on the Nyquist frequency of the lower rate, so every other
+ * tap is zero and the filter is symmetric: only the taps at the odd distances
+ * 1, 3, ..., 2k - 1 from the centre are stored, the centre is 0.5.
+ */
+struct HalfBandFilter {
+  size_t k;                         // Taps on each side of the centre
+  std::vector<float> coefficients;  // For halving the rate
+  std::vector<float> interpolation; // For doubling it (twice the above)
+};
+
+/**
+ * A function that returns the half-band filter of a quality, with as many
+ * taps at the higher rate as the sinc filter of the quality has when it
+ * halves the rate. The filters are designed once and shared by all threads.
+ *
+ * @param[in] quality The quality (not linear)
+ * @return The filter
+ */
+std::shared_ptr<const HalfBandFilter> half_band_filter(ResampleQuality quality);
+
+/**
+ * A kernel that halves the rate: out[j] = 0.5 * even[j] + the sum of
+ * coefficients[i - 1] * (odd[j + i - 1] + odd[j - i]) for i = 1 ... k, where
+ * even and odd are the even and odd input frames around the centres.
+ */
+using DecimateKernel = void (*)(const float *even, const float *odd,
+                                const float *coefficients, size_t k,
+                                size_t count, float *out);
+
+/**
+ * A kernel that computes the frames between the input frames when the rate
+ * is doubled: out[j] = the sum of coefficients[i - 1] * (samples[j + i] +
+ * samples[j - i + 1]) for i = 1 ... k.
+ */
+using InterpolateKernel = void (*)(const float *samples,
+                                   const float *coefficients, size_t k,
+                                   size_t count, float *out);
+
+/**
+ * @param[in] set The instruction set (supported by the CPU).
+ * @return The kernel that halves the rate.
+ */
+DecimateKernel decimate_kernel(InstructionSet set);
+
+/**
+ * @param[in] set The instruction set (supported by the CPU).
+ * @return The kernel that doubles the rate.
+ */
+InterpolateKernel interpolate_kernel(InstructionSet set);
+
+/**
+ * A dot product of taps samples with taps coefficients (a multiple of 16).
+ * The products are summed in the same order with every instruction set, so
+ * they return the same result.
+ */
+using DotKernel = float (*)(const float *samples, const float *coefficients,
+                            size_t taps);
+
+/**
+ * @param[in] set The instruction set (supported by the CPU).
+ * @return The dot product kernel of the instruction set.
+ */
+DotKernel dot_kernel(InstructionSet set);
+
+#endif
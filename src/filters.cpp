@@ -1,13 +1,35 @@
+#include "filters.hpp"
+#include "buffer_pool.hpp"
 #include "filehandler.hpp"
+#include "random.hpp"
+#include "sample_format.hpp"
+#include "stage_memory.hpp"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <iomanip>
 #include <iostream>
-#include <random>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <tuple>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The AVX2 and AVX-512 kernels are compiled for them and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VINYL_HAVE_X86_DISPATCH 1
+#endif
+
 // Limit bit depth (same as dynamic limiting the dynamic range)
 
 void limit_bit_depth(WAVHeader &audio, const uint16_t &new_bit_depth) {
+  StageScope stage(Stage::bit_depth);
   // 16; 24; 32Bit possible
   // resize instead of limit????
   if (new_bit_depth > audio.bits_per_sample) {
@@ -15,20 +37,655 @@ void limit_bit_depth(WAVHeader &audio, const uint16_t &new_bit_depth) {
     return;
   }
 
-  uint16_t original_bit_depth = audio.bits_per_sample;
-  int bit_depth_difference = original_bit_depth - new_bit_depth;
-  int max_value = (1 << (new_bit_depth - 1)) - 1;
-  int min_value = -(1 << (new_bit_depth - 1));
+  // The Quantizer rounds to the new bit depth when the file is written
+  audio.quantize_bits = new_bit_depth;
+
+  return;
+}
+
+// Adjust samping rate
+
+// The positions of the output frames are computed in pieces that stay in the
+// cache, every piece is then interpolated channel by channel
+constexpr size_t resample_piece = 2048;
+
+// Starts the half-band cascade at the input frame first (a multiple of down),
+// with silence in front of it. A stage that halves the rate keeps 2k frames in
+// front of the centre of its next output frame, one that doubles it k frames
+// in front of its next input frame.
+static void start_stages(ResamplerState &state, uint64_t first) {
+  const int64_t k = static_cast<int64_t>(state.half_band->k);
+  const int64_t lookbehind = state.up > 1 ? k : 2 * k;
+  uint64_t frame = first;
+  for (HalfBandStage &stage : state.stages) {
+    stage.origin = static_cast<int64_t>(frame) - lookbehind;
+    stage.pending.assign(state.num_channels,
+                         std::vector<float>(lookbehind, 0.f));
+    stage.next = state.up > 1 ? frame : frame / 2;
+    frame = state.up > 1 ? frame * 2 : frame / 2;
+  }
+}
+
+ResamplerState::ResamplerState(const uint32_t &old_sample_rate,
+                               const uint32_t &new_sample_rate,
+                               const uint16_t &num_channels,
+                               ResampleQuality quality)
+    : old_sample_rate(old_sample_rate), new_sample_rate(new_sample_rate),
+      num_channels(num_channels), kernels(best_instruction_set()) {
+  uint64_t divisor = std::gcd(old_sample_rate, new_sample_rate);
+  up = divisor ? new_sample_rate / divisor : 1;
+  down = divisor ? old_sample_rate / divisor : 1;
+
+  // Ratios of 2^n (e.g. 96kHz to 48kHz) are halved or doubled n times, a
+  // half-band filter needs about a quarter of the work of the sinc filter
+  uint64_t ratio = up * down;
+  if (quality != ResampleQuality::linear && up != down &&
+      (up == 1 || down == 1) && (ratio & (ratio - 1)) == 0) {
+    half_band = half_band_filter(quality);
+    for (; ratio > 1; ratio /= 2) {
+      stages.emplace_back();
+    }
+    start_stages(*this, 0);
+    return;
+  }
+
+  if (quality != ResampleQuality::linear && up != down) {
+    bank = filter_bank(up, down, quality);
+    return;
+  }
+
+  // The positions repeat every up output frames (down input frames), e.g.
+  // 160 for 44.1kHz to 48kHz. Small periods are computed once.
+  if (up > 1 && up <= resample_piece) {
+    size_t size = resample_piece / up * up;
+    period_offsets.resize(size);
+    period_fractions.resize(size);
+    for (size_t k = 0; k < size; ++k) {
+      period_offsets[k] = static_cast<int32_t>(k * down / up);
+      period_fractions[k] = static_cast<float>(k * down % up * (1.0 / up));
+    }
+  }
+}
+
+void ResamplerState::seek(uint64_t output_frame) {
+  // output_frame * down / up without overflowing
+  output_frames = output_frame;
+  position = output_frame / up * down + output_frame % up * down / up;
+  phase = output_frame % up * down % up;
+  last_frame.clear();
+  history.clear();
+
+  // The cascade starts early enough that the frames in front of the input do
+  // not reach the output frame, the output frames before it are dropped
+  if (half_band) {
+    const uint64_t k = half_band->k;
+    uint64_t lookbehind = up > 1 ? 2 * k : (2 * k - 1) * (down - 1);
+    uint64_t first = position - std::min(position, lookbehind);
+    first = first / down * down;
+    start_stages(*this, first);
+    input_frames = first;
+    skip = output_frame - first * up / down;
+    return;
+  }
+
+  // The sinc filter starts taps / 2 - 1 frames in front of the position
+  input_frames = position;
+  if (bank) {
+    input_frames -= std::min<uint64_t>(position, bank->taps / 2 - 1);
+  }
+}
+
+// The number of output frames in front of an input frame: the frames j with
+// j * down < frame * up
+static uint64_t outputs_before(const ResamplerState &state, uint64_t frame) {
+  return frame / state.down * state.up +
+         (frame % state.down * state.up + state.down - 1) / state.down;
+}
+
+// Moves the position to the next output frame, step and step_phase are
+// down / up and down % up
+static inline void advance_position(ResamplerState &state, uint64_t step,
+                                    uint64_t step_phase) {
+  state.position += step;
+  state.phase += step_phase;
+  if (state.phase >= state.up) {
+    state.phase -= state.up;
+    ++state.position;
+  }
+}
+
+static void keep_last_frame(ResamplerState &state,
+                            const SampleBuffer<float> &samples,
+                            size_t frames) {
+  state.last_frame.resize(state.num_channels);
+  for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+    state.last_frame[channel] = samples(channel, frames - 1);
+  }
+}
+
+// Interpolation kernels: out[i] is between in[offsets[i]] and the frame after
+// it. The offsets and fractions are computed once for all channels. Like the
+// Quantizer kernels they return the same samples for every instruction set.
+
+using LerpKernel = void (*)(const float *in, const int32_t *offsets,
+                            const float *fractions, size_t count, float *out);
+
+static void lerp_scalar(const float *in, const int32_t *offsets,
+                        const float *fractions, size_t count, float *out) {
+  for (size_t i = 0; i < count; ++i) {
+    float a = in[offsets[i]];
+    float b = in[offsets[i] + 1];
+    out[i] = a + fractions[i] * (b - a);
+  }
+}
+
+#if defined(__SSE2__)
+static void lerp_sse2(const float *in, const int32_t *offsets,
+                      const float *fractions, size_t count, float *out) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const int32_t *o = offsets + i;
+    __m128 a = _mm_setr_ps(in[o[0]], in[o[1]], in[o[2]], in[o[3]]);
+    __m128 b =
+        _mm_setr_ps(in[o[0] + 1], in[o[1] + 1], in[o[2] + 1], in[o[3] + 1]);
+    __m128 f = _mm_loadu_ps(fractions + i);
+    _mm_storeu_ps(out + i, _mm_add_ps(a, _mm_mul_ps(f, _mm_sub_ps(b, a))));
+  }
+  lerp_scalar(in, offsets + i, fractions + i, count - i, out + i);
+}
+#endif
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+__attribute__((target("avx2"))) static void
+lerp_avx2(const float *in, const int32_t *offsets, const float *fractions,
+          size_t count, float *out) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i o =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(offsets + i));
+    __m256 a = _mm256_i32gather_ps(in, o, 4);
+    __m256 b = _mm256_i32gather_ps(in + 1, o, 4);
+    __m256 f = _mm256_loadu_ps(fractions + i);
+    _mm256_storeu_ps(out + i,
+                     _mm256_add_ps(a, _mm256_mul_ps(f, _mm256_sub_ps(b, a))));
+  }
+  _mm256_zeroupper();
+  lerp_scalar(in, offsets + i, fractions + i, count - i, out + i);
+}
+
+__attribute__((target("avx512f"))) static void
+lerp_avx512(const float *in, const int32_t *offsets, const float *fractions,
+            size_t count, float *out) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i o = _mm512_loadu_si512(offsets + i);
+    __m512 a = _mm512_i32gather_ps(o, in, 4);
+    __m512 b = _mm512_i32gather_ps(o, in + 1, 4);
+    __m512 f = _mm512_loadu_ps(fractions + i);
+    _mm512_storeu_ps(out + i,
+                     _mm512_add_ps(a, _mm512_mul_ps(f, _mm512_sub_ps(b, a))));
+  }
+  _mm256_zeroupper();
+  lerp_scalar(in, offsets + i, fractions + i, count - i, out + i);
+}
+#endif
+
+static LerpKernel lerp_kernel(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return lerp_sse2;
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return lerp_avx2;
+  case InstructionSet::avx512:
+    return lerp_avx512;
+#endif
+  default:
+    return lerp_scalar;
+  }
+}
+
+static void resample_frames(ResamplerState &state,
+                            const SampleBuffer<float> &samples, uint64_t first,
+                            size_t count, SampleBuffer<float> &out,
+                            size_t out_first, LerpKernel lerp) {
+  const uint64_t step = state.down / state.up;
+  const uint64_t step_phase = state.down % state.up;
+  const double inverse_up = 1.0 / static_cast<double>(state.up);
+  const size_t period = state.period_offsets.size();
+  int32_t offsets[resample_piece];
+  float fractions[resample_piece];
+
+  for (size_t done = 0; done < count;) {
+    const uint64_t base = state.position;
+    const int32_t *piece_offsets = offsets;
+    const float *piece_fractions = fractions;
+    size_t n = std::min(resample_piece, count - done);
+    if (period > 0 && state.phase == 0 && n >= period) {
+      n = period;
+      piece_offsets = state.period_offsets.data();
+      piece_fractions = state.period_fractions.data();
+      state.position += n / state.up * state.down;
+    } else {
+      // Up to the start of the next period, so the table can be used again
+      if (period > 0) {
+        n = std::min<size_t>(n, state.up - state.output_frames % state.up);
+      }
+      for (size_t i = 0; i < n; ++i) {
+        offsets[i] = static_cast<int32_t>(state.position - base);
+        fractions[i] = static_cast<float>(state.phase * inverse_up);
+        advance_position(state, step, step_phase);
+      }
+    }
+
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      lerp(samples.channel(channel) + (base - first), piece_offsets,
+           piece_fractions, n, out.channel(channel) + out_first + done);
+    }
+    done += n;
+    state.output_frames += n;
+  }
+}
+
+// The sinc filter: an output frame at the position n needs the input frames
+// [n - taps / 2 + 1, n + taps / 2]. The frames in front of the block are kept
+// in the history, so the first output frames of a block are filtered from a
+// buffer that joins the history and the start of the block.
+
+// Filters count output frames from the planes of all channels, planes[c][0]
+// is the input frame origin
+static void filter_frames(ResamplerState &state, const float *const *planes,
+                          int64_t origin, size_t count,
+                          SampleBuffer<float> &out, size_t out_first) {
+  const FilterBank &bank = *state.bank;
+  const int64_t half = static_cast<int64_t>(bank.taps / 2);
+  const uint64_t step = state.down / state.up;
+  const uint64_t step_phase = state.down % state.up;
+  const bool exact = bank.phases == state.up;
+  const DotKernel dot = dot_kernel(state.kernels);
+  int32_t offsets[resample_piece];
+  uint32_t rows[resample_piece];
+  float fractions[resample_piece];
+
+  for (size_t done = 0; done < count; done += resample_piece) {
+    size_t n = std::min(resample_piece, count - done);
+    const uint64_t base = state.position;
+    for (size_t i = 0; i < n; ++i) {
+      offsets[i] = static_cast<int32_t>(state.position - base);
+      if (exact) {
+        rows[i] = static_cast<uint32_t>(state.phase);
+      } else {
+        // Between two rows of the bank
+        uint64_t scaled = state.phase * bank.phases;
+        rows[i] = static_cast<uint32_t>(scaled / state.up);
+        fractions[i] = static_cast<float>(
+            static_cast<double>(scaled % state.up) / state.up);
+      }
+      advance_position(state, step, step_phase);
+    }
+
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      const float *in =
+          planes[channel] + (static_cast<int64_t>(base) - half + 1 - origin);
+      float *target = out.channel(channel) + out_first + done;
+      for (size_t i = 0; i < n; ++i) {
+        const float *window = in + offsets[i];
+        float value = dot(window, bank.row(rows[i]), bank.taps);
+        if (!exact) {
+          float next = dot(window, bank.row(rows[i] + 1), bank.taps);
+          value = value + fractions[i] * (next - value);
+        }
+        target[i] = value;
+      }
+    }
+    state.output_frames += n;
+  }
+}
+
+// Filters the block and at most max_frames output frames
+static void filter_block(ResamplerState &state,
+                         const SampleBuffer<float> &samples, size_t frames,
+                         SampleBuffer<float> &out, uint64_t max_frames) {
+  const size_t taps = state.bank->taps;
+  const uint64_t half = taps / 2;
+  const uint64_t first = state.input_frames;
+  const uint64_t end = first + frames;
+  auto pending = [&](uint64_t frame) {
+    uint64_t before = outputs_before(state, frame);
+    return before - std::min(before, state.output_frames);
+  };
+
+  // The output frames whose window ends in the block, the first of them start
+  // in front of it
+  size_t count = static_cast<size_t>(
+      std::min(end >= half ? pending(end - half) : 0, max_frames));
+  size_t edge = std::min<size_t>(count, pending(first + half - 1));
+  size_t out_first = out.frames();
+  out.resize(out_first + count);
+
+  // The history and the start of the block, one after the other
+  const size_t head = std::min<size_t>(frames, taps);
+  if (state.history.empty()) {
+    state.history.assign(state.num_channels * taps, 0.f);
+  }
+  thread_local std::vector<float> joined;
+  joined.resize(state.num_channels * (taps + head));
+  std::vector<const float *> planes(state.num_channels);
+  for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+    float *target = joined.data() + channel * (taps + head);
+    std::copy_n(state.history.data() + channel * taps, taps, target);
+    std::copy_n(samples.channel(channel), head, target + taps);
+    planes[channel] = target;
+  }
+  filter_frames(state, planes.data(),
+                static_cast<int64_t>(first) - static_cast<int64_t>(taps), edge,
+                out, out_first);
+
+  for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+    planes[channel] = samples.channel(channel);
+  }
+  filter_frames(state, planes.data(), static_cast<int64_t>(first),
+                count - edge, out, out_first + edge);
+
+  // The last taps frames of the history and the block
+  for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+    const float *source = frames >= taps
+                              ? samples.channel(channel) + (frames - taps)
+                              : joined.data() + channel * (taps + head) + head;
+    std::copy_n(source, taps, state.history.data() + channel * taps);
+  }
+  state.input_frames = end;
+  keep_last_frame(state, samples, frames);
+}
+
+// The half-band cascade: every stage appends its input to the pending frames,
+// filters the output frames whose taps are all pending and drops the frames
+// that the next output frames no longer need. The kernels filter neighbouring
+// output frames at once.
+
+// Feeds frames of in to a stage and appends its output frames to out
+static void run_stage(ResamplerState &state, HalfBandStage &stage,
+                      const SampleBuffer<float> &in, size_t frames,
+                      SampleBuffer<float> &out) {
+  const HalfBandFilter &filter = *state.half_band;
+  const int64_t k = static_cast<int64_t>(filter.k);
+  for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+    const float *source = in.channel(channel);
+    stage.pending[channel].insert(stage.pending[channel].end(), source,
+                                  source + frames);
+  }
+  const int64_t end =
+      stage.origin + static_cast<int64_t>(stage.pending[0].size());
+  const int64_t next = static_cast<int64_t>(stage.next);
+  const size_t out_first = out.frames();
+  thread_local std::vector<float> even;
+  thread_local std::vector<float> odd;
+
+  if (state.down > 1) {
+    // The output frame m is centred on the input frame 2m and needs the input
+    // frames up to 2m + 2k - 1. The pending frames start at 2 * next - 2k.
+    int64_t last = (end - 2 * k) / 2;
+    size_t count = static_cast<size_t>(std::max<int64_t>(last - next + 1, 0));
+    out.resize(out_first + count);
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      const std::vector<float> &samples = stage.pending[channel];
+      size_t size = samples.size();
+      even.resize((size + 1) / 2);
+      odd.resize(size / 2);
+      for (size_t i = 0; i < size / 2; ++i) {
+        even[i] = samples[2 * i];
+        odd[i] = samples[2 * i + 1];
+      }
+      if (size % 2) {
+        even[size / 2] = samples[size - 1];
+      }
+      decimate_kernel(state.kernels)(even.data() + k, odd.data() + k,
+                                     filter.coefficients.data(), filter.k,
+                                     count, &out(channel, out_first));
+    }
+    stage.next += count;
+  } else {
+    // The input frame m gives the output frames 2m and 2m + 1, which needs
+    // the input frames [m - k + 1, m + k]. The pending frames start at
+    // next - k.
+    size_t count = static_cast<size_t>(std::max<int64_t>(end - k - next, 0));
+    out.resize(out_first + 2 * count);
+    odd.resize(count);
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      const float *samples = stage.pending[channel].data() + k;
+      interpolate_kernel(state.kernels)(samples, filter.interpolation.data(),
+                                        filter.k, count, odd.data());
+      float *target = &out(channel, out_first);
+      for (size_t j = 0; j < count; ++j) {
+        target[2 * j] = samples[j];
+        target[2 * j + 1] = odd[j];
+      }
+    }
+    stage.next += count;
+  }
+
+  const int64_t done = static_cast<int64_t>(stage.next);
+  const int64_t origin = state.down > 1 ? 2 * done - 2 * k : done - k;
+  for (auto &samples : stage.pending) {
+    samples.erase(samples.begin(), samples.begin() + (origin - stage.origin));
+  }
+  stage.origin = origin;
+}
+
+// Runs the block through all stages and appends at most max_frames output
+// frames
+static void half_band_block(ResamplerState &state,
+                            const SampleBuffer<float> &samples, size_t frames,
+                            SampleBuffer<float> &out, uint64_t max_frames) {
+  thread_local SampleBuffer<float> buffers[2];
+  const SampleBuffer<float> *in = &samples;
+  size_t in_frames = frames;
+  const size_t out_first = out.frames();
+  for (size_t i = 0; i < state.stages.size(); ++i) {
+    SampleBuffer<float> *target = &out;
+    if (i + 1 < state.stages.size()) {
+      target = &buffers[i % 2];
+      if (target->channels() != state.num_channels) {
+        *target = SampleBuffer<float>(state.num_channels, 0);
+      }
+      target->clear();
+    }
+    run_stage(state, state.stages[i], *in, in_frames, *target);
+    in = target;
+    in_frames = target->frames();
+  }
+
+  // The frames in front of a seek are dropped
+  size_t produced = out.frames() - out_first;
+  size_t dropped =
+      static_cast<size_t>(std::min<uint64_t>(state.skip, produced));
+  size_t kept =
+      static_cast<size_t>(std::min<uint64_t>(produced - dropped, max_frames));
+  if (dropped > 0) {
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      float *target = out.channel(channel) + out_first;
+      std::copy(target + dropped, target + dropped + kept, target);
+    }
+  }
+  out.resize(out_first + kept);
+  state.skip -= dropped;
+  state.output_frames += kept;
+  state.input_frames += frames;
+  keep_last_frame(state, samples, frames);
+}
+
+void adjust_sampling_rate(ResamplerState &state,
+                          const SampleBuffer<float> &samples, size_t frames,
+                          SampleBuffer<float> &out) {
+  StageScope stage(Stage::resample);
+  if (frames == 0) {
+    return;
+  }
+
+  if (state.old_sample_rate == state.new_sample_rate) {
+    out.append(samples, 0, frames);
+    state.input_frames += frames;
+    state.output_frames += frames;
+    state.position += frames;
+    keep_last_frame(state, samples, frames);
+    return;
+  }
 
-  for (auto &sample : audio.data) {
-    sample = std::clamp(sample >> bit_depth_difference, min_value, max_value);
-    sample = sample << bit_depth_difference;
+  if (state.half_band) {
+    half_band_block(state, samples, frames, out, UINT64_MAX);
+    return;
   }
 
+  if (state.bank) {
+    filter_block(state, samples, frames, out, UINT64_MAX);
+    return;
+  }
+
+  // The block holds the input frames [first, end), an output frame needs the
+  // frame in front of it and the one after it. The frame in front of the block
+  // is kept in last_frame.
+  const uint64_t first = state.input_frames;
+  const uint64_t end = first + frames;
+  size_t count = static_cast<size_t>(outputs_before(state, end - 1) -
+                                     std::min(outputs_before(state, end - 1),
+                                              state.output_frames));
+  size_t out_first = out.frames();
+  out.resize(out_first + count);
+
+  // Only the first frames of the block can start in the previous block
+  size_t done = 0;
+  for (; done < count && state.position < first; ++done) {
+    float fraction = static_cast<float>(state.phase * (1.0 / state.up));
+    for (uint16_t channel = 0; channel < state.num_channels; ++channel) {
+      float a = state.last_frame.empty() ? 0.f : state.last_frame[channel];
+      float b = samples(channel, 0);
+      out(channel, out_first + done) = a + fraction * (b - a);
+    }
+    ++state.output_frames;
+    advance_position(state, state.down / state.up, state.down % state.up);
+  }
+
+  resample_frames(state, samples, first, count - done, out, out_first + done,
+                  lerp_kernel(state.kernels));
+
+  state.input_frames = end;
+  keep_last_frame(state, samples, frames);
   return;
 }
 
-// Adjust samping rate
+void output_resampler_benchmark() {
+  // One channel of a sine, every run is compared to the scalar kernels
+  constexpr size_t frames = size_t(1) << 16;
+  SampleBuffer<float> input(1, frames);
+  for (size_t i = 0; i < frames; ++i) {
+    input(0, i) = std::sin(static_cast<float>(i) * 0.01f);
+  }
+
+  // The sinc filters and the half-band cascades
+  struct Run {
+    const char *name;
+    uint32_t old_sample_rate;
+    uint32_t new_sample_rate;
+    ResampleQuality quality;
+  };
+  const Run runs[] = {
+      {"linear", 44100, 48000, ResampleQuality::linear},
+      {"low", 44100, 48000, ResampleQuality::low},
+      {"medium", 44100, 48000, ResampleQuality::medium},
+      {"high", 44100, 48000, ResampleQuality::high},
+      {"high 2:1", 96000, 48000, ResampleQuality::high},
+      {"high 1:2", 48000, 96000, ResampleQuality::high}};
+
+  std::ostringstream out;
+  out << "Resampler throughput 44.1kHz to 48kHz, 96kHz to 48kHz (2:1) and "
+         "48kHz to 96kHz (1:2) (in frames/s of one channel):\n"
+      << std::left << std::setw(10) << "quality";
+  for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                             InstructionSet::avx2, InstructionSet::avx512}) {
+    out << std::right << std::setw(12) << instruction_set_name(set);
+  }
+  out << '\n';
+
+  for (const Run &run : runs) {
+    SampleBuffer<float> reference(1, 0);
+    ResamplerState scalar(run.old_sample_rate, run.new_sample_rate, 1,
+                          run.quality);
+    scalar.kernels = InstructionSet::scalar;
+    adjust_sampling_rate(scalar, input, frames, reference);
+
+    out << std::left << std::setw(10) << run.name << std::right;
+    for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                               InstructionSet::avx2, InstructionSet::avx512}) {
+      if (!supports_instruction_set(set)) {
+        out << std::setw(12) << "-";
+        continue;
+      }
+      SampleBuffer<float> resampled(1, 0);
+      uint64_t produced = 0;
+      auto begin = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed(0);
+      while (elapsed.count() < 0.2) {
+        ResamplerState state(run.old_sample_rate, run.new_sample_rate, 1,
+                             run.quality);
+        state.kernels = set;
+        resampled.clear();
+        adjust_sampling_rate(state, input, frames, resampled);
+        produced += resampled.frames();
+        elapsed = std::chrono::steady_clock::now() - begin;
+      }
+      bool same = resampled.frames() == reference.frames() &&
+                  std::equal(reference.channel(0),
+                             reference.channel(0) + reference.frames(),
+                             resampled.channel(0));
+
+      std::ostringstream rate;
+      rate << std::scientific << std::setprecision(2)
+           << produced / elapsed.count() << (same ? "" : "!")
+           << (set == best_instruction_set() ? "*" : "");
+      out << std::setw(12) << rate.str();
+    }
+    out << '\n';
+  }
+  out << "* chosen for this CPU, ! differs from the scalar kernel";
+  std::cerr << out.str() << std::endl;
+}
+
+void flush_sampling_rate(ResamplerState &state, size_t frames,
+                         SampleBuffer<float> &out) {
+  StageScope stage(Stage::resize);
+  // Past the last input frame the last frame is held
+  if (state.last_frame.empty()) {
+    state.last_frame.assign(state.num_channels, 0.f);
+  }
+
+  // The sinc filter still needs taps / 2 frames after the last input frame
+  // for the last output frames
+  if (state.bank && frames > 0) {
+    SampleBuffer<float> held(state.num_channels, 0);
+    held.append_repeated(state.last_frame.data(), state.bank->taps / 2);
+    size_t first = out.frames();
+    filter_block(state, held, held.frames(), out, frames);
+    frames -= out.frames() - first;
+  }
+
+  // The cascade needs the frames after the input of all stages: less than 2k
+  // when doubling, (2k - 1) * (down - 1) when halving
+  if (state.half_band && frames > 0) {
+    const uint64_t k = state.half_band->k;
+    SampleBuffer<float> held(state.num_channels, 0);
+    held.append_repeated(state.last_frame.data(),
+                         state.up > 1 ? 2 * k : (2 * k - 1) * state.down);
+    size_t first = out.frames();
+    half_band_block(state, held, held.frames(), out, frames);
+    frames -= out.frames() - first;
+  }
+
+  out.append_repeated(state.last_frame.data(), frames);
+  state.output_frames += frames;
+  return;
+}
 
 void adjust_sampling_rate(WAVHeader &audio, const uint32_t &new_sample_rate) {
   // Around 48000Hz
@@ -38,49 +695,169 @@ void adjust_sampling_rate(WAVHeader &audio, const uint32_t &new_sample_rate) {
   }
 
   uint32_t old_sample_rate = audio.sample_rate;
-  size_t old_num_samples = audio.data_size;
-  size_t new_num_samples = static_cast<size_t>(
+  size_t old_num_frames = audio.data.frames();
+  size_t new_num_frames = static_cast<size_t>(
       (static_cast<double>(new_sample_rate) / old_sample_rate) *
-      old_num_samples);
-
-  std::vector<int16_t> new_data(new_num_samples);
+      old_num_frames);
 
-  for (size_t i = 0; i < new_num_samples; ++i) {
-    double old_index =
-        static_cast<double>(i) * old_sample_rate / new_sample_rate;
-    size_t index_floor = static_cast<size_t>(std::floor(old_index));
-    size_t index_ceil = std::min(index_floor + 1, old_num_samples - 1);
-
-    double fraction = old_index - index_floor;
-    new_data[i] =
-        static_cast<int16_t>((1.f - fraction) * audio.data[index_floor] +
-                             fraction * audio.data[index_ceil]);
+  ResamplerState state(old_sample_rate, new_sample_rate, audio.num_channels);
+  SampleBuffer<float> new_data =
+      local_buffer_pool().acquire(audio.num_channels, new_num_frames);
+  adjust_sampling_rate(state, audio.data, old_num_frames, new_data);
+  if (state.output_frames < new_num_frames) {
+    flush_sampling_rate(state, new_num_frames - state.output_frames, new_data);
   }
+  new_data.resize(new_num_frames);
 
+  local_buffer_pool().release(std::move(audio.data));
   audio.data = std::move(new_data);
 
   audio.sample_rate = new_sample_rate;
   audio.byte_rate =
       new_sample_rate * audio.num_channels * audio.bits_per_sample / 8;
   audio.block_align = audio.num_channels * audio.bits_per_sample / 8;
-  audio.data_size = audio.data.size() * sizeof(int16_t);
-  audio.wav_size = audio.data_size + sizeof(WAVHeader) - 8;
+  update_data_size(audio);
 
   return;
 }
 
 // Adding Noise to the struct
 
-inline int16_t generate_crackle_noise_value() {
-  return ((rand() % 2000) - 1000) * 2;
+// The noise is generated for 16 bit and scaled to full scale 1.0. It is
+// counter based: the noise of a frame only depends on the key (the seed and
+// the file) and the index of the frame, so any part of a file gets the same
+// noise as in a full render.
+
+constexpr float pop_click_limit = 0.5f;
+
+inline float generate_crackle_noise_value(uint32_t bits) {
+  return (static_cast<int>(bits % 2000) - 1000) * 2 / 32768.f;
+}
+
+inline float generate_pop_click_noise_value(uint32_t bits) {
+  return (bits % 2 ? -pop_click_limit : pop_click_limit);
+}
+
+/**
+ * A noise that is added to one frame of a channel
+ */
+struct NoiseEvent {
+  size_t frame;
+  float value;
+};
+
+// Adds the noise to a channel and clamps the result
+static void apply_noise(float *plane, const std::vector<NoiseEvent> &events,
+                        const float &min_value, const float &max_value) {
+  for (const auto &event : events) {
+    plane[event.frame] =
+        std::clamp(plane[event.frame] + event.value, min_value, max_value);
+  }
+}
+
+// The key of the noise of the track
+static uint64_t noise_key(const Settings &settings) {
+  return random_key(settings.seed, settings.file_name);
+}
+
+// Every frame gets one random word: it gets noise if the word modulo range is
+// below level, the rest of the word (the quotient) decides the value. The
+// frames of the events count from the first frame of the block.
+template <typename Value>
+static void collect_events(std::vector<NoiseEvent> &events,
+                           const RandomStream &stream, size_t frames,
+                           uint64_t first_frame, uint32_t level, uint32_t range,
+                           Value value) {
+  events.clear();
+  constexpr size_t piece = 4096;
+  uint32_t words[piece];
+  for (size_t done = 0; done < frames; done += piece) {
+    size_t n = std::min(piece, frames - done);
+    random_words(stream, first_frame + done, n, words);
+    for (size_t i = 0; i < n; ++i) {
+      if (words[i] % range < level) {
+        events.push_back({done + i, value(words[i] / range)});
+      }
+    }
+  }
+}
+
+static const std::vector<NoiseEvent> &
+crackle_events(size_t frames, uint16_t noise_level, uint64_t first_frame,
+               uint64_t key, uint16_t channel) {
+  thread_local std::vector<NoiseEvent> events;
+  collect_events(events, {key, channel, RandomPurpose::crackle}, frames,
+                 first_frame, noise_level, 10000,
+                 generate_crackle_noise_value);
+  return events;
+}
+
+static const std::vector<NoiseEvent> &
+pop_click_events(size_t frames, uint32_t noise_level, uint64_t first_frame,
+                 uint64_t key, uint16_t channel) {
+  thread_local std::vector<NoiseEvent> events;
+  collect_events(events, {key, channel, RandomPurpose::pop_click}, frames,
+                 first_frame, noise_level, 100000,
+                 generate_pop_click_noise_value);
+  return events;
 }
 
-inline int16_t generate_pop_click_noise_value() {
-  return (rand() % 2 ? -16384 : 16384);
+// Adds the crackle and pop noise to a channel of packed 24 bit frames. Like
+// the floats a crackle is only clamped to full scale if there is no pop on its
+// frame, otherwise the sum is clamped to the limit of the pop.
+static void apply_packed_noise(char *samples, uint16_t channels,
+                               uint16_t channel,
+                               const std::vector<NoiseEvent> &crackles,
+                               const std::vector<NoiseEvent> &pops) {
+  constexpr int32_t full_scale = 1 << 23;
+  constexpr int32_t pop_click_max = static_cast<int32_t>(
+      pop_click_limit * full_scale);
+  // The noise is a multiple of the least significant bit of 24 bit samples
+  auto lsb = [](float value) {
+    return static_cast<int32_t>(std::lrint(value * double(full_scale)));
+  };
+
+  const size_t frame_size = 3 * channels;
+  auto crackle = crackles.begin();
+  auto pop = pops.begin();
+  while (crackle != crackles.end() || pop != pops.end()) {
+    size_t frame;
+    int32_t value = 0;
+    int32_t min_value = -full_scale;
+    int32_t max_value = full_scale - 1;
+    if (pop == pops.end() ||
+        (crackle != crackles.end() && crackle->frame <= pop->frame)) {
+      frame = crackle->frame;
+      value += lsb((crackle++)->value);
+    } else {
+      frame = pop->frame;
+    }
+    if (pop != pops.end() && pop->frame == frame) {
+      value += lsb((pop++)->value);
+      min_value = -pop_click_max;
+      max_value = pop_click_max;
+    }
+
+    add_packed_s24(samples + frame * frame_size + 3 * channel, value,
+                   min_value, max_value);
+  }
 }
 
-void add_crackle_noise(WAVHeader &audio, const uint16_t &noise_level) {
-  srand(static_cast<unsigned int>(time(0)));
+void add_crackle_noise(SampleBuffer<float> &samples, size_t frames,
+                       const uint16_t &noise_level, uint64_t first_frame,
+                       uint64_t key) {
+  StageScope stage(Stage::crackle);
+  for (uint16_t channel = 0; channel < samples.channels(); ++channel) {
+    // Floats have headroom, the Quantizer clamps to full scale
+    apply_noise(samples.channel(channel),
+                crackle_events(frames, noise_level, first_frame, key, channel),
+                -HUGE_VALF, HUGE_VALF);
+  }
+  return;
+}
+
+void add_crackle_noise(WAVHeader &audio, const uint16_t &noise_level,
+                       const uint64_t &key) {
 
   if (noise_level > 10000) {
     throw "noise_level can not be greater than 10_000 aka 100%\n";
@@ -90,21 +867,26 @@ void add_crackle_noise(WAVHeader &audio, const uint16_t &noise_level) {
     return;
   }
 
-  for (int i = 0; i < static_cast<int>(audio.data_size);
-       i += audio.block_align) {
-    if (rand() % 10000 < noise_level) {
-      short *sample = reinterpret_cast<short *>(&audio.data[i]);
-      int16_t crackle_noise = generate_crackle_noise_value();
-      *sample = std::min(
-          std::max(static_cast<int>(*sample) + crackle_noise, -32768), 32767);
-    }
-  }
+  add_crackle_noise(audio.data, audio.data.frames(), noise_level, 0, key);
 
   return;
 }
 
-void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level) {
-  srand(static_cast<unsigned int>(time(0)));
+void add_pop_click_noise(SampleBuffer<float> &samples, size_t frames,
+                         const uint32_t &noise_level, uint64_t first_frame,
+                         uint64_t key) {
+  StageScope stage(Stage::pop);
+  for (uint16_t channel = 0; channel < samples.channels(); ++channel) {
+    apply_noise(samples.channel(channel),
+                pop_click_events(frames, noise_level, first_frame, key,
+                                 channel),
+                -pop_click_limit, pop_click_limit);
+  }
+  return;
+}
+
+void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level,
+                         const uint64_t &key) {
 
   if (noise_level > 100000l) {
     throw "noise_level can not be greater than 10_000 aka 100%\n";
@@ -114,43 +896,55 @@ void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level) {
     return;
   }
 
-  for (int i = 0; i < static_cast<int>(audio.data_size);
-       i += audio.block_align) {
-    if (rand() % 100000l < noise_level) {
-      short *sample = reinterpret_cast<short *>(&audio.data[i]);
-      int16_t pop_click_noise = generate_pop_click_noise_value();
-      *sample = std::min(
-          std::max(static_cast<int>(*sample) + pop_click_noise, -16384), 16384);
-    }
-  }
+  add_pop_click_noise(audio.data, audio.data.frames(), noise_level, 0, key);
 
   return;
 }
 
 // Add needle sounds to the struct
 
-std::vector<int16_t> generate_needle_sound(const int &sample_rate,
-                                           const int &num_channels,
-                                           const float &duration_seconds) {
-  std::vector<int16_t> sound;
-
+static size_t needle_frames(const uint32_t &sample_rate,
+                            const float &duration_seconds) {
   if (duration_seconds <= 0) {
-    return sound;
+    return 0;
+  }
+  return static_cast<size_t>(duration_seconds * sample_rate);
+}
+
+// Writes the sound into the frames [first, first + numSamples) of all channels.
+// The drop and the lift get their own noise of the key.
+static void render_needle_sound(SampleBuffer<float> &sound, size_t first,
+                                const int &sample_rate,
+                                const float &duration_seconds, uint64_t key,
+                                RandomPurpose purpose) {
+  size_t numSamples = needle_frames(sample_rate, duration_seconds);
+  if (numSamples == 0) {
+    return;
   }
 
-  size_t numSamples = static_cast<size_t>(duration_seconds * sample_rate);
-  size_t impactSamples = static_cast<size_t>(0.01 * sample_rate); // 10ms impact
+  // 10ms impact, a shorter needle sound is only the impact
+  size_t impactSamples =
+      std::min(static_cast<size_t>(0.01 * sample_rate), numSamples);
   size_t frictionSamples = numSamples - impactSamples;
+  float *first_channel = sound.channel(0) + first;
 
-  std::default_random_engine generator;
-  std::uniform_int_distribution<int16_t> noiseDistribution(-25000, -23000);
+  // Uniform noise in [-25000, -23000], one word per frame. The frames are
+  // written in order, so the words are generated piece by piece.
+  const RandomStream stream{key, 0, purpose};
+  constexpr size_t piece = 4096;
+  uint32_t words[piece];
+  auto noise = [&](size_t i) {
+    if (i % piece == 0) {
+      random_words(stream, i, std::min(piece, numSamples - i), words);
+    }
+    return static_cast<int16_t>(-25000 + static_cast<int>(words[i % piece] %
+                                                          2001));
+  };
 
   // Generate initial impact sound (short burst of loud noise)
   for (size_t i = 0; i < impactSamples; ++i) {
-    int16_t sampleValue = noiseDistribution(generator);
-    for (uint16_t channel = 0; channel < num_channels; ++channel) {
-      sound.push_back(sampleValue);
-    }
+    int16_t sampleValue = noise(i);
+    first_channel[i] = sampleValue / 32768.f;
   }
 
   // Generate friction noise
@@ -158,69 +952,144 @@ std::vector<int16_t> generate_needle_sound(const int &sample_rate,
     double decay = exp(-static_cast<double>(i) /
                        (frictionSamples / 2.0 * duration_seconds));
     int16_t sampleValue =
-        static_cast<int16_t>(noiseDistribution(generator) * decay);
-    for (uint16_t channel = 0; channel < num_channels; ++channel) {
-      sound.push_back(sampleValue);
-    }
+        static_cast<int16_t>(noise(impactSamples + i) * decay);
+    first_channel[impactSamples + i] = sampleValue / 32768.f;
+  }
+
+  // All channels get the same sound
+  for (uint16_t channel = 1; channel < sound.channels(); ++channel) {
+    std::copy(first_channel, first_channel + numSamples,
+              sound.channel(channel) + first);
   }
 
+  return;
+}
+
+SampleBuffer<float> generate_needle_sound(const int &sample_rate,
+                                          const int &num_channels,
+                                          const float &duration_seconds,
+                                          uint64_t key,
+                                          RandomPurpose purpose) {
+  StageScope stage(Stage::needles);
+  size_t frames = needle_frames(sample_rate, duration_seconds);
+  SampleBuffer<float> sound = local_buffer_pool().acquire(num_channels, frames);
+  sound.resize(frames);
+  render_needle_sound(sound, 0, sample_rate, duration_seconds, key, purpose);
   return sound;
 }
 
-void add_start_needle(WAVHeader &audio, const float &needle_drop_duration) {
+// The needle bank: the sounds depend on the format, the duration and the key
+// of the file. A thread only keeps the sounds of the file it filters, they
+// stay valid until it filters another file.
+static const SampleBuffer<float> &needle_sound(const uint32_t &sample_rate,
+                                               const uint16_t &num_channels,
+                                               const float &duration_seconds,
+                                               uint64_t key,
+                                               RandomPurpose purpose) {
+  StageScope stage(Stage::needles);
+  thread_local uint64_t bank_key = 0;
+  thread_local std::map<std::tuple<uint32_t, uint16_t, float, RandomPurpose>,
+                        SampleBuffer<float>>
+      bank;
+  if (key != bank_key) {
+    for (auto &entry : bank) {
+      local_buffer_pool().release(std::move(entry.second));
+    }
+    bank.clear();
+    bank_key = key;
+  }
+
+  auto sound = std::make_tuple(sample_rate, num_channels, duration_seconds,
+                               purpose);
+  auto found = bank.find(sound);
+  if (found == bank.end()) {
+    found = bank
+                .emplace(sound, generate_needle_sound(sample_rate, num_channels,
+                                                      duration_seconds, key,
+                                                      purpose))
+                .first;
+  }
+  return found->second;
+}
+
+// The needle sounds need more than 8 bit
+static void widen_to_16_bit(WAVHeader &audio) {
+  if (audio.bits_per_sample >= 16) {
+    return;
+  }
+  audio.bits_per_sample = 16;
+  if (audio.audio_format == wave_format_extensible) {
+    audio.valid_bits_per_sample = 16;
+  }
+  audio.block_align = audio.num_channels * audio.bits_per_sample / 8;
+  audio.byte_rate = audio.sample_rate * audio.block_align;
+  return;
+}
+
+void add_start_needle(WAVHeader &audio, const float &needle_drop_duration,
+                      const uint64_t &key) {
+  StageScope stage(Stage::needles);
 
   if (needle_drop_duration < 0) {
     throw "The needle_drop_duration can not be less than 0\n";
   }
 
   // Generate the needle drop sound.
-  std::vector<int16_t> needle_drop_sound = generate_needle_sound(
-      audio.sample_rate, audio.num_channels, needle_drop_duration);
+  SampleBuffer<float> needle_drop_sound =
+      generate_needle_sound(audio.sample_rate, audio.num_channels,
+                            needle_drop_duration, key,
+                            RandomPurpose::needle_drop);
 
   // Create a new buffer to hold the combined audio data.
-  std::vector<int16_t> newAudioData;
-  newAudioData.reserve(needle_drop_sound.size() + audio.data_size);
+  SampleBuffer<float> newAudioData = local_buffer_pool().acquire(
+      audio.num_channels, needle_drop_sound.frames() + audio.data.frames());
 
   // Append needle drop sound.
-  newAudioData.insert(newAudioData.end(), needle_drop_sound.begin(),
-                      needle_drop_sound.end());
+  newAudioData.append(needle_drop_sound);
 
   // Append original audio data.
-  newAudioData.insert(newAudioData.end(), audio.data.begin(), audio.data.end());
+  newAudioData.append(audio.data);
 
   // Update the audio data with the new combined data.
+  local_buffer_pool().release(std::move(needle_drop_sound));
+  local_buffer_pool().release(std::move(audio.data));
   audio.data = std::move(newAudioData);
 
-  if (audio.bits_per_sample < 16) {
-    audio.bits_per_sample = 16;
-  }
-
-  audio.data_size = audio.data.size() * sizeof(int16_t);
-  audio.wav_size = audio.data_size + sizeof(WAVHeader) - 8;
+  widen_to_16_bit(audio);
+  update_data_size(audio);
 
   return;
 }
 
-void add_end_needle(WAVHeader &audio, const float &needle_lift_duration) {
+void add_end_needle(WAVHeader &audio, const float &needle_lift_duration,
+                    const uint64_t &key) {
+  StageScope stage(Stage::needles);
 
   if (needle_lift_duration < 0) {
     throw "The needle_lift_duration can not be less than 0\n";
   }
 
   // Generate the needle lift sound.
-  auto needle_lift_sound = generate_needle_sound(
-      audio.sample_rate, audio.num_channels, needle_lift_duration);
-
-  // Append needle lift sound to the end of the audio data.
-  audio.data.insert(audio.data.end(), needle_lift_sound.begin(),
-                    needle_lift_sound.end());
+  auto needle_lift_sound =
+      generate_needle_sound(audio.sample_rate, audio.num_channels,
+                            needle_lift_duration, key,
+                            RandomPurpose::needle_lift);
 
-  if (audio.bits_per_sample < 16) {
-    audio.bits_per_sample = 16;
+  // Append needle lift sound to the end of the audio data. A pooled buffer is
+  // used if the current one would have to grow.
+  size_t frames = audio.data.frames() + needle_lift_sound.frames();
+  if (frames > audio.data.capacity()) {
+    SampleBuffer<float> newAudioData =
+        local_buffer_pool().acquire(audio.num_channels, frames);
+    newAudioData.append(audio.data);
+    local_buffer_pool().release(std::move(audio.data));
+    audio.data = std::move(newAudioData);
   }
+  audio.data.append(needle_lift_sound);
+  local_buffer_pool().release(std::move(needle_lift_sound));
 
-  audio.data_size = audio.data.size() * sizeof(int16_t);
-  audio.wav_size = audio.data_size + sizeof(WAVHeader) - 8;
+  widen_to_16_bit(audio);
+  update_data_size(audio);
 
   return;
 }
@@ -228,27 +1097,396 @@ void add_end_needle(WAVHeader &audio, const float &needle_lift_duration) {
 // Calculate and resize audio length
 
 double calc_audio_length(const WAVHeader &audio) {
-  uint32_t number_of_samples =
+  uint64_t number_of_samples =
       audio.data_size / (audio.num_channels * (audio.bits_per_sample / 8));
   double duration = static_cast<double>(number_of_samples) / audio.sample_rate;
   return duration;
 }
 
 void resize_audio(WAVHeader &audio, const double &audio_length) {
-  uint32_t desired_samples =
-      static_cast<uint32_t>(audio_length * audio.sample_rate);
-  uint32_t samples_per_channel = desired_samples * audio.num_channels;
+  StageScope stage(Stage::resize);
+  uint64_t desired_samples =
+      static_cast<uint64_t>(audio_length * audio.sample_rate);
+
+  // Resize the data buffer to hold the frames for the desired length
+  audio.data.resize(desired_samples);
+
+  /* Update the data_size and the wav_size in the header to reflect the new size
+   of the audio data */
+  update_data_size(audio);
+  return;
+}
+
+// Apply all filters
+
+OutputLayout plan_output_layout(const WAVHeader &input,
+                                const Settings &settings) {
+  OutputLayout layout;
+  layout.lead_in =
+      needle_frames(settings.sample_rate, settings.needle_drop_duration);
+  layout.lead_out =
+      needle_frames(settings.sample_rate, settings.needle_lift_duration);
+
+  // The filtered track keeps the length of the original track
+  layout.body = unknown_data_size;
+  if (input.data_size != unknown_data_size) {
+    uint64_t input_frames = input.data_size / input.block_align;
+    layout.body = input_frames * settings.sample_rate / input.sample_rate;
+  }
+  return layout;
+}
+
+uint64_t estimate_working_set(const WAVHeader &input,
+                              const Settings &settings) {
+  OutputLayout layout = plan_output_layout(input, settings);
+  if (layout.body == unknown_data_size) {
+    return unknown_data_size;
+  }
+
+  // Packed samples are filtered in place
+  uint64_t input_frames = input.data_size / input.block_align;
+  if (can_filter_packed(input, settings)) {
+    return input_frames * input.block_align;
+  }
+
+  uint64_t frame_size = input.num_channels * sizeof(float);
+  uint64_t output_block_align =
+      input.num_channels * std::max<uint16_t>(input.bits_per_sample, 16) / 8;
+  uint64_t output_frames = layout.lead_in + layout.body + layout.lead_out;
+  return input_frames * frame_size + layout.body * frame_size +
+         output_frames * output_block_align;
+}
+
+// Adds the noise to the track and appends it resampled to the length of the
+// layout to out
+static void filter_body(WAVHeader &audio, const Settings &settings,
+                        const OutputLayout &layout, SampleBuffer<float> &out) {
+  if (settings.needle_drop_duration < 0) {
+    throw "The needle_drop_duration can not be less than 0\n";
+  }
+  if (settings.needle_lift_duration < 0) {
+    throw "The needle_lift_duration can not be less than 0\n";
+  }
+
+  add_crackle_noise(audio, settings.crackling_noise_lvl, noise_key(settings));
+  add_pop_click_noise(audio, settings.general_noise_lvl, noise_key(settings));
+  limit_bit_depth(audio, settings.bit_depth);
+  audio.dither = settings.dither;
+  audio.dither_key = noise_key(settings);
+
+  // The track is cut to the length of the original track
+  if (settings.sample_rate == audio.sample_rate) {
+    std::cerr << "The new sample rate is the same as the current sample rate\n";
+  }
+  size_t first = out.frames();
+  size_t body = static_cast<size_t>(layout.body);
+  ResamplerState resampler(audio.sample_rate, settings.sample_rate,
+                           audio.num_channels, settings.resample_quality);
+  adjust_sampling_rate(resampler, audio.data, audio.data.frames(), out);
+  if (resampler.output_frames < body) {
+    flush_sampling_rate(resampler, body - resampler.output_frames, out);
+  }
+  StageScope stage(Stage::resize);
+  out.resize(first + body);
+  return;
+}
+
+// Describes the format of the output in the header
+static void set_output_format(WAVHeader &audio, const Settings &settings) {
+  audio.sample_rate = settings.sample_rate;
+  audio.block_align = audio.num_channels * audio.bits_per_sample / 8;
+  audio.byte_rate = audio.sample_rate * audio.block_align;
+  widen_to_16_bit(audio);
+  return;
+}
+
+void apply_vinyl_filter(WAVHeader &audio, const Settings &settings) {
+  // The size of the output is known before filtering, so the needle sounds and
+  // the track are written once into a buffer of the final size
+  OutputLayout layout = plan_output_layout(audio, settings);
+  size_t body = static_cast<size_t>(layout.body);
+  SampleBuffer<float> output;
+  {
+    // The buffer the track is resampled into
+    StageScope stage(Stage::resample);
+    output = local_buffer_pool().acquire(
+        audio.num_channels, layout.lead_in + body + layout.lead_out);
+  }
+  {
+    StageScope stage(Stage::needles);
+    output.resize(layout.lead_in);
+    render_needle_sound(output, 0, settings.sample_rate,
+                        settings.needle_drop_duration, noise_key(settings),
+                        RandomPurpose::needle_drop);
+  }
+
+  // The track is resampled directly behind the needle drop
+  filter_body(audio, settings, layout, output);
+
+  /*
+   * important to apply the needle sounds after limiting the original audio as
+   * the realworld sounds should not be limited
+   */
+  {
+    StageScope stage(Stage::needles);
+    output.resize(layout.lead_in + body + layout.lead_out);
+    render_needle_sound(output, layout.lead_in + body, settings.sample_rate,
+                        settings.needle_lift_duration, noise_key(settings),
+                        RandomPurpose::needle_lift);
+  }
+
+  local_buffer_pool().release(std::move(audio.data));
+  audio.data = std::move(output);
+  set_output_format(audio, settings);
+  update_data_size(audio);
+  return;
+}
+
+Timeline build_vinyl_timeline(WAVHeader &audio, const Settings &settings) {
+  OutputLayout layout = plan_output_layout(audio, settings);
+  SampleBuffer<float> body;
+  {
+    // The buffer the track is resampled into
+    StageScope stage(Stage::resample);
+    body = local_buffer_pool().acquire(audio.num_channels,
+                                       static_cast<size_t>(layout.body));
+  }
+  filter_body(audio, settings, layout, body);
+  local_buffer_pool().release(std::move(audio.data));
+  audio.data = std::move(body);
+  set_output_format(audio, settings);
+
+  // The needle sounds come from the needle bank, nothing is concatenated
+  Timeline timeline;
+  timeline.append(needle_sound(settings.sample_rate, audio.num_channels,
+                               settings.needle_drop_duration,
+                               noise_key(settings),
+                               RandomPurpose::needle_drop));
+  timeline.append(audio.data);
+  timeline.append(needle_sound(settings.sample_rate, audio.num_channels,
+                               settings.needle_lift_duration,
+                               noise_key(settings),
+                               RandomPurpose::needle_lift));
+  update_data_size(audio, timeline);
+  return timeline;
+}
+
+bool can_filter_packed(const WAVHeader &input, const Settings &settings) {
+  return input.data_size != unknown_data_size &&
+         sample_format_of(input) == SampleFormat::pcm_s24 &&
+         input.sample_rate == settings.sample_rate && !settings.dither;
+}
+
+Timeline build_vinyl_timeline(MappedWAV &input, WAVHeader &audio,
+                              const Settings &settings) {
+  char *samples = input.writable_samples();
+  if (!samples || !can_filter_packed(input.header(), settings)) {
+    audio = read_wav_file(input);
+    return build_vinyl_timeline(audio, settings);
+  }
+
+  audio = input.header();
+  if (settings.needle_drop_duration < 0) {
+    throw "The needle_drop_duration can not be less than 0\n";
+  }
+  if (settings.needle_lift_duration < 0) {
+    throw "The needle_lift_duration can not be less than 0\n";
+  }
+  if (settings.crackling_noise_lvl > 10000) {
+    throw "noise_level can not be greater than 10_000 aka 100%\n";
+  }
+
+  // The same noise as for decoded samples, both are added in one pass
+  const size_t frames = input.view().frames;
+  static const std::vector<NoiseEvent> none;
+  for (uint16_t channel = 0; channel < audio.num_channels; ++channel) {
+    const std::vector<NoiseEvent> *crackles = &none;
+    const std::vector<NoiseEvent> *pops = &none;
+    if (settings.crackling_noise_lvl != 0) {
+      StageScope stage(Stage::crackle);
+      crackles = &crackle_events(frames, settings.crackling_noise_lvl, 0,
+                                 noise_key(settings), channel);
+    }
+    if (settings.general_noise_lvl != 0) {
+      StageScope stage(Stage::pop);
+      pops = &pop_click_events(frames, settings.general_noise_lvl, 0,
+                               noise_key(settings), channel);
+    }
+    StageScope stage(Stage::pop);
+    apply_packed_noise(samples, audio.num_channels, channel, *crackles, *pops);
+  }
+
+  // The samples are rounded here, the Quantizer only rounds the needle sounds
+  limit_bit_depth(audio, settings.bit_depth);
+  {
+    StageScope stage(Stage::bit_depth);
+    limit_packed_s24(samples, frames * audio.num_channels,
+                     audio.quantize_bits);
+  }
+  std::cerr << "The new sample rate is the same as the current sample rate\n";
+  set_output_format(audio, settings);
+
+  Timeline timeline;
+  timeline.append(needle_sound(settings.sample_rate, audio.num_channels,
+                               settings.needle_drop_duration,
+                               noise_key(settings),
+                               RandomPurpose::needle_drop));
+  timeline.append_encoded(samples, frames);
+  timeline.append(needle_sound(settings.sample_rate, audio.num_channels,
+                               settings.needle_lift_duration,
+                               noise_key(settings),
+                               RandomPurpose::needle_lift));
+  update_data_size(audio, timeline);
+  return timeline;
+}
+
+void apply_vinyl_filter(const char *input, size_t input_size,
+                        const Settings &settings, std::vector<char> &output) {
+  WAVHeader audio = read_wav_file(input, input_size);
+  Timeline timeline = build_vinyl_timeline(audio, settings);
+  write_wav_file(audio, timeline, output);
+  local_buffer_pool().release(std::move(audio.data));
+  return;
+}
+
+// Filter a file block by block
+
+bool is_excerpt(const Settings &settings) {
+  return settings.start != 0 || settings.duration != 0;
+}
+
+VinylStream::VinylStream(const WAVHeader &input, const Settings &settings)
+    : settings(settings), output(input),
+      resampler(input.sample_rate, settings.sample_rate, input.num_channels,
+                settings.resample_quality) {
+  if (settings.crackling_noise_lvl > 10000) {
+    throw "noise_level can not be greater than 10_000 aka 100%\n";
+  }
+  if (settings.needle_drop_duration < 0) {
+    throw "The needle_drop_duration can not be less than 0\n";
+  }
+  if (settings.needle_lift_duration < 0) {
+    throw "The needle_lift_duration can not be less than 0\n";
+  }
+
+  bool limit_bits = settings.bit_depth <= input.bits_per_sample;
+  if (!limit_bits) {
+    std::cerr << "New bit depth is greater than current bit depth.\n";
+  }
+
+  // For streams of unknown length the length of the track is only known in
+  // finish()
+  bool unknown_length = input.data_size == unknown_data_size;
+  body_frames = plan_output_layout(input, settings).body;
+
+  needle_drop = generate_needle_sound(
+      settings.sample_rate, input.num_channels, settings.needle_drop_duration,
+      noise_key(settings), RandomPurpose::needle_drop);
+  needle_lift = generate_needle_sound(
+      settings.sample_rate, input.num_channels, settings.needle_lift_duration,
+      noise_key(settings), RandomPurpose::needle_lift);
+
+  // An excerpt starts the resampler at its first frame. It interpolates from
+  // the same input frames as in the complete output.
+  excerpt = is_excerpt(settings);
+  if (excerpt) {
+    if (settings.start < 0 || settings.duration < 0) {
+      throw "The start and the duration can not be less than 0\n";
+    }
+    excerpt_first =
+        static_cast<uint64_t>(settings.start * settings.sample_rate);
+    uint64_t length =
+        settings.duration > 0
+            ? static_cast<uint64_t>(settings.duration * settings.sample_rate)
+            : unknown_data_size;
+    if (!unknown_length) {
+      excerpt_first = std::min(excerpt_first, body_frames);
+      length = std::min(length, body_frames - excerpt_first);
+    }
+    body_frames = length;
+    unknown_length = length == unknown_data_size;
+
+    resampler.seek(excerpt_first);
+    input_first = resampler.input_frames;
+    output_first = needle_drop.frames() + excerpt_first;
+  }
+
+  output.sample_rate = settings.sample_rate;
+  output.quantize_bits = limit_bits ? settings.bit_depth : 0;
+  output.dither = settings.dither;
+  output.dither_key = noise_key(settings);
+  widen_to_16_bit(output);
+  output.byte_rate = output.sample_rate * output.block_align;
 
-  // Resize the data vector to hold the samples for the desired length
-  audio.data.resize(samples_per_channel);
+  uint64_t output_frames =
+      excerpt ? body_frames
+              : body_frames + needle_drop.frames() + needle_lift.frames();
+  output.data_size =
+      unknown_length ? unknown_data_size : output_frames * output.block_align;
+  output.data = SampleBuffer<float>();
+  resampled = SampleBuffer<float>(input.num_channels, 0);
+  update_wav_size(output);
+}
+
+void VinylStream::process(SampleBuffer<float> &samples, size_t frames,
+                          SampleBuffer<float> &out) {
+  if (!started) {
+    StageScope stage(Stage::needles);
+    if (!excerpt) {
+      out.append(needle_drop);
+    }
+    started = true;
+  }
+
+  // The noise depends on the index of the frame in the input
+  if (settings.crackling_noise_lvl != 0) {
+    add_crackle_noise(samples, frames, settings.crackling_noise_lvl,
+                      resampler.input_frames, noise_key(settings));
+  }
+  if (settings.general_noise_lvl != 0) {
+    add_pop_click_noise(samples, frames, settings.general_noise_lvl,
+                        resampler.input_frames, noise_key(settings));
+  }
+  resampled.clear();
+  adjust_sampling_rate(resampler, samples, frames, resampled);
+  append_body(out);
+  return;
+}
 
-  /* Update the data_size in the header to reflect the new size of the audio
-   data */
-  audio.data_size = samples_per_channel * (audio.bits_per_sample / 8);
+void VinylStream::finish(SampleBuffer<float> &out) {
+  if (!started) {
+    StageScope stage(Stage::needles);
+    if (!excerpt) {
+      out.append(needle_drop);
+    }
+    started = true;
+  }
+
+  if (body_frames == unknown_data_size) {
+    uint64_t track_frames = resampler.input_frames * settings.sample_rate /
+                            resampler.old_sample_rate;
+    body_frames = track_frames - std::min(track_frames, excerpt_first);
+  }
+
+  // Pad the track to the length of the original track
+  resampled.clear();
+  if (body_written < body_frames) {
+    flush_sampling_rate(resampler, body_frames - body_written, resampled);
+  }
+  append_body(out);
+
+  StageScope stage(Stage::needles);
+  if (!excerpt) {
+    out.append(needle_lift);
+  }
+  return;
+}
 
-  /* Update the wav_size in the header to reflect the new size of the entire
-   file */
-  audio.wav_size = audio.data_size + sizeof(WAVHeader) -
-                   8; // Subtract 8 for the 'RIFF' and size fields
+void VinylStream::append_body(SampleBuffer<float> &out) {
+  StageScope stage(Stage::resample);
+  uint64_t frames = std::min<uint64_t>(resampled.frames(),
+                                       body_frames - body_written);
+  out.append(resampled, 0, static_cast<size_t>(frames));
+  body_written += frames;
   return;
 }
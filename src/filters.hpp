@@ -1,7 +1,14 @@
 #ifndef FILTERS_H
 #define FILTERS_H
 #include "filehandler.hpp"
+#include "filter_bank.hpp"
+#include "stage_memory.hpp"
+#include "timeline.hpp"
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
 /**
  * The default settings for the vinyl filter.
@@ -13,8 +20,86 @@ struct Settings {
   uint16_t general_noise_lvl = 5;     // in 0.001%
   float needle_drop_duration = 0.8f;  // in 1s
   float needle_lift_duration = 1.f;   // in 1s
+  bool stream = false;                // process the file block by block
+  bool direct_io = false;             // bypass the page cache
+  bool dither = false;                // dither before the final rounding
+  uint64_t memory_budget = 0;         // in 1B (0: no budget)
+  StageReportFormat memory_report = StageReportFormat::off; // per file
+  bool verbose = false;               // print the statistics of the run
+  uint64_t seed = 0;                  // of the noise (same seed, same noise)
+  double start = 0;                   // in 1s, start of the excerpt
+  double duration = 0;                // in 1s (0: up to the end of the track)
+  ResampleQuality resample_quality = ResampleQuality::linear;
+  std::string file_name;              // of the track, keys its noise
 };
 
+/**
+ * A function that checks whether only an excerpt of the track is rendered.
+ *
+ * @param[in] settings The settings for the filter
+ * @return true if start or duration is set
+ */
+bool is_excerpt(const Settings &settings);
+
+/**
+ * A half-band filter of the cascade, it halves or doubles the rate
+ */
+struct HalfBandStage {
+  std::vector<std::vector<float>> pending; // Input frames of every channel
+  int64_t origin = 0; // Index of the first pending frame (at the stage input)
+  uint64_t next = 0;  // Output frame (or input frame when doubling) to do next
+};
+
+/**
+ * The state of the resampler that is carried from one block to the next. The
+ * ratio of the sample rates is reduced by their gcd, so the position of every
+ * output frame in the input is exact: an input frame and a phase in 1/up
+ * frames, advanced by down/up frames per output frame. Above the linear
+ * quality every output frame is filtered from the frames around its position
+ * with a polyphase sinc filter. Ratios of 2^n are converted by a cascade of
+ * n half-band filters instead.
+ */
+struct ResamplerState {
+  ResamplerState(const uint32_t &old_sample_rate,
+                 const uint32_t &new_sample_rate, const uint16_t &num_channels,
+                 ResampleQuality quality = ResampleQuality::linear);
+
+  /**
+   * A function that starts the resampler at an output frame, e.g. for an
+   * excerpt. The input has to start at input_frames afterwards.
+   *
+   * @param[in] output_frame The index of the first output frame
+   */
+  void seek(uint64_t output_frame);
+
+  uint32_t old_sample_rate;        // in 1Hz
+  uint32_t new_sample_rate;        // in 1Hz
+  uint16_t num_channels;           // Number of interleaved channels
+  uint64_t up;                     // new_sample_rate / gcd
+  uint64_t down;                   // old_sample_rate / gcd
+  uint64_t input_frames = 0;       // Input frames consumed so far
+  uint64_t output_frames = 0;      // Output frames produced so far
+  uint64_t position = 0;           // Input frame in front of the next output
+  uint64_t phase = 0;              // Its distance from position in 1/up
+  std::vector<float> last_frame;   // The last frame of the previous block
+  std::vector<int32_t> period_offsets; // Input frames of whole periods of up
+  std::vector<float> period_fractions; // output frames (if up is small)
+  std::shared_ptr<const FilterBank> bank; // The sinc filter (nullptr: linear)
+  std::vector<float> history; // The last taps input frames of every channel
+  std::shared_ptr<const HalfBandFilter> half_band; // For ratios of 2^n
+  std::vector<HalfBandStage> stages; // The cascade, from the input rate on
+  uint64_t skip = 0;          // Output frames dropped after a seek
+  InstructionSet kernels;     // The kernels that interpolate or filter
+};
+
+/**
+ * A function that measures how many frames per second the resampler converts
+ * with every quality and every instruction set the CPU supports (44.1kHz to
+ * 48kHz, and 96kHz to 48kHz and back with the half-band cascade) and prints
+ * them (to stderr).
+ */
+void output_resampler_benchmark();
+
 /**
  * A function that calculates the length of a audiofile in seconds.
  *
@@ -24,13 +109,38 @@ struct Settings {
 double calc_audio_length(const WAVHeader &audio);
 
 /**
- * A function that limits the bit depth to a given value
+ * A function that limits the bit depth to a given value. The samples stay
+ * floats, they are rounded once to the new bit depth when the file is written.
  *
  * @param[out] audio The audio file read into the WAVHeader struct
  * @param[in] bit_depth The new bit depth
  */
 void limit_bit_depth(WAVHeader &audio, const uint16_t &bit_depth);
 
+/**
+ * A function that resamples a block of samples. The frames that can already be
+ * interpolated are appended to out, the rest follows with the next block.
+ *
+ * @param[out] state The state of the resampler
+ * @param[in] samples The samples of the block
+ * @param[in] frames The number of frames in the block
+ * @param[out] out The buffer the resampled frames are appended to
+ */
+void adjust_sampling_rate(ResamplerState &state,
+                          const SampleBuffer<float> &samples, size_t frames,
+                          SampleBuffer<float> &out);
+
+/**
+ * A function that appends frames after the end of the input by holding the
+ * last input frame.
+ *
+ * @param[out] state The state of the resampler
+ * @param[in] frames The number of frames to append
+ * @param[out] out The buffer the frames are appended to
+ */
+void flush_sampling_rate(ResamplerState &state, size_t frames,
+                         SampleBuffer<float> &out);
+
 /**
  * A function that adjusts the sampling rate of the given audio file to a given
  * rate.
@@ -45,16 +155,51 @@ void adjust_sampling_rate(WAVHeader &audio, const uint32_t &sampling_rate);
  *
  * @param[out] audio The audio file read into the WAVHeader struct
  * @param[in] noise_level The amount of noise generated (1 -> 0.1%)
+ * @param[in] key The key of the noise (random_key of the seed and the file)
+ */
+void add_crackle_noise(WAVHeader &audio, const uint16_t &noise_level,
+                       const uint64_t &key);
+
+/**
+ * A function that adds crackle noises to a block of samples. Every channel
+ * gets its own noise. The noise of a frame only depends on the key, the
+ * channel and its index in the file, so the blocks can be processed in any
+ * order.
+ *
+ * @param[out] samples The samples of the block
+ * @param[in] frames The number of frames in the block
+ * @param[in] noise_level The amount of noise generated (1 -> 0.01%)
+ * @param[in] first_frame The index of the first frame of the block in the file
+ * @param[in] key The key of the noise (random_key of the seed and the file)
  */
-void add_crackle_noise(WAVHeader &audio, const uint16_t &noise_level);
+void add_crackle_noise(SampleBuffer<float> &samples, size_t frames,
+                       const uint16_t &noise_level, uint64_t first_frame,
+                       uint64_t key);
+
+/**
+ * A function that adds pop noises to a block of samples. Every channel gets
+ * its own noise. Like the crackle noise it only depends on the key, the
+ * channel and the index of the frame.
+ *
+ * @param[out] samples The samples of the block
+ * @param[in] frames The number of frames in the block
+ * @param[in] noise_level The amount of noise generated (1 -> 0.001%)
+ * @param[in] first_frame The index of the first frame of the block in the file
+ * @param[in] key The key of the noise (random_key of the seed and the file)
+ */
+void add_pop_click_noise(SampleBuffer<float> &samples, size_t frames,
+                         const uint32_t &noise_level, uint64_t first_frame,
+                         uint64_t key);
 
 /**
  * A function that adds pop noises based on the given parameters.
  *
  * @param[out] audio The audio file read into the WAVHeader struct
  * @param[in] noise_level The amount of noise generated (1 -> 0.01%)
+ * @param[in] key The key of the noise (random_key of the seed and the file)
  */
-void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level);
+void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level,
+                         const uint64_t &key);
 
 /**
  * A function that adds the sound of the needle dropping on the vinyl record
@@ -63,8 +208,10 @@ void add_pop_click_noise(WAVHeader &audio, const uint32_t &noise_level);
  * @param[out] audio The audio file read into the WAVHeader struct
  * @param[in] needle_drop_duration The duration of the generated sound effect in
  * 1s
+ * @param[in] key The key of the sound (random_key of the seed and the file)
  */
-void add_start_needle(WAVHeader &audio, const float &needle_drop_duration);
+void add_start_needle(WAVHeader &audio, const float &needle_drop_duration,
+                      const uint64_t &key);
 
 /**
  * A function that adds the sound of the needle dropping on the vinyl record
@@ -73,8 +220,10 @@ void add_start_needle(WAVHeader &audio, const float &needle_drop_duration);
  * @param[out] audio The audio file read into the WAVHeader struct
  * @param[in] needle_lift_duration The duration of the generated sound effect in
  * 1s
+ * @param[in] key The key of the sound (random_key of the seed and the file)
  */
-void add_end_needle(WAVHeader &audio, const float &needle_lift_duration);
+void add_end_needle(WAVHeader &audio, const float &needle_lift_duration,
+                    const uint64_t &key);
 
 /**
  * A function that shortens the audiofile to a given length in seconds.
@@ -84,4 +233,172 @@ void add_end_needle(WAVHeader &audio, const float &needle_lift_duration);
  */
 void resize_audio(WAVHeader &audio, const double &audio_length);
 
+/**
+ * The layout of the output of the vinyl filter: the needle drop, the filtered
+ * track and the needle lift, one after the other.
+ */
+struct OutputLayout {
+  size_t lead_in;  // Frames of the needle drop
+  uint64_t body;   // Frames of the track (unknown_data_size if unknown)
+  size_t lead_out; // Frames of the needle lift
+};
+
+/**
+ * A function that computes the layout of the output before the file is
+ * filtered, so that the output can be written into a buffer of its final size.
+ *
+ * @param[in] input The header of the input file
+ * @param[in] settings The settings for the filter
+ * @return The number of frames of every part of the output
+ */
+OutputLayout plan_output_layout(const WAVHeader &input,
+                                const Settings &settings);
+
+/**
+ * A function that estimates the memory the vinyl filter needs to process a file
+ * as a whole: the decoded track, the filtered track and the encoded output.
+ *
+ * @param[in] input The header of the input file
+ * @param[in] settings The settings for the filter
+ * @return The size in bytes (unknown_data_size if the length is unknown)
+ */
+uint64_t estimate_working_set(const WAVHeader &input, const Settings &settings);
+
+/**
+ * A function that applies the complete vinyl filter to a file in memory: noise,
+ * bit depth, sampling rate, the length of the original track and the needle
+ * sounds. The track is copied once, into a buffer with room for the needles.
+ *
+ * @param[out] audio The audio file read into the WAVHeader struct
+ * @param[in] settings The settings for the filter
+ */
+void apply_vinyl_filter(WAVHeader &audio, const Settings &settings);
+
+/**
+ * A function that applies the complete vinyl filter and returns the output as a
+ * timeline: the needle drop, the filtered track and the needle lift. The
+ * needle sounds come from a bank of the thread, so nothing is concatenated.
+ * They stay valid until the thread filters another file. Afterwards the header describes the output, but its
+ * data only holds the filtered track.
+ *
+ * @param[out] audio The audio file read into the WAVHeader struct
+ * @param[in] settings The settings for the filter
+ * @return The samples of the output (referencing audio.data)
+ */
+Timeline build_vinyl_timeline(WAVHeader &audio, const Settings &settings);
+
+/**
+ * A function that checks whether the samples of a file can be filtered in
+ * place without decoding them: 24 bit PCM that keeps its sample rate and is
+ * not dithered.
+ *
+ * @param[in] input The header of the input file
+ * @param[in] settings The settings for the filter
+ * @return true if the samples can be filtered in place
+ */
+bool can_filter_packed(const WAVHeader &input, const Settings &settings);
+
+/**
+ * A function that applies the complete vinyl filter to a file that was mapped
+ * or read into memory and returns the output as a timeline. Samples that
+ * can_filter_packed are filtered in place in their 3 byte layout and the
+ * timeline references them, so the input has to outlive it. Other files are
+ * decoded and filtered like with build_vinyl_timeline.
+ *
+ * @param[out] input The file (its samples may be modified)
+ * @param[out] audio The header of the output file (and its decoded samples)
+ * @param[in] settings The settings for the filter
+ * @return The samples of the output
+ */
+Timeline build_vinyl_timeline(MappedWAV &input, WAVHeader &audio,
+                              const Settings &settings);
+
+/**
+ * A function that applies the complete vinyl filter to a wav-file in memory
+ * without accessing the file system.
+ *
+ * @param[in] input The contents of the wav-file
+ * @param[in] input_size The size of the contents in bytes
+ * @param[in] settings The settings for the filter
+ * @param[out] output The buffer the filtered wav-file is appended to
+ */
+void apply_vinyl_filter(const char *input, size_t input_size,
+                        const Settings &settings, std::vector<char> &output);
+
+/**
+ * The complete vinyl filter for files that are processed block by block. It
+ * applies the same steps as the functions above: noise, bit depth, sampling
+ * rate, the length of the original track and the needle sounds. For an excerpt
+ * (see is_excerpt) the output only holds the frames [start, start + duration)
+ * of the filtered track, the same frames as in the complete output, and the
+ * input has to start at first_input_frame.
+ */
+class VinylStream {
+public:
+  /**
+   * @param[in] input The header of the input file
+   * @param[in] settings The settings for the filter
+   */
+  VinylStream(const WAVHeader &input, const Settings &settings);
+
+  /**
+   * @return The header of the output file including the final sizes
+   * (unknown_data_size if the size of the input is unknown).
+   */
+  const WAVHeader &header() const { return output; }
+
+  /**
+   * @return The first frame of the input that is needed (0 if not an
+   * excerpt).
+   */
+  uint64_t first_input_frame() const { return input_first; }
+
+  /**
+   * @return The index of the first output frame in the complete output (0 if
+   * not an excerpt), e.g. to dither the excerpt like the complete output.
+   */
+  uint64_t first_output_frame() const { return output_first; }
+
+  /**
+   * @return true if the output is complete and no more input is needed.
+   */
+  bool done() const {
+    return body_frames != unknown_data_size && body_written >= body_frames;
+  }
+
+  /**
+   * A function that filters the next block of the input.
+   *
+   * @param[out] samples The samples of the block (they are modified)
+   * @param[in] frames The number of frames in the block
+   * @param[out] out The buffer the output frames are appended to
+   */
+  void process(SampleBuffer<float> &samples, size_t frames,
+               SampleBuffer<float> &out);
+
+  /**
+   * A function that appends the rest of the output after the last block.
+   *
+   * @param[out] out The buffer the output frames are appended to
+   */
+  void finish(SampleBuffer<float> &out);
+
+private:
+  void append_body(SampleBuffer<float> &out);
+
+  Settings settings;
+  WAVHeader output;
+  ResamplerState resampler;
+  uint64_t body_frames;                   // Frames of the filtered track
+  uint64_t body_written = 0;              // Frames of the track written so far
+  bool excerpt = false;                   // Only a part of the track
+  uint64_t excerpt_first = 0;             // First frame of the track
+  uint64_t input_first = 0;               // First frame of the input
+  uint64_t output_first = 0;              // First frame of the output
+  SampleBuffer<float> needle_drop;        // The sound at the start
+  SampleBuffer<float> needle_lift;        // The sound at the end
+  SampleBuffer<float> resampled;          // Scratch buffer for the resampler
+  bool started = false;
+};
+
 #endif
@@ -0,0 +1,384 @@
+#include "random.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The AVX2 and AVX-512 kernels are compiled for them and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VINYL_HAVE_X86_DISPATCH 1
+#endif
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3"): ten rounds of two 32 bit multiplications turn a counter of four words
+// into four random words. The counter of a block of the stream is its index
+// (two words), the channel and the purpose.
+
+constexpr uint32_t philox_m0 = 0xD2511F53;
+constexpr uint32_t philox_m1 = 0xCD9E8D57;
+constexpr uint32_t philox_w0 = 0x9E3779B9; // Added to the key every round
+constexpr uint32_t philox_w1 = 0xBB67AE85;
+constexpr int philox_rounds = 10;
+
+// The blocks are generated in groups of 16, one per lane of the widest
+// kernel. Word j of block l of a group is word 16j + l of the group, so every
+// kernel stores whole vectors and all of them return the same words.
+constexpr size_t group_blocks = 16;
+constexpr size_t group_words = 4 * group_blocks;
+
+using PhiloxKernel = void (*)(const RandomStream &stream, uint64_t group,
+                              size_t groups, uint32_t *out);
+
+uint64_t random_key(uint64_t seed, const std::string &file) {
+  // FNV-1a of the name, mixed like splitmix64
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (unsigned char c : file) {
+    hash = (hash ^ c) * 0x100000001B3ull;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+  return seed ^ (hash ^ (hash >> 31));
+}
+
+static void philox_scalar(const RandomStream &stream, uint64_t group,
+                          size_t groups, uint32_t *out) {
+  for (size_t g = 0; g < groups; ++g) {
+    for (size_t lane = 0; lane < group_blocks; ++lane) {
+      uint64_t block = (group + g) * group_blocks + lane;
+      uint32_t c0 = static_cast<uint32_t>(block);
+      uint32_t c1 = static_cast<uint32_t>(block >> 32);
+      uint32_t c2 = stream.channel;
+      uint32_t c3 = static_cast<uint32_t>(stream.purpose);
+      uint32_t k0 = static_cast<uint32_t>(stream.key);
+      uint32_t k1 = static_cast<uint32_t>(stream.key >> 32);
+      for (int round = 0; round < philox_rounds; ++round) {
+        uint64_t p0 = static_cast<uint64_t>(philox_m0) * c0;
+        uint64_t p1 = static_cast<uint64_t>(philox_m1) * c2;
+        c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+        c1 = static_cast<uint32_t>(p1);
+        c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+        c3 = static_cast<uint32_t>(p0);
+        k0 += philox_w0;
+        k1 += philox_w1;
+      }
+      uint32_t *target = out + g * group_words + lane;
+      target[0] = c0;
+      target[group_blocks] = c1;
+      target[2 * group_blocks] = c2;
+      target[3 * group_blocks] = c3;
+    }
+  }
+}
+
+#if defined(__SSE2__)
+// The lanes hold neighbouring blocks. _mm_mul_epu32 multiplies the even
+// lanes, the odd ones are shifted down for it. The high and low halves of the
+// products are then merged back into lanes.
+static void philox_sse2(const RandomStream &stream, uint64_t group,
+                        size_t groups, uint32_t *out) {
+  const __m128i m0 = _mm_set1_epi32(static_cast<int>(philox_m0));
+  const __m128i m1 = _mm_set1_epi32(static_cast<int>(philox_m1));
+  const __m128i low_mask = _mm_set1_epi64x(0xFFFFFFFF);
+  for (size_t g = 0; g < groups; ++g) {
+    uint64_t first = (group + g) * group_blocks;
+    for (size_t lane = 0; lane < group_blocks; lane += 4) {
+      // The blocks of a group do not carry into the high word
+      __m128i c0 = _mm_add_epi32(
+          _mm_set1_epi32(static_cast<int>(first + lane)),
+          _mm_setr_epi32(0, 1, 2, 3));
+      __m128i c1 = _mm_set1_epi32(static_cast<int>(first >> 32));
+      __m128i c2 = _mm_set1_epi32(static_cast<int>(stream.channel));
+      __m128i c3 = _mm_set1_epi32(static_cast<int>(stream.purpose));
+      uint32_t k0 = static_cast<uint32_t>(stream.key);
+      uint32_t k1 = static_cast<uint32_t>(stream.key >> 32);
+      for (int round = 0; round < philox_rounds; ++round) {
+        __m128i even0 = _mm_mul_epu32(c0, m0);
+        __m128i odd0 = _mm_mul_epu32(_mm_srli_epi64(c0, 32), m0);
+        __m128i even1 = _mm_mul_epu32(c2, m1);
+        __m128i odd1 = _mm_mul_epu32(_mm_srli_epi64(c2, 32), m1);
+        __m128i hi0 = _mm_or_si128(_mm_srli_epi64(even0, 32),
+                                   _mm_andnot_si128(low_mask, odd0));
+        __m128i hi1 = _mm_or_si128(_mm_srli_epi64(even1, 32),
+                                   _mm_andnot_si128(low_mask, odd1));
+        c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1),
+                           _mm_set1_epi32(static_cast<int>(k0)));
+        c1 = _mm_or_si128(_mm_and_si128(even1, low_mask),
+                          _mm_slli_epi64(odd1, 32));
+        c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3),
+                           _mm_set1_epi32(static_cast<int>(k1)));
+        c3 = _mm_or_si128(_mm_and_si128(even0, low_mask),
+                          _mm_slli_epi64(odd0, 32));
+        k0 += philox_w0;
+        k1 += philox_w1;
+      }
+      uint32_t *target = out + g * group_words + lane;
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(target), c0);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(target + group_blocks), c1);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(target + 2 * group_blocks),
+                       c2);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(target + 3 * group_blocks),
+                       c3);
+    }
+  }
+}
+#endif
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+__attribute__((target("avx2"))) static void
+philox_avx2(const RandomStream &stream, uint64_t group, size_t groups,
+            uint32_t *out) {
+  const __m256i m0 = _mm256_set1_epi32(static_cast<int>(philox_m0));
+  const __m256i m1 = _mm256_set1_epi32(static_cast<int>(philox_m1));
+  const __m256i low_mask = _mm256_set1_epi64x(0xFFFFFFFF);
+  for (size_t g = 0; g < groups; ++g) {
+    uint64_t first = (group + g) * group_blocks;
+    for (size_t lane = 0; lane < group_blocks; lane += 8) {
+      __m256i c0 = _mm256_add_epi32(
+          _mm256_set1_epi32(static_cast<int>(first + lane)),
+          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+      __m256i c1 = _mm256_set1_epi32(static_cast<int>(first >> 32));
+      __m256i c2 = _mm256_set1_epi32(static_cast<int>(stream.channel));
+      __m256i c3 = _mm256_set1_epi32(static_cast<int>(stream.purpose));
+      uint32_t k0 = static_cast<uint32_t>(stream.key);
+      uint32_t k1 = static_cast<uint32_t>(stream.key >> 32);
+      for (int round = 0; round < philox_rounds; ++round) {
+        __m256i even0 = _mm256_mul_epu32(c0, m0);
+        __m256i odd0 = _mm256_mul_epu32(_mm256_srli_epi64(c0, 32), m0);
+        __m256i even1 = _mm256_mul_epu32(c2, m1);
+        __m256i odd1 = _mm256_mul_epu32(_mm256_srli_epi64(c2, 32), m1);
+        __m256i hi0 = _mm256_or_si256(_mm256_srli_epi64(even0, 32),
+                                      _mm256_andnot_si256(low_mask, odd0));
+        __m256i hi1 = _mm256_or_si256(_mm256_srli_epi64(even1, 32),
+                                      _mm256_andnot_si256(low_mask, odd1));
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1),
+                              _mm256_set1_epi32(static_cast<int>(k0)));
+        c1 = _mm256_or_si256(_mm256_and_si256(even1, low_mask),
+                             _mm256_slli_epi64(odd1, 32));
+        c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3),
+                              _mm256_set1_epi32(static_cast<int>(k1)));
+        c3 = _mm256_or_si256(_mm256_and_si256(even0, low_mask),
+                             _mm256_slli_epi64(odd0, 32));
+        k0 += philox_w0;
+        k1 += philox_w1;
+      }
+      uint32_t *target = out + g * group_words + lane;
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(target), c0);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + group_blocks),
+                          c1);
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i *>(target + 2 * group_blocks), c2);
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i *>(target + 3 * group_blocks), c3);
+    }
+  }
+  _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f"))) static void
+philox_avx512(const RandomStream &stream, uint64_t group, size_t groups,
+              uint32_t *out) {
+  const __m512i m0 = _mm512_set1_epi32(static_cast<int>(philox_m0));
+  const __m512i m1 = _mm512_set1_epi32(static_cast<int>(philox_m1));
+  const __m512i low_mask = _mm512_set1_epi64(0xFFFFFFFF);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                          11, 12, 13, 14, 15);
+  for (size_t g = 0; g < groups; ++g) {
+    uint64_t first = (group + g) * group_blocks;
+    __m512i c0 =
+        _mm512_add_epi32(_mm512_set1_epi32(static_cast<int>(first)), lanes);
+    __m512i c1 = _mm512_set1_epi32(static_cast<int>(first >> 32));
+    __m512i c2 = _mm512_set1_epi32(static_cast<int>(stream.channel));
+    __m512i c3 = _mm512_set1_epi32(static_cast<int>(stream.purpose));
+    uint32_t k0 = static_cast<uint32_t>(stream.key);
+    uint32_t k1 = static_cast<uint32_t>(stream.key >> 32);
+    for (int round = 0; round < philox_rounds; ++round) {
+      __m512i even0 = _mm512_mul_epu32(c0, m0);
+      __m512i odd0 = _mm512_mul_epu32(_mm512_srli_epi64(c0, 32), m0);
+      __m512i even1 = _mm512_mul_epu32(c2, m1);
+      __m512i odd1 = _mm512_mul_epu32(_mm512_srli_epi64(c2, 32), m1);
+      __m512i hi0 = _mm512_or_si512(_mm512_srli_epi64(even0, 32),
+                                    _mm512_andnot_si512(low_mask, odd0));
+      __m512i hi1 = _mm512_or_si512(_mm512_srli_epi64(even1, 32),
+                                    _mm512_andnot_si512(low_mask, odd1));
+      c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1),
+                            _mm512_set1_epi32(static_cast<int>(k0)));
+      c1 = _mm512_or_si512(_mm512_and_si512(even1, low_mask),
+                           _mm512_slli_epi64(odd1, 32));
+      c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3),
+                            _mm512_set1_epi32(static_cast<int>(k1)));
+      c3 = _mm512_or_si512(_mm512_and_si512(even0, low_mask),
+                           _mm512_slli_epi64(odd0, 32));
+      k0 += philox_w0;
+      k1 += philox_w1;
+    }
+    uint32_t *target = out + g * group_words;
+    _mm512_storeu_si512(target, c0);
+    _mm512_storeu_si512(target + group_blocks, c1);
+    _mm512_storeu_si512(target + 2 * group_blocks, c2);
+    _mm512_storeu_si512(target + 3 * group_blocks, c3);
+  }
+  _mm256_zeroupper();
+}
+#endif
+
+static PhiloxKernel philox_kernel(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return philox_sse2;
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return philox_avx2;
+  case InstructionSet::avx512:
+    return philox_avx512;
+#endif
+  default:
+    return philox_scalar;
+  }
+}
+
+// Generates the words [first, first + count) in pieces of whole groups and
+// passes every piece to consume(words, count, done), done words before it
+template <typename Consume>
+static void generate_words(const RandomStream &stream, uint64_t first,
+                           size_t count, InstructionSet set,
+                           Consume consume) {
+  constexpr size_t piece_groups = 64;
+  uint32_t words[piece_groups * group_words];
+  const PhiloxKernel kernel = philox_kernel(set);
+  for (size_t done = 0; done < count;) {
+    uint64_t word = first + done;
+    size_t offset = static_cast<size_t>(word % group_words);
+    size_t groups = std::min(
+        piece_groups, (offset + count - done + group_words - 1) / group_words);
+    kernel(stream, word / group_words, groups, words);
+    size_t n = std::min(count - done, groups * group_words - offset);
+    consume(words + offset, n, done);
+    done += n;
+  }
+}
+
+void random_words(const RandomStream &stream, uint64_t first, size_t count,
+                  uint32_t *out, InstructionSet set) {
+  generate_words(stream, first, count, set,
+                 [&](const uint32_t *words, size_t n, size_t done) {
+                   std::copy_n(words, n, out + done);
+                 });
+}
+
+void random_uniform(const RandomStream &stream, uint64_t first, size_t count,
+                    float *out, InstructionSet set) {
+  const float unit = 1.f / 16777216.f;
+  generate_words(stream, first, count, set,
+                 [&](const uint32_t *words, size_t n, size_t done) {
+                   for (size_t i = 0; i < n; ++i) {
+                     out[done + i] = static_cast<float>(words[i] >> 8) * unit;
+                   }
+                 });
+}
+
+void random_normal(const RandomStream &stream, uint64_t first, size_t count,
+                   float *out, InstructionSet set) {
+  if (count == 0) {
+    return;
+  }
+
+  // The pairs of words around the values, the radius comes from a value in
+  // (0, 1] and the angle from one in [0, 1)
+  const double unit = 1.0 / 16777216.0;
+  const double two_pi = 6.28318530717958647692;
+  uint64_t first_word = first / 2 * 2;
+  size_t words = static_cast<size_t>((first + count + 1) / 2 * 2 - first_word);
+  generate_words(
+      stream, first_word, words, set,
+      [&](const uint32_t *pairs, size_t n, size_t done) {
+        for (size_t i = 0; i < n; i += 2) {
+          double radius = std::sqrt(
+              -2.0 * std::log(static_cast<double>((pairs[i] >> 8) + 1) * unit));
+          double angle = static_cast<double>(pairs[i + 1] >> 8) * unit * two_pi;
+          uint64_t value = first_word + done + i;
+          if (value >= first) {
+            out[value - first] = static_cast<float>(radius * std::cos(angle));
+          }
+          if (value + 1 < first + count) {
+            out[value + 1 - first] =
+                static_cast<float>(radius * std::sin(angle));
+          }
+        }
+      });
+}
+
+// Benchmark
+
+void output_random_benchmark() {
+  // 64k values per run, every run is compared to the scalar kernel
+  constexpr size_t count = size_t(1) << 16;
+  const RandomStream stream{0, 0, RandomPurpose::benchmark};
+  const char *names[] = {"words", "uniform", "normal"};
+
+  std::ostringstream out;
+  out << "Random numbers (Philox4x32-10) per second:\n"
+      << std::left << std::setw(8) << "kind";
+  for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                             InstructionSet::avx2, InstructionSet::avx512}) {
+    out << std::right << std::setw(12) << instruction_set_name(set);
+  }
+  out << '\n';
+
+  for (size_t kind = 0; kind < 3; ++kind) {
+    // Words are compared as floats of the same bits
+    auto generate = [&](InstructionSet set, std::vector<float> &values) {
+      if (kind == 0) {
+        random_words(stream, 0, count,
+                     reinterpret_cast<uint32_t *>(values.data()), set);
+      } else if (kind == 1) {
+        random_uniform(stream, 0, count, values.data(), set);
+      } else {
+        random_normal(stream, 0, count, values.data(), set);
+      }
+    };
+    std::vector<float> reference(count);
+    generate(InstructionSet::scalar, reference);
+
+    out << std::left << std::setw(8) << names[kind] << std::right;
+    for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                               InstructionSet::avx2, InstructionSet::avx512}) {
+      if (!supports_instruction_set(set)) {
+        out << std::setw(12) << "-";
+        continue;
+      }
+      std::vector<float> values(count);
+      uint64_t generated = 0;
+      auto begin = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed(0);
+      while (elapsed.count() < 0.2) {
+        generate(set, values);
+        generated += count;
+        elapsed = std::chrono::steady_clock::now() - begin;
+      }
+      bool same = std::equal(reference.begin(), reference.end(),
+                             values.begin(), [](float a, float b) {
+                               return std::memcmp(&a, &b, sizeof(a)) == 0;
+                             });
+
+      std::ostringstream rate;
+      rate << std::scientific << std::setprecision(2)
+           << generated / elapsed.count() << (same ? "" : "!")
+           << (set == best_instruction_set() ? "*" : "");
+      out << std::setw(12) << rate.str();
+    }
+    out << '\n';
+  }
+  out << "* chosen for this CPU, ! differs from the scalar kernel";
+  std::cerr << out.str() << std::endl;
+}
@@ -0,0 +1,90 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+#include "sample_format.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * What random numbers are used for. Every purpose has its own numbers, so
+ * e.g. the crackle and the pop noise are independent.
+ */
+enum class RandomPurpose : uint32_t {
+  crackle,     // Whether a frame crackles and how loud
+  pop_click,   // Whether a frame pops and its sign
+  needle_drop, // The needle sound at the start of the track
+  needle_lift, // The needle sound at the end of the track
+  dither,      // The TPDF dither of the Quantizer
+  benchmark,   // The test signals of the benchmarks
+};
+
+/**
+ * A stream of random numbers from a counter based generator (Philox4x32-10).
+ * The numbers are not generated one after the other: word i of the stream is
+ * a function of the key, the channel, the purpose and i, so any part of a
+ * stream is generated as fast as its start and the same with every
+ * instruction set.
+ */
+struct RandomStream {
+  uint64_t key;          // The seed (and the file, see random_key)
+  uint32_t channel;      // 0 if all channels get the same numbers
+  RandomPurpose purpose; // What the numbers are for
+};
+
+/**
+ * A function that combines the seed with the name of a file, so that every
+ * file gets its own noise and a file gets the same noise in every folder.
+ *
+ * @param[in] seed The seed of the noise
+ * @param[in] file The name of the file (without the folder)
+ * @return The key of the random streams of the file
+ */
+uint64_t random_key(uint64_t seed, const std::string &file);
+
+/**
+ * A function that generates 32 random bits per word.
+ *
+ * @param[in] stream The stream
+ * @param[in] first The index of the first word in the stream
+ * @param[in] count The number of words
+ * @param[out] out The buffer for count words
+ * @param[in] set The instruction set (supported by the CPU)
+ */
+void random_words(const RandomStream &stream, uint64_t first, size_t count,
+                  uint32_t *out, InstructionSet set = best_instruction_set());
+
+/**
+ * A function that generates floats in [0, 1) with 24 random bits, value i is
+ * made from word i of the stream.
+ *
+ * @param[in] stream The stream
+ * @param[in] first The index of the first value in the stream
+ * @param[in] count The number of values
+ * @param[out] out The buffer for count values
+ * @param[in] set The instruction set (supported by the CPU)
+ */
+void random_uniform(const RandomStream &stream, uint64_t first, size_t count,
+                    float *out, InstructionSet set = best_instruction_set());
+
+/**
+ * A function that generates normally distributed floats (mean 0, standard
+ * deviation 1) with the Box-Muller transform, the values 2i and 2i + 1 are
+ * made from the words 2i and 2i + 1 of the stream.
+ *
+ * @param[in] stream The stream
+ * @param[in] first The index of the first value in the stream
+ * @param[in] count The number of values
+ * @param[out] out The buffer for count values
+ * @param[in] set The instruction set (supported by the CPU)
+ */
+void random_normal(const RandomStream &stream, uint64_t first, size_t count,
+                   float *out, InstructionSet set = best_instruction_set());
+
+/**
+ * A function that measures how many random words, uniform and normal values
+ * per second every instruction set the CPU supports generates and prints them
+ * (to stderr).
+ */
+void output_random_benchmark();
+
+#endif
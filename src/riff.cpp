@@ -0,0 +1,182 @@
+#include "riff.hpp"
+#include <algorithm>
+#include <cstring>
+
+DS64Chunk parse_ds64_chunk(const char *payload, uint64_t size) {
+  if (size < ds64_payload_size) {
+    throw "File seams to be currupted!\n";
+  }
+
+  DS64Chunk ds64;
+  uint32_t table_length;
+  std::memcpy(&ds64.riff_size, payload, 8);
+  std::memcpy(&ds64.data_size, payload + 8, 8);
+  std::memcpy(&ds64.sample_count, payload + 16, 8);
+  std::memcpy(&table_length, payload + 24, 4);
+
+  // Each entry of the table holds a chunk id and a 64 bit size
+  uint64_t offset = ds64_payload_size;
+  for (uint32_t i = 0; i < table_length && offset + 12 <= size; ++i) {
+    RIFFChunk entry;
+    std::memcpy(entry.id, payload + offset, 4);
+    std::memcpy(&entry.size, payload + offset + 4, 8);
+    entry.offset = 0;
+    ds64.table.push_back(entry);
+    offset += 12;
+  }
+
+  return ds64;
+}
+
+// Replace the size of a chunk with its 64 bit size from the ds64 chunk
+static void resolve_ds64_size(RIFFChunk &chunk, const DS64Chunk &ds64,
+                              bool has_ds64) {
+  if (!has_ds64 || chunk.size != riff_size_in_ds64) {
+    return;
+  }
+
+  if (is_riff_chunk(chunk, "data")) {
+    chunk.size = ds64.data_size;
+    return;
+  }
+  for (const auto &entry : ds64.table) {
+    if (is_riff_chunk(entry, chunk.id)) {
+      chunk.size = entry.size;
+      return;
+    }
+  }
+  return;
+}
+
+// The offset of the chunk after a chunk, which has to be further into the file
+static uint64_t next_riff_chunk(uint64_t offset, const RIFFChunk &chunk) {
+  uint64_t next = chunk.offset + riff_padded_size(chunk.size);
+  if (next <= offset) {
+    throw "File seams to be currupted!\n";
+  }
+  return next;
+}
+
+std::vector<RIFFChunk> index_riff_chunks(const char *bytes, size_t size) {
+  DS64Chunk ds64;
+  bool has_ds64 = false;
+  std::vector<RIFFChunk> chunks;
+
+  // Skip "RIFF", the riff size and "WAVE"
+  uint64_t offset = 12;
+  while (offset + 8 <= size) {
+    RIFFChunk chunk;
+    uint32_t chunk_size;
+    std::memcpy(chunk.id, bytes + offset, 4);
+    std::memcpy(&chunk_size, bytes + offset + 4, sizeof(chunk_size));
+    chunk.offset = offset + 8;
+    chunk.size = chunk_size;
+    resolve_ds64_size(chunk, ds64, has_ds64);
+
+    // Sizes from the ds64 chunk can be close to 2^64, so the sum may wrap
+    bool clamped = chunk.size > size - chunk.offset;
+    if (clamped) {
+      // Recorders that were interrupted leave a data chunk with a wrong size
+      if (!is_riff_chunk(chunk, "data")) {
+        throw "File seams to be currupted!\n";
+      }
+      chunk.size = size - chunk.offset;
+    }
+
+    if (is_riff_chunk(chunk, "ds64")) {
+      ds64 = parse_ds64_chunk(bytes + chunk.offset, chunk.size);
+      has_ds64 = true;
+    }
+
+    offset = next_riff_chunk(offset, chunk);
+    chunks.push_back(std::move(chunk));
+    if (clamped) {
+      break;
+    }
+  }
+
+  return chunks;
+}
+
+std::vector<RIFFChunk> index_riff_chunks(std::istream &in, uint64_t size) {
+  DS64Chunk ds64;
+  bool has_ds64 = false;
+  std::vector<RIFFChunk> chunks;
+  bool seekable = size != std::numeric_limits<uint64_t>::max();
+
+  uint64_t offset = 12;
+  while (offset + 8 <= size) {
+    char header[8];
+    if (!in.read(header, sizeof(header))) {
+      break;
+    }
+
+    RIFFChunk chunk;
+    uint32_t chunk_size;
+    std::memcpy(chunk.id, header, 4);
+    std::memcpy(&chunk_size, header + 4, sizeof(chunk_size));
+    chunk.offset = offset + 8;
+    chunk.size = chunk_size;
+    resolve_ds64_size(chunk, ds64, has_ds64);
+
+    bool is_data = is_riff_chunk(chunk, "data");
+    bool clamped = chunk.size > size - chunk.offset;
+    if (clamped) {
+      if (!is_data) {
+        throw "File seams to be currupted!\n";
+      }
+      chunk.size = size - chunk.offset;
+    }
+    offset = next_riff_chunk(offset, chunk);
+
+    if (is_data) {
+      chunks.push_back(std::move(chunk));
+      if (!seekable || clamped) {
+        break;
+      }
+      in.seekg(static_cast<std::streamoff>(offset));
+      continue;
+    }
+
+    // The size of a chunk in a pipe can not be checked, so the payload grows
+    // while it is read and a wrong size ends with the pipe
+    while (chunk.payload.size() < chunk.size) {
+      size_t read = chunk.payload.size();
+      size_t piece = static_cast<size_t>(
+          std::min<uint64_t>(chunk.size - read, 1 << 20));
+      chunk.payload.resize(read + piece);
+      if (!in.read(chunk.payload.data() + read,
+                   static_cast<std::streamsize>(piece))) {
+        throw "File seams to be currupted!\n";
+      }
+    }
+    if (chunk.size & 1) {
+      in.ignore(1);
+    }
+    if (!in) {
+      throw "File seams to be currupted!\n";
+    }
+
+    if (is_riff_chunk(chunk, "ds64")) {
+      ds64 = parse_ds64_chunk(chunk.payload.data(), chunk.size);
+      has_ds64 = true;
+    }
+    chunks.push_back(std::move(chunk));
+  }
+
+  return chunks;
+}
+
+bool is_riff_chunk(const RIFFChunk &chunk, const char *id) {
+  return std::strncmp(chunk.id, id, 4) == 0;
+}
+
+const RIFFChunk *find_riff_chunk(const std::vector<RIFFChunk> &chunks,
+                                 const char *id) {
+  for (const auto &chunk : chunks) {
+    if (is_riff_chunk(chunk, id)) {
+      return &chunk;
+    }
+  }
+  return nullptr;
+}
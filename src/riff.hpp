@@ -0,0 +1,104 @@
+#ifndef RIFF_H
+#define RIFF_H
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <vector>
+
+/**
+ * An entry of the chunk index of a RIFF file
+ */
+struct RIFFChunk {
+  char id[4];                // Four character code (e.g. "fmt ", "LIST")
+  uint64_t offset;           // Offset of the chunk payload in the file
+  uint64_t size;             // Size of the chunk payload in bytes
+  std::vector<char> payload; // Copy of the payload for metadata chunks
+};
+
+/**
+ * The 64 bit sizes of a RF64 / BW64 file. Chunks whose 32 bit size field is
+ * 0xFFFFFFFF take their size from here.
+ */
+struct DS64Chunk {
+  uint64_t riff_size = 0;       // Size of the file minus 8 bytes
+  uint64_t data_size = 0;       // Size of the data chunk
+  uint64_t sample_count = 0;    // Number of frames in the data chunk
+  std::vector<RIFFChunk> table; // Sizes of other large chunks (id and size)
+};
+
+/**
+ * The value of a 32 bit size field whose real size is in the ds64 chunk
+ */
+constexpr uint32_t riff_size_in_ds64 = 0xFFFFFFFF;
+
+/**
+ * The size of the ds64 chunk payload without a table
+ */
+constexpr uint32_t ds64_payload_size = 28;
+
+/**
+ * A function that parses the payload of a ds64 chunk.
+ *
+ * @param[in] payload The payload of the chunk.
+ * @param[in] size The size of the payload in bytes.
+ * @return The 64 bit sizes.
+ */
+DS64Chunk parse_ds64_chunk(const char *payload, uint64_t size);
+
+/**
+ * A function that walks the chunks of a RIFF file by hopping from chunk to
+ * chunk with the size fields. Only the chunk headers are touched. The sizes of
+ * RF64 / BW64 files are taken from the ds64 chunk.
+ *
+ * @param[in] bytes The contents of the file.
+ * @param[in] size The size of the file in bytes.
+ * @return The index of all chunks after the "WAVE" form type in file order.
+ */
+std::vector<RIFFChunk> index_riff_chunks(const char *bytes, size_t size);
+
+/**
+ * A function that walks the chunks of a RIFF stream. The stream has to be
+ * positioned after the "WAVE" form type. The payload of every chunk except the
+ * data chunk is read into the index. If the size of the stream is unknown
+ * (pipes), the walk stops at the data chunk and the stream is left at the
+ * first sample. Otherwise the data chunk is skipped with a seek.
+ *
+ * @param[in] in The stream to read from.
+ * @param[in] size The size of the stream in bytes or the maximum value if it
+ * is unknown.
+ * @return The index of the chunks in file order.
+ */
+std::vector<RIFFChunk>
+index_riff_chunks(std::istream &in,
+                  uint64_t size = std::numeric_limits<uint64_t>::max());
+
+/**
+ * A function that checks the four character code of a chunk.
+ *
+ * @param[in] chunk The chunk from the index.
+ * @param[in] id The four character code to compare with.
+ * @return true if the chunk has the given id.
+ */
+bool is_riff_chunk(const RIFFChunk &chunk, const char *id);
+
+/**
+ * A function that searches the index for the first chunk with the given id.
+ *
+ * @param[in] chunks The chunk index.
+ * @param[in] id The four character code of the chunk.
+ * @return The chunk or nullptr if there is no such chunk.
+ */
+const RIFFChunk *find_riff_chunk(const std::vector<RIFFChunk> &chunks,
+                                 const char *id);
+
+/**
+ * A function that returns the size of a chunk payload including the pad byte
+ * that RIFF requires after chunks with an odd size.
+ *
+ * @param[in] size The size of the payload in bytes.
+ * @return The padded size.
+ */
+inline uint64_t riff_padded_size(uint64_t size) { return size + (size & 1); }
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef SAMPLE_BUFFER_H
+#define SAMPLE_BUFFER_H
+#include "sample_memory.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * The alignment of every channel of a SampleBuffer in bytes (one cache line,
+ * enough for AVX-512)
+ */
+constexpr size_t sample_alignment = 64;
+
+/**
+ * An allocator for std::vector that aligns the memory to a given boundary.
+ * Large buffers follow the SampleMemoryPolicy (huge pages, NUMA node).
+ */
+template <typename T, size_t Alignment = sample_alignment>
+struct AlignedAllocator {
+  using value_type = T;
+
+  template <typename U> struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(size_t count) {
+    return static_cast<T *>(allocate_samples(count * sizeof(T), Alignment));
+  }
+
+  void deallocate(T *memory, size_t count) {
+    deallocate_samples(memory, count * sizeof(T), Alignment);
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Alignment> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment> &) const {
+    return false;
+  }
+};
+
+/**
+ * Samples of all channels of a file, stored planar: every channel is a
+ * separate, aligned array that is indexed by frame. Kernels that work on one
+ * channel therefore run with unit stride.
+ */
+template <typename T> class SampleBuffer {
+public:
+  using Channel = std::vector<T, AlignedAllocator<T>>;
+
+  SampleBuffer() = default;
+
+  /**
+   * @param[in] num_channels The number of channels.
+   * @param[in] num_frames The number of frames (filled with zeros).
+   */
+  SampleBuffer(uint16_t num_channels, size_t num_frames)
+      : planes(num_channels, Channel(num_frames)) {}
+
+  /**
+   * @return The number of channels.
+   */
+  uint16_t channels() const { return static_cast<uint16_t>(planes.size()); }
+
+  /**
+   * @return The number of frames (one sample per channel).
+   */
+  size_t frames() const { return planes.empty() ? 0 : planes[0].size(); }
+
+  /**
+   * @return The total number of samples of all channels.
+   */
+  size_t size() const { return frames() * planes.size(); }
+
+  /**
+   * @param[in] channel The index of the channel.
+   * @return The first sample of the channel.
+   */
+  T *channel(uint16_t channel) { return planes[channel].data(); }
+  const T *channel(uint16_t channel) const { return planes[channel].data(); }
+
+  /**
+   * @param[in] channel The index of the channel.
+   * @param[in] frame The index of the frame.
+   * @return The sample.
+   */
+  T &operator()(uint16_t channel, size_t frame) {
+    return planes[channel][frame];
+  }
+  const T &operator()(uint16_t channel, size_t frame) const {
+    return planes[channel][frame];
+  }
+
+  /**
+   * A function that changes the number of frames. New frames are zero.
+   *
+   * @param[in] num_frames The new number of frames.
+   */
+  void resize(size_t num_frames) {
+    for (auto &plane : planes) {
+      plane.resize(num_frames);
+    }
+  }
+
+  /**
+   * @return The number of frames memory is reserved for.
+   */
+  size_t capacity() const { return planes.empty() ? 0 : planes[0].capacity(); }
+
+  /**
+   * @param[in] num_frames The number of frames to reserve memory for.
+   */
+  void reserve(size_t num_frames) {
+    for (auto &plane : planes) {
+      plane.reserve(num_frames);
+    }
+  }
+
+  /**
+   * A function that removes all frames but keeps the channels and memory.
+   */
+  void clear() { resize(0); }
+
+  /**
+   * A function that appends frames of another buffer with the same channels.
+   *
+   * @param[in] other The buffer to copy from.
+   * @param[in] first The first frame to copy.
+   * @param[in] count The number of frames to copy.
+   */
+  void append(const SampleBuffer &other, size_t first, size_t count) {
+    for (uint16_t c = 0; c < channels(); ++c) {
+      const T *source = other.channel(c) + first;
+      planes[c].insert(planes[c].end(), source, source + count);
+    }
+  }
+
+  /**
+   * A function that appends all frames of another buffer with the same
+   * channels.
+   *
+   * @param[in] other The buffer to copy from.
+   */
+  void append(const SampleBuffer &other) { append(other, 0, other.frames()); }
+
+  /**
+   * A function that appends the same frame several times.
+   *
+   * @param[in] frame One sample per channel.
+   * @param[in] count The number of frames to append.
+   */
+  void append_repeated(const T *frame, size_t count) {
+    for (uint16_t c = 0; c < channels(); ++c) {
+      planes[c].insert(planes[c].end(), count, frame[c]);
+    }
+  }
+
+private:
+  std::vector<Channel> planes;
+};
+
+/**
+ * A function that copies interleaved samples into a planar buffer.
+ *
+ * @param[in] interleaved The interleaved samples (frames * channels).
+ * @param[in] frames The number of frames.
+ * @param[out] buffer The planar buffer, its channels define the layout.
+ * @param[in] first The first frame of the buffer that is written.
+ */
+template <typename T>
+void deinterleave(const T *interleaved, size_t frames, SampleBuffer<T> &buffer,
+                  size_t first) {
+  const uint16_t channels = buffer.channels();
+  if (channels == 1) {
+    std::memcpy(buffer.channel(0) + first, interleaved, frames * sizeof(T));
+    return;
+  }
+
+  size_t frame = 0;
+  if (channels == 2) {
+    T *left = buffer.channel(0) + first;
+    T *right = buffer.channel(1) + first;
+#if defined(__SSE2__)
+    if constexpr (sizeof(T) == 4) {
+      // Split [L0 R0 L1 R1] [L2 R2 L3 R3] into [L0 L1 L2 L3] [R0 R1 R2 R3]
+      for (; frame + 4 <= frames; frame += 4) {
+        const float *source =
+            reinterpret_cast<const float *>(interleaved + 2 * frame);
+        __m128 low = _mm_loadu_ps(source);
+        __m128 high = _mm_loadu_ps(source + 4);
+        _mm_storeu_ps(reinterpret_cast<float *>(left + frame),
+                      _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(reinterpret_cast<float *>(right + frame),
+                      _mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)));
+      }
+    }
+#endif
+    for (; frame < frames; ++frame) {
+      left[frame] = interleaved[2 * frame];
+      right[frame] = interleaved[2 * frame + 1];
+    }
+    return;
+  }
+
+  for (uint16_t c = 0; c < channels; ++c) {
+    T *plane = buffer.channel(c) + first;
+    const T *source = interleaved + c;
+    for (frame = 0; frame < frames; ++frame) {
+      plane[frame] = source[frame * channels];
+    }
+  }
+}
+
+/**
+ * A function that copies frames of a planar buffer into interleaved samples.
+ *
+ * @param[in] buffer The planar buffer.
+ * @param[in] first The first frame to copy.
+ * @param[in] frames The number of frames.
+ * @param[out] interleaved The interleaved samples (frames * channels).
+ */
+template <typename T>
+void interleave(const SampleBuffer<T> &buffer, size_t first, size_t frames,
+                T *interleaved) {
+  const uint16_t channels = buffer.channels();
+  if (channels == 1) {
+    std::memcpy(interleaved, buffer.channel(0) + first, frames * sizeof(T));
+    return;
+  }
+
+  size_t frame = 0;
+  if (channels == 2) {
+    const T *left = buffer.channel(0) + first;
+    const T *right = buffer.channel(1) + first;
+#if defined(__SSE2__)
+    if constexpr (sizeof(T) == 4) {
+      for (; frame + 4 <= frames; frame += 4) {
+        __m128 l = _mm_loadu_ps(reinterpret_cast<const float *>(left + frame));
+        __m128 r =
+            _mm_loadu_ps(reinterpret_cast<const float *>(right + frame));
+        float *target = reinterpret_cast<float *>(interleaved + 2 * frame);
+        _mm_storeu_ps(target, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(target + 4, _mm_unpackhi_ps(l, r));
+      }
+    }
+#endif
+    for (; frame < frames; ++frame) {
+      interleaved[2 * frame] = left[frame];
+      interleaved[2 * frame + 1] = right[frame];
+    }
+    return;
+  }
+
+  for (uint16_t c = 0; c < channels; ++c) {
+    const T *plane = buffer.channel(c) + first;
+    T *target = interleaved + c;
+    for (frame = 0; frame < frames; ++frame) {
+      target[frame * channels] = plane[frame];
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,718 @@
+#include "sample_format.hpp"
+#include "random.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// SSSE3, AVX2 and AVX-512 are not part of the x86-64 baseline, the kernels
+// that use them are compiled for them and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VINYL_HAVE_X86_DISPATCH 1
+#endif
+
+SampleFormat sample_format_of(const WAVHeader &wav) {
+  uint16_t format = wav.audio_format == wave_format_extensible
+                        ? wav.sub_format
+                        : wav.audio_format;
+
+  if (format == wave_format_pcm) {
+    switch (wav.bits_per_sample) {
+    case 8:
+      return SampleFormat::pcm_u8;
+    case 16:
+      return SampleFormat::pcm_s16;
+    case 24:
+      return SampleFormat::pcm_s24;
+    case 32:
+      return SampleFormat::pcm_s32;
+    }
+  } else if (format == wave_format_ieee_float) {
+    switch (wav.bits_per_sample) {
+    case 32:
+      return SampleFormat::float32;
+    case 64:
+      return SampleFormat::float64;
+    }
+  }
+  throw "Unsupported audio format (only 8/16/24/32 bit PCM and 32/64 bit "
+        "float are supported).\n";
+}
+
+size_t bytes_per_sample(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::pcm_u8:
+    return 1;
+  case SampleFormat::pcm_s16:
+    return 2;
+  case SampleFormat::pcm_s24:
+    return 3;
+  case SampleFormat::pcm_s32:
+  case SampleFormat::float32:
+    return 4;
+  case SampleFormat::float64:
+    return 8;
+  }
+  return 0;
+}
+
+// Decode kernels
+
+static void decode_s16(const char *bytes, size_t count, float *samples) {
+  const float scale = 1.f / 32768.f;
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Interleaving a sample with itself and shifting back extends the sign
+  const __m128 vscale = _mm_set1_ps(scale);
+  for (; i + 8 <= count; i += 8) {
+    __m128i packed =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + 2 * i));
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16);
+    _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_cvtepi32_ps(low), vscale));
+    _mm_storeu_ps(samples + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), vscale));
+  }
+#endif
+  for (; i < count; ++i) {
+    int16_t sample;
+    std::memcpy(&sample, bytes + 2 * i, sizeof(sample));
+    samples[i] = sample * scale;
+  }
+}
+
+static void decode_s24(const char *bytes, size_t count, float *samples) {
+  const float scale = 1.f / 2147483648.f;
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+  for (size_t i = 0; i < count; ++i, data += 3) {
+    int32_t sample = static_cast<int32_t>(
+        (static_cast<uint32_t>(data[0]) << 8) |
+        (static_cast<uint32_t>(data[1]) << 16) |
+        (static_cast<uint32_t>(data[2]) << 24));
+    samples[i] = static_cast<float>(sample) * scale;
+  }
+}
+
+static void decode_s32(const char *bytes, size_t count, float *samples) {
+  const float scale = 1.f / 2147483648.f;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128 vscale = _mm_set1_ps(scale);
+  for (; i + 4 <= count; i += 4) {
+    __m128i sample =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + 4 * i));
+    _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_cvtepi32_ps(sample), vscale));
+  }
+#endif
+  for (; i < count; ++i) {
+    int32_t sample;
+    std::memcpy(&sample, bytes + 4 * i, sizeof(sample));
+    samples[i] = static_cast<float>(sample) * scale;
+  }
+}
+
+void decode_samples(const char *bytes, size_t count, SampleFormat format,
+                    float *samples) {
+  switch (format) {
+  case SampleFormat::pcm_u8:
+    for (size_t i = 0; i < count; ++i) {
+      samples[i] = (static_cast<unsigned char>(bytes[i]) - 128) / 128.f;
+    }
+    break;
+  case SampleFormat::pcm_s16:
+    decode_s16(bytes, count, samples);
+    break;
+  case SampleFormat::pcm_s24:
+    decode_s24(bytes, count, samples);
+    break;
+  case SampleFormat::pcm_s32:
+    decode_s32(bytes, count, samples);
+    break;
+  case SampleFormat::float32:
+    std::memcpy(samples, bytes, count * sizeof(float));
+    break;
+  case SampleFormat::float64:
+    for (size_t i = 0; i < count; ++i) {
+      double value;
+      std::memcpy(&value, bytes + 8 * i, sizeof(value));
+      samples[i] = static_cast<float>(value);
+    }
+    break;
+  }
+}
+
+// Packed 24-bit kernels
+
+static inline int32_t load_s24(const unsigned char *data) {
+  return static_cast<int32_t>((static_cast<uint32_t>(data[0]) << 8) |
+                              (static_cast<uint32_t>(data[1]) << 16) |
+                              (static_cast<uint32_t>(data[2]) << 24)) >>
+         8;
+}
+
+static inline void store_s24(unsigned char *data, int32_t value) {
+  uint32_t bits = static_cast<uint32_t>(value);
+  data[0] = static_cast<unsigned char>(bits);
+  data[1] = static_cast<unsigned char>(bits >> 8);
+  data[2] = static_cast<unsigned char>(bits >> 16);
+}
+
+// Rounds half to even: the bits below the shift plus half - 1 carry into the
+// kept bits if they are above half, or exactly half and the kept bits are odd
+static inline int32_t round_s24(int32_t value, int shift, int32_t upper) {
+  int32_t half = 1 << (shift - 1);
+  int32_t rounded = (value + half - 1 + ((value >> shift) & 1)) >> shift;
+  return std::min(rounded, upper) << shift;
+}
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+// Four samples per register: the 12 bytes are spread into the upper three
+// bytes of 32-bit lanes, so an arithmetic shift extends the sign
+__attribute__((target("ssse3"))) static size_t
+limit_packed_s24_ssse3(unsigned char *data, size_t count, int shift,
+                       int32_t upper) {
+  const __m128i unpack =
+      _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m128i pack =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m128i packed_bytes =
+      _mm_setr_epi32(-1, -1, -1, 0); // The 12 bytes of four samples
+  const __m128i vshift = _mm_cvtsi32_si128(shift);
+  const __m128i vbias = _mm_set1_epi32((1 << (shift - 1)) - 1);
+  const __m128i vone = _mm_set1_epi32(1);
+  const __m128i vupper = _mm_set1_epi32(upper);
+
+  // Every load reads 16 bytes, the last 4 belong to the next samples and are
+  // stored unchanged
+  size_t i = 0;
+  for (; i + 6 <= count; i += 4, data += 12) {
+    __m128i loaded = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    __m128i value = _mm_srai_epi32(_mm_shuffle_epi8(loaded, unpack), 8);
+    __m128i odd = _mm_and_si128(_mm_sra_epi32(value, vshift), vone);
+    __m128i rounded = _mm_sra_epi32(
+        _mm_add_epi32(_mm_add_epi32(value, vbias), odd), vshift);
+    __m128i above = _mm_cmpgt_epi32(rounded, vupper);
+    rounded = _mm_or_si128(_mm_and_si128(above, vupper),
+                           _mm_andnot_si128(above, rounded));
+    __m128i result = _mm_shuffle_epi8(_mm_sll_epi32(rounded, vshift), pack);
+    result = _mm_or_si128(_mm_and_si128(result, packed_bytes),
+                          _mm_andnot_si128(packed_bytes, loaded));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(data), result);
+  }
+  return i;
+}
+#endif
+
+void limit_packed_s24(char *bytes, size_t count, uint16_t bit_depth) {
+  if (bit_depth == 0 || bit_depth >= 24) {
+    return;
+  }
+  const int shift = 24 - bit_depth;
+  const int32_t upper = (1 << (bit_depth - 1)) - 1;
+  unsigned char *data = reinterpret_cast<unsigned char *>(bytes);
+
+  size_t i = 0;
+#ifdef VINYL_HAVE_X86_DISPATCH
+  static const bool ssse3 = __builtin_cpu_supports("ssse3");
+  if (ssse3) {
+    i = limit_packed_s24_ssse3(data, count, shift, upper);
+  }
+#endif
+
+  for (; i < count; ++i) {
+    store_s24(data + 3 * i, round_s24(load_s24(data + 3 * i), shift, upper));
+  }
+}
+
+void add_packed_s24(char *sample, int32_t value, int32_t lower,
+                    int32_t upper) {
+  unsigned char *data = reinterpret_cast<unsigned char *>(sample);
+  store_s24(data, std::clamp(load_s24(data) + value, lower, upper));
+}
+
+// Quantizer
+
+// The most bits a format can keep: the integer container or the mantissa
+static int format_bits(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::pcm_u8:
+    return 8;
+  case SampleFormat::pcm_s16:
+    return 16;
+  case SampleFormat::pcm_s24:
+  case SampleFormat::float32:
+    return 24;
+  case SampleFormat::pcm_s32:
+  case SampleFormat::float64:
+    return 32;
+  }
+  return 32;
+}
+
+static bool is_float(SampleFormat format) {
+  return format == SampleFormat::float32 || format == SampleFormat::float64;
+}
+
+// Quantizer kernels: they scale the samples to the bit depth, add the dither,
+// clamp, round to the nearest integer (half to even, like lrintf) and shift
+// the result into the container. Every instruction set has a kernel for 16
+// bit, 32 bit and float output, the other formats are packed from the 32 bit
+// values. The scalar kernels are the reference, the others return the same
+// bytes and leave the last samples to them.
+
+struct QuantizeRange {
+  float scale;         // 1.0 in units of the least significant bit
+  float lower;         // The smallest value
+  float upper;         // The largest value
+  float inverse_scale; // From the rounded value back to 1.0 (float output)
+  int shift;           // From the rounded value to the container
+};
+
+using QuantizeKernel = void (*)(const float *samples, const float *noise,
+                                size_t count, const QuantizeRange &range,
+                                char *bytes);
+
+template <SampleFormat format>
+static void quantize_scalar(const float *samples, const float *noise,
+                            size_t count, const QuantizeRange &range,
+                            char *bytes) {
+  for (size_t i = 0; i < count; ++i) {
+    float value = samples[i] * range.scale + (noise ? noise[i] : 0.f);
+    value = std::min(std::max(value, range.lower), range.upper);
+    int32_t rounded = static_cast<int32_t>(
+        static_cast<uint32_t>(std::lrintf(value)) << range.shift);
+    if constexpr (format == SampleFormat::pcm_s16) {
+      int16_t sample = static_cast<int16_t>(rounded);
+      std::memcpy(bytes + 2 * i, &sample, sizeof(sample));
+    } else if constexpr (format == SampleFormat::pcm_s32) {
+      std::memcpy(bytes + 4 * i, &rounded, sizeof(rounded));
+    } else {
+      float sample = static_cast<float>(rounded) * range.inverse_scale;
+      std::memcpy(bytes + 4 * i, &sample, sizeof(sample));
+    }
+  }
+}
+
+#if defined(__SSE2__)
+template <SampleFormat format>
+static void quantize_sse2(const float *samples, const float *noise,
+                          size_t count, const QuantizeRange &range,
+                          char *bytes) {
+  const __m128 vscale = _mm_set1_ps(range.scale);
+  const __m128 vlower = _mm_set1_ps(range.lower);
+  const __m128 vupper = _mm_set1_ps(range.upper);
+  const __m128 vinverse = _mm_set1_ps(range.inverse_scale);
+  const __m128i vshift = _mm_cvtsi32_si128(range.shift);
+  auto round = [&](size_t i) {
+    __m128 value = _mm_mul_ps(_mm_loadu_ps(samples + i), vscale);
+    if (noise) {
+      value = _mm_add_ps(value, _mm_loadu_ps(noise + i));
+    }
+    value = _mm_min_ps(_mm_max_ps(value, vlower), vupper);
+    return _mm_sll_epi32(_mm_cvtps_epi32(value), vshift);
+  };
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i low = round(i);
+    __m128i high = round(i + 4);
+    if constexpr (format == SampleFormat::pcm_s16) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + 2 * i),
+                       _mm_packs_epi32(low, high));
+    } else if constexpr (format == SampleFormat::pcm_s32) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + 4 * i), low);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + 4 * i + 16), high);
+    } else {
+      _mm_storeu_ps(reinterpret_cast<float *>(bytes + 4 * i),
+                    _mm_mul_ps(_mm_cvtepi32_ps(low), vinverse));
+      _mm_storeu_ps(reinterpret_cast<float *>(bytes + 4 * i + 16),
+                    _mm_mul_ps(_mm_cvtepi32_ps(high), vinverse));
+    }
+  }
+  quantize_scalar<format>(samples + i, noise ? noise + i : nullptr, count - i,
+                          range, bytes + bytes_per_sample(format) * i);
+}
+#endif
+
+#ifdef VINYL_HAVE_X86_DISPATCH
+template <SampleFormat format>
+__attribute__((target("avx2"))) static void
+quantize_avx2(const float *samples, const float *noise, size_t count,
+              const QuantizeRange &range, char *bytes) {
+  const __m256 vscale = _mm256_set1_ps(range.scale);
+  const __m256 vlower = _mm256_set1_ps(range.lower);
+  const __m256 vupper = _mm256_set1_ps(range.upper);
+  const __m256 vinverse = _mm256_set1_ps(range.inverse_scale);
+  const __m128i vshift = _mm_cvtsi32_si128(range.shift);
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i rounded[2];
+    for (int half = 0; half < 2; ++half) {
+      __m256 value =
+          _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8 * half), vscale);
+      if (noise) {
+        value = _mm256_add_ps(value, _mm256_loadu_ps(noise + i + 8 * half));
+      }
+      value = _mm256_min_ps(_mm256_max_ps(value, vlower), vupper);
+      rounded[half] = _mm256_sll_epi32(_mm256_cvtps_epi32(value), vshift);
+    }
+    if constexpr (format == SampleFormat::pcm_s16) {
+      // The packs work within the 128-bit lanes, the permute restores the
+      // order of the samples
+      __m256i packed = _mm256_packs_epi32(rounded[0], rounded[1]);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + 2 * i),
+                          _mm256_permute4x64_epi64(packed, 0xD8));
+    } else if constexpr (format == SampleFormat::pcm_s32) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + 4 * i),
+                          rounded[0]);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + 4 * i + 32),
+                          rounded[1]);
+    } else {
+      _mm256_storeu_ps(reinterpret_cast<float *>(bytes + 4 * i),
+                       _mm256_mul_ps(_mm256_cvtepi32_ps(rounded[0]), vinverse));
+      _mm256_storeu_ps(reinterpret_cast<float *>(bytes + 4 * i + 32),
+                       _mm256_mul_ps(_mm256_cvtepi32_ps(rounded[1]), vinverse));
+    }
+  }
+  // Without optimisation the compiler does not clear the upper halves of the
+  // registers, which slows down the SSE code that follows
+  _mm256_zeroupper();
+  quantize_scalar<format>(samples + i, noise ? noise + i : nullptr, count - i,
+                          range, bytes + bytes_per_sample(format) * i);
+}
+
+template <SampleFormat format>
+__attribute__((target("avx512f"))) static void
+quantize_avx512(const float *samples, const float *noise, size_t count,
+                const QuantizeRange &range, char *bytes) {
+  const __m512 vscale = _mm512_set1_ps(range.scale);
+  const __m512 vlower = _mm512_set1_ps(range.lower);
+  const __m512 vupper = _mm512_set1_ps(range.upper);
+  const __m512 vinverse = _mm512_set1_ps(range.inverse_scale);
+  const __m128i vshift = _mm_cvtsi32_si128(range.shift);
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 value = _mm512_mul_ps(_mm512_loadu_ps(samples + i), vscale);
+    if (noise) {
+      value = _mm512_add_ps(value, _mm512_loadu_ps(noise + i));
+    }
+    value = _mm512_min_ps(_mm512_max_ps(value, vlower), vupper);
+    __m512i rounded = _mm512_sll_epi32(_mm512_cvtps_epi32(value), vshift);
+    if constexpr (format == SampleFormat::pcm_s16) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + 2 * i),
+                          _mm512_cvtsepi32_epi16(rounded));
+    } else if constexpr (format == SampleFormat::pcm_s32) {
+      _mm512_storeu_si512(bytes + 4 * i, rounded);
+    } else {
+      _mm512_storeu_ps(bytes + 4 * i,
+                       _mm512_mul_ps(_mm512_cvtepi32_ps(rounded), vinverse));
+    }
+  }
+  _mm256_zeroupper();
+  quantize_scalar<format>(samples + i, noise ? noise + i : nullptr, count - i,
+                          range, bytes + bytes_per_sample(format) * i);
+}
+#endif
+
+// The kernels of one instruction set for 16 bit, 32 bit and float output
+struct QuantizeKernels {
+  QuantizeKernel s16;
+  QuantizeKernel s32;
+  QuantizeKernel float32;
+};
+
+#define VINYL_QUANTIZE_KERNELS(name)                                           \
+  QuantizeKernels {                                                            \
+    name<SampleFormat::pcm_s16>, name<SampleFormat::pcm_s32>,                  \
+        name<SampleFormat::float32>                                            \
+  }
+
+static QuantizeKernels quantize_kernels(InstructionSet set) {
+  switch (set) {
+#if defined(__SSE2__)
+  case InstructionSet::sse2:
+    return VINYL_QUANTIZE_KERNELS(quantize_sse2);
+#endif
+#ifdef VINYL_HAVE_X86_DISPATCH
+  case InstructionSet::avx2:
+    return VINYL_QUANTIZE_KERNELS(quantize_avx2);
+  case InstructionSet::avx512:
+    return VINYL_QUANTIZE_KERNELS(quantize_avx512);
+#endif
+  default:
+    return VINYL_QUANTIZE_KERNELS(quantize_scalar);
+  }
+}
+
+#undef VINYL_QUANTIZE_KERNELS
+
+const char *instruction_set_name(InstructionSet set) {
+  switch (set) {
+  case InstructionSet::scalar:
+    return "scalar";
+  case InstructionSet::sse2:
+    return "sse2";
+  case InstructionSet::avx2:
+    return "avx2";
+  case InstructionSet::avx512:
+    return "avx512";
+  }
+  return "scalar";
+}
+
+bool supports_instruction_set(InstructionSet set) {
+  switch (set) {
+  case InstructionSet::scalar:
+    return true;
+  case InstructionSet::sse2:
+#if defined(__SSE2__)
+    return true;
+#else
+    return false;
+#endif
+  case InstructionSet::avx2:
+#ifdef VINYL_HAVE_X86_DISPATCH
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+  case InstructionSet::avx512:
+#ifdef VINYL_HAVE_X86_DISPATCH
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+InstructionSet best_instruction_set() {
+  static const InstructionSet best = [] {
+    for (InstructionSet set : {InstructionSet::avx512, InstructionSet::avx2,
+                               InstructionSet::sse2}) {
+      if (supports_instruction_set(set)) {
+        return set;
+      }
+    }
+    return InstructionSet::scalar;
+  }();
+  return best;
+}
+
+Quantizer::Quantizer(SampleFormat format, uint16_t bit_depth, bool dither,
+                     uint64_t key)
+    : format(format), dither(dither), key(key),
+      kernels(best_instruction_set()) {
+  int max_bits = format_bits(format);
+  bits = bit_depth == 0 ? max_bits : std::min<int>(bit_depth, max_bits);
+  shift = is_float(format) ? 0 : max_bits - bits;
+
+  // Floats that keep every bit are not rounded at all
+  if (is_float(format) && bits == max_bits) {
+    bits = 0;
+  }
+}
+
+void Quantizer::use_instruction_set(InstructionSet set) {
+  if (!supports_instruction_set(set)) {
+    throw "The instruction set is not supported by this CPU.\n";
+  }
+  kernels = set;
+}
+
+void Quantizer::encode(const float *samples, size_t count, char *bytes) {
+  if (bits == 0) {
+    if (format == SampleFormat::float32) {
+      std::memcpy(bytes, samples, count * sizeof(float));
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        double value = samples[i];
+        std::memcpy(bytes + 8 * i, &value, sizeof(value));
+      }
+    }
+    return;
+  }
+
+  // Above 2^24 a float can not hold scale - 1, the largest float below full
+  // scale is used instead
+  QuantizeRange range;
+  range.scale = std::ldexp(1.f, bits - 1);
+  range.lower = -range.scale;
+  range.upper =
+      bits <= 24 ? range.scale - 1.f : std::nextafter(range.scale, 0.f);
+  range.inverse_scale = std::ldexp(1.f, 1 - bits);
+  range.shift = shift;
+  const QuantizeKernels kernel = quantize_kernels(kernels);
+
+  // The dither and the values of the other formats are computed in pieces
+  constexpr size_t piece = 4096;
+  float noise[piece];
+  float uniform[2 * piece];
+  int32_t values[piece];
+  for (size_t done = 0; done < count; done += piece) {
+    size_t n = std::min(piece, count - done);
+
+    // TPDF: the difference of two uniform values in [0, 1), the sample at
+    // position p gets the values 2p and 2p + 1 of the dither stream
+    if (dither) {
+      random_uniform({key, 0, RandomPurpose::dither}, 2 * position, 2 * n,
+                     uniform, kernels);
+      for (size_t i = 0; i < n; ++i) {
+        noise[i] = uniform[2 * i] - uniform[2 * i + 1];
+      }
+    }
+    position += n;
+    const float *piece_noise = dither ? noise : nullptr;
+    char *target = bytes + bytes_per_sample(format) * done;
+
+    switch (format) {
+    case SampleFormat::pcm_s16:
+      kernel.s16(samples + done, piece_noise, n, range, target);
+      break;
+    case SampleFormat::pcm_s32:
+      kernel.s32(samples + done, piece_noise, n, range, target);
+      break;
+    case SampleFormat::float32:
+      kernel.float32(samples + done, piece_noise, n, range, target);
+      break;
+    case SampleFormat::pcm_u8:
+      kernel.s32(samples + done, piece_noise, n, range,
+                 reinterpret_cast<char *>(values));
+      for (size_t i = 0; i < n; ++i) {
+        target[i] = static_cast<char>(values[i] + 128);
+      }
+      break;
+    case SampleFormat::pcm_s24:
+      kernel.s32(samples + done, piece_noise, n, range,
+                 reinterpret_cast<char *>(values));
+      for (size_t i = 0; i < n; ++i) {
+        uint32_t value = static_cast<uint32_t>(values[i]);
+        target[3 * i] = static_cast<char>(value);
+        target[3 * i + 1] = static_cast<char>(value >> 8);
+        target[3 * i + 2] = static_cast<char>(value >> 16);
+      }
+      break;
+    case SampleFormat::float64:
+      // Rounded like float output, but with a 32 bit value (shift is 0)
+      kernel.s32(samples + done, piece_noise, n, range,
+                 reinterpret_cast<char *>(values));
+      for (size_t i = 0; i < n; ++i) {
+        double value = static_cast<double>(values[i]) * range.inverse_scale;
+        std::memcpy(target + 8 * i, &value, sizeof(value));
+      }
+      break;
+    }
+  }
+}
+
+// Planar buffers are converted in pieces that stay in the cache. The scratch
+// buffer is kept per thread, so converting does not allocate.
+
+static constexpr size_t conversion_frames = 4096;
+
+void decode_samples(const char *bytes, size_t frames, SampleFormat format,
+                    SampleBuffer<float> &samples, size_t first) {
+  const uint16_t channels = samples.channels();
+  const size_t frame_size = bytes_per_sample(format) * channels;
+  thread_local std::vector<float> interleaved;
+  interleaved.resize(std::min(frames, conversion_frames) * channels);
+
+  for (size_t done = 0; done < frames; done += conversion_frames) {
+    size_t count = std::min(conversion_frames, frames - done);
+    decode_samples(bytes + done * frame_size, count * channels, format,
+                   interleaved.data());
+    deinterleave(interleaved.data(), count, samples, first + done);
+  }
+}
+
+void Quantizer::encode(const SampleBuffer<float> &samples, size_t first,
+                       size_t frames, char *bytes) {
+  const uint16_t channels = samples.channels();
+  const size_t frame_size = bytes_per_sample(format) * channels;
+  thread_local std::vector<float> interleaved;
+  interleaved.resize(std::min(frames, conversion_frames) * channels);
+
+  for (size_t done = 0; done < frames; done += conversion_frames) {
+    size_t count = std::min(conversion_frames, frames - done);
+    interleave(samples, first + done, count, interleaved.data());
+    encode(interleaved.data(), count * channels, bytes + done * frame_size);
+  }
+}
+
+// Benchmark
+
+void output_quantizer_benchmark(uint16_t bit_depth, bool dither) {
+  // Half a million samples (2 MiB) stay in the cache of most CPUs, they go
+  // slightly beyond full scale so the clamping is measured too
+  constexpr size_t count = size_t(1) << 19;
+  std::vector<float> samples(count);
+  random_uniform({0, 0, RandomPurpose::benchmark}, 0, count, samples.data());
+  for (size_t i = 0; i < count; ++i) {
+    samples[i] = (2.f * samples[i] - 1.f) * 1.05f;
+  }
+
+  const SampleFormat formats[] = {SampleFormat::pcm_s16, SampleFormat::pcm_s32,
+                                  SampleFormat::float32};
+  const char *format_names[] = {"16 bit", "32 bit", "float"};
+  const InstructionSet best = best_instruction_set();
+
+  std::ostringstream out;
+  out << "Quantizer throughput at " << bit_depth << " bit"
+      << (dither ? " with dither" : "") << " (in samples/s):\n"
+      << std::left << std::setw(8) << "format";
+  for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                             InstructionSet::avx2, InstructionSet::avx512}) {
+    out << std::right << std::setw(12) << instruction_set_name(set);
+  }
+  out << '\n';
+
+  for (size_t f = 0; f < 3; ++f) {
+    const size_t size = count * bytes_per_sample(formats[f]);
+    std::vector<char> reference(size);
+    std::vector<char> bytes(size);
+    Quantizer scalar(formats[f], bit_depth, dither);
+    scalar.use_instruction_set(InstructionSet::scalar);
+    scalar.encode(samples.data(), count, reference.data());
+
+    out << std::left << std::setw(8) << format_names[f] << std::right;
+    for (InstructionSet set : {InstructionSet::scalar, InstructionSet::sse2,
+                               InstructionSet::avx2, InstructionSet::avx512}) {
+      if (!supports_instruction_set(set)) {
+        out << std::setw(12) << "-";
+        continue;
+      }
+
+      // Repeated for at least 0.2s, every run starts at the same position
+      // so it encodes the same bytes
+      uint64_t encoded = 0;
+      auto begin = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed(0);
+      while (elapsed.count() < 0.2) {
+        Quantizer quantizer(formats[f], bit_depth, dither);
+        quantizer.use_instruction_set(set);
+        quantizer.encode(samples.data(), count, bytes.data());
+        encoded += count;
+        elapsed = std::chrono::steady_clock::now() - begin;
+      }
+
+      std::ostringstream rate;
+      rate << std::scientific << std::setprecision(2)
+           << encoded / elapsed.count() << (bytes == reference ? "" : "!")
+           << (set == best ? "*" : "");
+      out << std::setw(12) << rate.str();
+    }
+    out << '\n';
+  }
+  out << "* chosen for this CPU, ! differs from the scalar kernel";
+  std::cerr << out.str() << std::endl;
+}
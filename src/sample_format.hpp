@@ -0,0 +1,193 @@
+#ifndef SAMPLE_FORMAT_H
+#define SAMPLE_FORMAT_H
+#include "filehandler.hpp"
+#include "sample_buffer.hpp"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The sample encodings of WAV files that can be decoded. Internally every
+ * sample is a float where 1.0 is full scale, so the filters never convert or
+ * round. The samples are rounded once, by the Quantizer, when they are
+ * written.
+ */
+enum class SampleFormat {
+  pcm_u8,  // 8 bit unsigned integer
+  pcm_s16, // 16 bit signed integer
+  pcm_s24, // 24 bit signed integer (packed, 3 bytes)
+  pcm_s32, // 32 bit signed integer
+  float32, // 32 bit IEEE float
+  float64, // 64 bit IEEE float
+};
+
+/**
+ * A function that returns the sample encoding of a WAV file.
+ *
+ * @param[in] wav The header of the file.
+ * @return The sample encoding.
+ */
+SampleFormat sample_format_of(const WAVHeader &wav);
+
+/**
+ * A function that returns the number of bytes of one encoded sample.
+ *
+ * @param[in] format The sample encoding.
+ * @return The size in bytes.
+ */
+size_t bytes_per_sample(SampleFormat format);
+
+/**
+ * A function that decodes interleaved samples from the byte layout of a WAV
+ * file into floats.
+ *
+ * @param[in] bytes The encoded samples.
+ * @param[in] count The number of samples.
+ * @param[in] format The sample encoding.
+ * @param[out] samples The buffer for count samples.
+ */
+void decode_samples(const char *bytes, size_t count, SampleFormat format,
+                    float *samples);
+
+/**
+ * A function that decodes interleaved frames from the byte layout of a WAV
+ * file into a planar buffer.
+ *
+ * @param[in] bytes The encoded frames.
+ * @param[in] frames The number of frames.
+ * @param[in] format The sample encoding.
+ * @param[out] samples The planar buffer.
+ * @param[in] first The first frame of the buffer that is written.
+ */
+void decode_samples(const char *bytes, size_t frames, SampleFormat format,
+                    SampleBuffer<float> &samples, size_t first);
+
+/**
+ * A function that rounds packed 24-bit samples in place to a lower bit depth.
+ * They are rounded (half to even) and clamped like the Quantizer rounds the
+ * decoded samples, but they are never widened to floats.
+ *
+ * @param[out] bytes The packed little-endian samples.
+ * @param[in] count The number of samples.
+ * @param[in] bit_depth The bits that are kept (0 or 24 and more: all bits).
+ */
+void limit_packed_s24(char *bytes, size_t count, uint16_t bit_depth);
+
+/**
+ * A function that adds a value to one packed 24-bit sample in place.
+ *
+ * @param[out] sample The 3 bytes of the sample.
+ * @param[in] value The value in units of the least significant bit.
+ * @param[in] lower The smallest result.
+ * @param[in] upper The largest result.
+ */
+void add_packed_s24(char *sample, int32_t value, int32_t lower, int32_t upper);
+
+/**
+ * The instruction sets the Quantizer has kernels for. The best one the CPU
+ * supports is chosen at runtime, the scalar kernels are the reference.
+ */
+enum class InstructionSet {
+  scalar, // Plain C++
+  sse2,   // 4 samples per instruction (x86-64 baseline)
+  avx2,   // 8 samples per instruction
+  avx512, // 16 samples per instruction (AVX-512F)
+};
+
+/**
+ * @param[in] set The instruction set.
+ * @return The name of the instruction set.
+ */
+const char *instruction_set_name(InstructionSet set);
+
+/**
+ * @param[in] set The instruction set.
+ * @return true if the CPU (and the build) supports the instruction set.
+ */
+bool supports_instruction_set(InstructionSet set);
+
+/**
+ * @return The instruction set with the widest registers the CPU supports.
+ */
+InstructionSet best_instruction_set();
+
+/**
+ * A function that measures how many samples per second the Quantizer encodes
+ * with every instruction set the CPU supports, for 16 bit, 32 bit and float
+ * output, and prints them (to stderr). The output of every kernel is compared
+ * to the scalar kernel.
+ *
+ * @param[in] bit_depth The bits that are kept.
+ * @param[in] dither Whether to add dither before rounding.
+ */
+void output_quantizer_benchmark(uint16_t bit_depth, bool dither);
+
+/**
+ * The conversion from floats into the byte layout of a WAV file. Every sample
+ * is rounded once to the bit depth of the output (at most the bits the format
+ * can hold) and clamped to its range. Optionally TPDF dither of +-1 LSB is
+ * added before rounding. The dither only depends on its key and the index of
+ * the sample, so the output does not depend on how the samples are split into
+ * blocks.
+ */
+class Quantizer {
+public:
+  /**
+   * @param[in] format The sample encoding of the output.
+   * @param[in] bit_depth The bits that are kept (0 for all bits of the
+   * format).
+   * @param[in] dither Whether to add dither before rounding.
+   * @param[in] key The key of the dither (random_key of the seed and the
+   * file).
+   */
+  Quantizer(SampleFormat format, uint16_t bit_depth, bool dither,
+            uint64_t key = 0);
+
+  /**
+   * A function that rounds and encodes interleaved samples.
+   *
+   * @param[in] samples The samples.
+   * @param[in] count The number of samples.
+   * @param[out] bytes The buffer for count * bytes_per_sample(format) bytes.
+   */
+  void encode(const float *samples, size_t count, char *bytes);
+
+  /**
+   * A function that rounds and encodes frames of a planar buffer into the
+   * interleaved byte layout of a WAV file.
+   *
+   * @param[in] samples The planar buffer.
+   * @param[in] first The first frame to encode.
+   * @param[in] frames The number of frames.
+   * @param[out] bytes The buffer for frames * block align bytes.
+   */
+  void encode(const SampleBuffer<float> &samples, size_t first, size_t frames,
+              char *bytes);
+
+  /**
+   * A function that skips samples that are already encoded (e.g. packed
+   * samples that were filtered in place), so the dither of the following
+   * samples stays the same.
+   *
+   * @param[in] count The number of samples.
+   */
+  void skip(size_t count) { position += count; }
+
+  /**
+   * A function that selects the kernels of an instruction set instead of the
+   * best one (throws if the CPU does not support it).
+   *
+   * @param[in] set The instruction set.
+   */
+  void use_instruction_set(InstructionSet set);
+
+private:
+  SampleFormat format;
+  int bits;   // Bits the samples are rounded to (0: not rounded)
+  int shift;  // Shift from the rounded value to the container
+  bool dither;
+  uint64_t key;           // The key of the dither
+  InstructionSet kernels; // The kernels that round the samples
+  uint64_t position = 0;  // Samples encoded so far, the dither depends on it
+};
+
+#endif
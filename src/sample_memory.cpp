@@ -0,0 +1,313 @@
+#include "sample_memory.hpp"
+#include "stage_memory.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define VINYL_HAVE_HUGE_PAGES 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define VINYL_HAVE_SPILL 1
+#endif
+
+// The size of a huge page on x86-64 and most arm64 systems
+constexpr size_t huge_page_size = size_t(2) << 20;
+
+// Numbers of the Linux memory policy API (numaif.h is not always installed)
+constexpr int mpol_preferred = 1;
+
+static SampleMemoryPolicy memory_policy;
+
+// The counters of SampleMemoryStats. Every allocation updates them, so they
+// are atomic and only the rare NUMA bindings take a lock.
+static struct {
+  std::atomic<uint64_t> normal_allocations{0};
+  std::atomic<uint64_t> normal_bytes{0};
+  std::atomic<uint64_t> thp_allocations{0};
+  std::atomic<uint64_t> thp_bytes{0};
+  std::atomic<uint64_t> hugetlb_allocations{0};
+  std::atomic<uint64_t> hugetlb_bytes{0};
+  std::atomic<uint64_t> hugetlb_fallbacks{0};
+  std::atomic<uint64_t> spilled_allocations{0};
+  std::atomic<uint64_t> spilled_bytes{0};
+} totals;
+static std::mutex node_mutex;
+static std::vector<uint64_t> node_bytes; // Bytes bound to every NUMA node
+
+// The memory budget: sample buffers beyond it are spilled to temporary files.
+// The mutex only guards the spilled buffers.
+static std::atomic<uint64_t> memory_budget{0}; // 0: unlimited
+static std::atomic<uint64_t> live_bytes{0};    // Bytes of all sample buffers
+static std::atomic<uint64_t> spilled_count{0}; // Buffers in spilled
+static std::mutex budget_mutex;
+static std::map<void *, size_t> spilled; // Spilled buffers and their size
+
+PageMode parse_page_mode(const std::string &name) {
+  if (name == "normal") {
+    return PageMode::normal;
+  } else if (name == "thp") {
+    return PageMode::thp;
+  } else if (name == "hugetlb") {
+    return PageMode::hugetlb;
+  }
+  throw "Unknown page mode (use normal, thp or hugetlb).\n";
+}
+
+void set_sample_memory_policy(const SampleMemoryPolicy &policy) {
+  memory_policy = policy;
+  return;
+}
+
+void set_sample_memory_budget(uint64_t bytes) {
+  memory_budget = bytes;
+  return;
+}
+
+// Buffers of at least one huge page are mapped if the policy needs it
+static bool uses_mapping(size_t bytes) {
+#ifdef VINYL_HAVE_HUGE_PAGES
+  return bytes >= huge_page_size &&
+         (memory_policy.pages != PageMode::normal || memory_policy.numa_local);
+#else
+  (void)bytes;
+  return false;
+#endif
+}
+
+static size_t mapping_size(size_t bytes) {
+  return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+}
+
+#ifdef VINYL_HAVE_HUGE_PAGES
+// Maps memory that starts at a huge page boundary, so that it can be backed by
+// transparent huge pages from the first byte
+static void *map_aligned(size_t size) {
+  size_t padded = size + huge_page_size;
+  void *memory = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+  uintptr_t aligned =
+      (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+  if (aligned > start) {
+    munmap(memory, aligned - start);
+  }
+  size_t tail = start + padded - (aligned + size);
+  if (tail > 0) {
+    munmap(reinterpret_cast<void *>(aligned + size), tail);
+  }
+  return reinterpret_cast<void *>(aligned);
+}
+
+// Prefers the NUMA node of the calling thread for the pages of the memory
+static void bind_to_local_node(void *memory, size_t size) {
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return;
+  }
+
+  constexpr size_t bits = sizeof(unsigned long) * 8;
+  std::vector<unsigned long> mask(node / bits + 1, 0);
+  mask[node / bits] |= 1ul << (node % bits);
+  if (syscall(SYS_mbind, memory, size, mpol_preferred, mask.data(),
+              mask.size() * bits + 1, 0) != 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(node_mutex);
+  if (node_bytes.size() <= node) {
+    node_bytes.resize(node + 1, 0);
+  }
+  node_bytes[node] += size;
+}
+#endif
+
+static void *allocate_in_memory(size_t bytes, size_t alignment) {
+  if (!uses_mapping(bytes)) {
+    void *memory = ::operator new(bytes, std::align_val_t(alignment));
+    ++totals.normal_allocations;
+    totals.normal_bytes += bytes;
+    return memory;
+  }
+
+#ifdef VINYL_HAVE_HUGE_PAGES
+  size_t size = mapping_size(bytes);
+  void *memory = nullptr;
+  bool hugetlb = false;
+  if (memory_policy.pages == PageMode::hugetlb) {
+    memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugetlb = memory != MAP_FAILED;
+    if (!hugetlb) {
+      memory = nullptr;
+      ++totals.hugetlb_fallbacks;
+    }
+  }
+  if (!memory) {
+    memory = map_aligned(size);
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+    if (memory_policy.pages != PageMode::normal) {
+      madvise(memory, size, MADV_HUGEPAGE);
+    }
+  }
+
+  // The policy has to be set before the pages are touched
+  if (memory_policy.numa_local) {
+    bind_to_local_node(memory, size);
+  }
+
+  record_stage_allocation(size);
+  if (hugetlb) {
+    ++totals.hugetlb_allocations;
+    totals.hugetlb_bytes += size;
+  } else if (memory_policy.pages != PageMode::normal) {
+    ++totals.thp_allocations;
+    totals.thp_bytes += size;
+  } else {
+    ++totals.normal_allocations;
+    totals.normal_bytes += size;
+  }
+  return memory;
+#else
+  throw std::bad_alloc();
+#endif
+}
+
+static void free_in_memory(void *memory, size_t bytes, size_t alignment) {
+  if (!uses_mapping(bytes)) {
+    ::operator delete(memory, std::align_val_t(alignment));
+    return;
+  }
+
+#ifdef VINYL_HAVE_HUGE_PAGES
+  munmap(memory, mapping_size(bytes));
+  record_stage_free(mapping_size(bytes));
+#endif
+  return;
+}
+
+#ifdef VINYL_HAVE_SPILL
+// Maps a new temporary file that is removed again right away. The kernel can
+// write its pages back to the disk instead of running out of memory.
+static void *map_spill_file(size_t bytes) {
+  const char *directory = std::getenv("TMPDIR");
+  std::string path = std::string(directory ? directory : "/tmp") +
+                     "/vinyl-spill-XXXXXX";
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    return nullptr;
+  }
+  unlink(path.c_str());
+
+  void *memory = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+    memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return memory == MAP_FAILED ? nullptr : memory;
+}
+#endif
+
+void *allocate_samples(size_t bytes, size_t alignment) {
+#ifdef VINYL_HAVE_SPILL
+  uint64_t live = live_bytes += bytes;
+  uint64_t budget = memory_budget;
+  if (budget > 0 && bytes >= huge_page_size && live > budget) {
+    void *memory = map_spill_file(bytes);
+    if (memory) {
+      {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        spilled[memory] = bytes;
+      }
+      ++spilled_count;
+      record_stage_allocation(bytes);
+      ++totals.spilled_allocations;
+      totals.spilled_bytes += bytes;
+      return memory;
+    }
+  }
+#endif
+  return allocate_in_memory(bytes, alignment);
+}
+
+void deallocate_samples(void *memory, size_t bytes, size_t alignment) {
+#ifdef VINYL_HAVE_SPILL
+  live_bytes -= bytes;
+  // Only large buffers are spilled
+  if (bytes >= huge_page_size && spilled_count > 0) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    auto found = spilled.find(memory);
+    if (found != spilled.end()) {
+      munmap(memory, found->second);
+      record_stage_free(found->second);
+      spilled.erase(found);
+      --spilled_count;
+      return;
+    }
+  }
+#endif
+  free_in_memory(memory, bytes, alignment);
+  return;
+}
+
+SampleMemoryStats sample_memory_stats() {
+  SampleMemoryStats stats;
+  stats.normal_allocations = totals.normal_allocations;
+  stats.normal_bytes = totals.normal_bytes;
+  stats.thp_allocations = totals.thp_allocations;
+  stats.thp_bytes = totals.thp_bytes;
+  stats.hugetlb_allocations = totals.hugetlb_allocations;
+  stats.hugetlb_bytes = totals.hugetlb_bytes;
+  stats.hugetlb_fallbacks = totals.hugetlb_fallbacks;
+  stats.spilled_allocations = totals.spilled_allocations;
+  stats.spilled_bytes = totals.spilled_bytes;
+  std::lock_guard<std::mutex> lock(node_mutex);
+  stats.node_bytes = node_bytes;
+  return stats;
+}
+
+void output_sample_memory_stats() {
+  SampleMemoryStats stats = sample_memory_stats();
+  auto mib = [](uint64_t bytes) { return bytes / double(1 << 20); };
+  std::cerr << "Sample memory: " << stats.normal_allocations << " normal pages ("
+            << mib(stats.normal_bytes) << " MiB), " << stats.thp_allocations
+            << " transparent huge pages (" << mib(stats.thp_bytes)
+            << " MiB), " << stats.hugetlb_allocations << " explicit huge pages ("
+            << mib(stats.hugetlb_bytes) << " MiB)" << std::endl;
+  if (stats.hugetlb_fallbacks > 0) {
+    std::cerr << "Explicit huge pages not available for "
+              << stats.hugetlb_fallbacks
+              << " buffers (reserve them in /proc/sys/vm/nr_hugepages)"
+              << std::endl;
+  }
+  if (stats.spilled_allocations > 0) {
+    std::cerr << "Spilled to temporary files: " << stats.spilled_allocations
+              << " buffers (" << mib(stats.spilled_bytes) << " MiB)"
+              << std::endl;
+  }
+  for (size_t node = 0; node < stats.node_bytes.size(); ++node) {
+    if (stats.node_bytes[node] > 0) {
+      std::cerr << "NUMA node " << node << ": " << mib(stats.node_bytes[node])
+                << " MiB" << std::endl;
+    }
+  }
+  return;
+}
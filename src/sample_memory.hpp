@@ -0,0 +1,97 @@
+#ifndef SAMPLE_MEMORY_H
+#define SAMPLE_MEMORY_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * The kinds of memory large sample buffers can be placed in. Buffers smaller
+ * than a huge page always come from the heap.
+ */
+enum class PageMode {
+  normal,  // Aligned heap memory
+  thp,     // Mappings that are marked for transparent huge pages
+  hugetlb, // Explicit huge pages (falls back to thp if none are reserved)
+};
+
+/**
+ * The memory policy for sample buffers. It is set once at startup.
+ */
+struct SampleMemoryPolicy {
+  PageMode pages = PageMode::normal;
+  bool numa_local = false; // Place the pages on the node of the thread that
+                           // allocates the buffer (the one that filters it)
+};
+
+/**
+ * Where the sample buffers were placed so far.
+ */
+struct SampleMemoryStats {
+  uint64_t normal_allocations = 0;  // Buffers with normal pages
+  uint64_t normal_bytes = 0;        // in 1B
+  uint64_t thp_allocations = 0;     // Mappings for transparent huge pages
+  uint64_t thp_bytes = 0;           // in 1B
+  uint64_t hugetlb_allocations = 0; // Mappings with explicit huge pages
+  uint64_t hugetlb_bytes = 0;       // in 1B
+  uint64_t hugetlb_fallbacks = 0;   // Explicit huge pages that failed
+  uint64_t spilled_allocations = 0; // Buffers in temporary files
+  uint64_t spilled_bytes = 0;       // in 1B
+  std::vector<uint64_t> node_bytes; // Bytes bound to every NUMA node
+};
+
+/**
+ * A function that converts the name of a page mode from the command line.
+ *
+ * @param[in] name "normal", "thp" or "hugetlb"
+ * @return The page mode
+ */
+PageMode parse_page_mode(const std::string &name);
+
+/**
+ * A function that sets the memory policy for all later sample buffers.
+ *
+ * @param[in] policy The policy
+ */
+void set_sample_memory_policy(const SampleMemoryPolicy &policy);
+
+/**
+ * A function that sets the memory budget for sample buffers. Buffers of 2 MiB
+ * and more that would exceed it are placed in temporary files (in TMPDIR or
+ * /tmp) that are mapped into memory, so the kernel can write them back instead
+ * of running out of memory.
+ *
+ * @param[in] bytes The budget in bytes (0 for no budget)
+ */
+void set_sample_memory_budget(uint64_t bytes);
+
+/**
+ * A function that allocates the memory of a sample buffer according to the
+ * policy and the budget.
+ *
+ * @param[in] bytes The size in bytes.
+ * @param[in] alignment The alignment of the start in bytes.
+ * @return The memory (throws std::bad_alloc if there is none).
+ */
+void *allocate_samples(size_t bytes, size_t alignment);
+
+/**
+ * A function that frees memory of allocate_samples.
+ *
+ * @param[in] memory The memory.
+ * @param[in] bytes The size that was allocated.
+ * @param[in] alignment The alignment that was requested.
+ */
+void deallocate_samples(void *memory, size_t bytes, size_t alignment);
+
+/**
+ * @return Where the sample buffers were placed so far.
+ */
+SampleMemoryStats sample_memory_stats();
+
+/**
+ * A function that prints where the sample buffers were placed.
+ */
+void output_sample_memory_stats();
+
+#endif
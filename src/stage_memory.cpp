@@ -0,0 +1,243 @@
+#include "stage_memory.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define VINYL_HAVE_ALLOCATION_HOOK 1
+#endif
+
+static const char *const stage_names[stage_count] = {
+    "other",    "read",   "crackle", "pop",  "bit-depth",
+    "resample", "resize", "needles", "write"};
+
+/**
+ * The counters of a stage, they are updated by all threads
+ */
+struct StageCounters {
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> allocated_bytes{0};
+  std::atomic<uint64_t> freed_bytes{0};
+  std::atomic<uint64_t> peak_live_bytes{0};
+};
+
+static std::atomic<bool> counting{false};
+static std::atomic<int64_t> live_bytes{0};
+static std::atomic<uint64_t> peak_live_bytes{0};
+static StageCounters counters[stage_count];
+
+// Constant initialised, so it can be used inside operator new
+static thread_local Stage current_stage = Stage::other;
+
+static void raise_peak(std::atomic<uint64_t> &peak, uint64_t value) {
+  uint64_t seen = peak.load(std::memory_order_relaxed);
+  while (seen < value &&
+         !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+  }
+}
+
+static uint64_t current_live_bytes() {
+  return static_cast<uint64_t>(
+      std::max<int64_t>(live_bytes.load(std::memory_order_relaxed), 0));
+}
+
+StageReportFormat parse_stage_report_format(const std::string &name) {
+  if (name == "off") {
+    return StageReportFormat::off;
+  } else if (name == "table") {
+    return StageReportFormat::table;
+  } else if (name == "json") {
+    return StageReportFormat::json;
+  }
+  throw "Unknown memory report format (use off, table or json).\n";
+}
+
+void enable_stage_memory() {
+  counting.store(true, std::memory_order_relaxed);
+  return;
+}
+
+void record_stage_allocation(size_t bytes) {
+  if (!counting.load(std::memory_order_relaxed)) {
+    return;
+  }
+  StageCounters &stage = counters[static_cast<size_t>(current_stage)];
+  stage.allocations.fetch_add(1, std::memory_order_relaxed);
+  stage.allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  int64_t live =
+      live_bytes.fetch_add(static_cast<int64_t>(bytes),
+                           std::memory_order_relaxed) +
+      static_cast<int64_t>(bytes);
+  uint64_t value = static_cast<uint64_t>(std::max<int64_t>(live, 0));
+  raise_peak(stage.peak_live_bytes, value);
+  raise_peak(peak_live_bytes, value);
+}
+
+void record_stage_free(size_t bytes) {
+  if (!counting.load(std::memory_order_relaxed)) {
+    return;
+  }
+  StageCounters &stage = counters[static_cast<size_t>(current_stage)];
+  stage.freed_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  live_bytes.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+}
+
+void reset_stage_memory() {
+  for (auto &stage : counters) {
+    stage.allocations.store(0, std::memory_order_relaxed);
+    stage.allocated_bytes.store(0, std::memory_order_relaxed);
+    stage.freed_bytes.store(0, std::memory_order_relaxed);
+    stage.peak_live_bytes.store(0, std::memory_order_relaxed);
+  }
+  peak_live_bytes.store(current_live_bytes(), std::memory_order_relaxed);
+  return;
+}
+
+StageMemoryReport stage_memory_report() {
+  StageMemoryReport report;
+  for (size_t i = 0; i < stage_count; ++i) {
+    report.stages[i].allocations =
+        counters[i].allocations.load(std::memory_order_relaxed);
+    report.stages[i].allocated_bytes =
+        counters[i].allocated_bytes.load(std::memory_order_relaxed);
+    report.stages[i].freed_bytes =
+        counters[i].freed_bytes.load(std::memory_order_relaxed);
+    report.stages[i].peak_live_bytes =
+        counters[i].peak_live_bytes.load(std::memory_order_relaxed);
+  }
+  report.peak_live_bytes = peak_live_bytes.load(std::memory_order_relaxed);
+  return report;
+}
+
+// Escapes a file name for a JSON string
+static std::string json_string(const std::string &text) {
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<int>(c) << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+void output_stage_memory_report(const std::string &file,
+                                const StageMemoryReport &report,
+                                StageReportFormat format) {
+  if (format == StageReportFormat::json) {
+    std::ostringstream out;
+    out << "{\"file\":" << json_string(file)
+        << ",\"peak_live_bytes\":" << report.peak_live_bytes
+        << ",\"stages\":{";
+    for (size_t i = 0; i < stage_count; ++i) {
+      const StageMemoryStats &stage = report.stages[i];
+      out << (i ? "," : "") << '"' << stage_names[i] << "\":{"
+          << "\"allocations\":" << stage.allocations
+          << ",\"allocated_bytes\":" << stage.allocated_bytes
+          << ",\"freed_bytes\":" << stage.freed_bytes
+          << ",\"peak_live_bytes\":" << stage.peak_live_bytes << '}';
+    }
+    out << "}}";
+    std::cerr << out.str() << std::endl;
+  } else if (format == StageReportFormat::table) {
+    auto mib = [](uint64_t bytes) { return bytes / double(1 << 20); };
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    out << "Memory of " << file << " by stage:\n"
+        << std::left << std::setw(11) << "stage" << std::right
+        << std::setw(12) << "allocations" << std::setw(16) << "allocated MiB"
+        << std::setw(12) << "freed MiB" << std::setw(16) << "peak live MiB"
+        << '\n';
+    for (size_t i = 0; i < stage_count; ++i) {
+      const StageMemoryStats &stage = report.stages[i];
+      out << std::left << std::setw(11) << stage_names[i] << std::right
+          << std::setw(12) << stage.allocations << std::setw(16)
+          << mib(stage.allocated_bytes) << std::setw(12)
+          << mib(stage.freed_bytes) << std::setw(16)
+          << mib(stage.peak_live_bytes) << '\n';
+    }
+    out << "Peak live memory: " << mib(report.peak_live_bytes) << " MiB";
+    std::cerr << out.str() << std::endl;
+  }
+  return;
+}
+
+StageScope::StageScope(Stage stage) : previous(current_stage) {
+  current_stage = stage;
+}
+
+StageScope::~StageScope() { current_stage = previous; }
+
+#ifdef VINYL_HAVE_ALLOCATION_HOOK
+// The global allocation functions are replaced, so that every allocation of
+// the program is counted. The usable size of the block is counted, as it is
+// known again when the block is freed.
+
+static void *counted_allocation(void *memory) {
+  if (memory && counting.load(std::memory_order_relaxed)) {
+    record_stage_allocation(malloc_usable_size(memory));
+  }
+  return memory;
+}
+
+static void counted_free(void *memory) {
+  if (memory && counting.load(std::memory_order_relaxed)) {
+    record_stage_free(malloc_usable_size(memory));
+  }
+  std::free(memory);
+}
+
+static void *allocate_or_throw(size_t size) {
+  void *memory = std::malloc(size ? size : 1);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  return counted_allocation(memory);
+}
+
+static void *allocate_aligned_or_throw(size_t size, std::align_val_t align) {
+  size_t alignment = std::max(static_cast<size_t>(align), sizeof(void *));
+  void *memory = nullptr;
+  if (posix_memalign(&memory, alignment, size ? size : 1) != 0) {
+    throw std::bad_alloc();
+  }
+  return counted_allocation(memory);
+}
+
+void *operator new(size_t size) { return allocate_or_throw(size); }
+void *operator new[](size_t size) { return allocate_or_throw(size); }
+void *operator new(size_t size, std::align_val_t align) {
+  return allocate_aligned_or_throw(size, align);
+}
+void *operator new[](size_t size, std::align_val_t align) {
+  return allocate_aligned_or_throw(size, align);
+}
+
+void operator delete(void *memory) noexcept { counted_free(memory); }
+void operator delete[](void *memory) noexcept { counted_free(memory); }
+void operator delete(void *memory, size_t) noexcept { counted_free(memory); }
+void operator delete[](void *memory, size_t) noexcept { counted_free(memory); }
+void operator delete(void *memory, std::align_val_t) noexcept {
+  counted_free(memory);
+}
+void operator delete[](void *memory, std::align_val_t) noexcept {
+  counted_free(memory);
+}
+void operator delete(void *memory, size_t, std::align_val_t) noexcept {
+  counted_free(memory);
+}
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept {
+  counted_free(memory);
+}
+#endif
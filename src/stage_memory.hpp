@@ -0,0 +1,120 @@
+#ifndef STAGE_MEMORY_H
+#define STAGE_MEMORY_H
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * The stages of the vinyl filter that allocations are attributed to.
+ */
+enum class Stage {
+  other,     // Everything outside of the stages below
+  read,      // Reading and decoding the input
+  crackle,   // Crackle noise
+  pop,       // Pop noise
+  bit_depth, // Limiting the bit depth
+  resample,  // Resampling into the output buffer
+  resize,    // Cutting / padding the track to its length
+  needles,   // The needle sounds
+  write,     // Encoding and writing the output
+};
+
+constexpr size_t stage_count = 9;
+
+/**
+ * The allocations of one stage. Frees are attributed to the stage that frees
+ * the memory, which is not always the one that allocated it.
+ */
+struct StageMemoryStats {
+  uint64_t allocations = 0;     // Allocations in the stage
+  uint64_t allocated_bytes = 0; // in 1B
+  uint64_t freed_bytes = 0;     // in 1B
+  uint64_t peak_live_bytes = 0; // Peak of the live bytes during the stage
+};
+
+/**
+ * The allocations of all stages since reset_stage_memory.
+ */
+struct StageMemoryReport {
+  std::array<StageMemoryStats, stage_count> stages;
+  uint64_t peak_live_bytes = 0; // Peak of the live bytes of the process
+};
+
+/**
+ * The formats of the report.
+ */
+enum class StageReportFormat {
+  off,   // No report
+  table, // A table for humans
+  json,  // One JSON object per file
+};
+
+/**
+ * A function that converts the name of a report format from the command line.
+ *
+ * @param[in] name "off", "table" or "json"
+ * @return The format
+ */
+StageReportFormat parse_stage_report_format(const std::string &name);
+
+/**
+ * A function that starts counting allocations. It is called once at startup,
+ * before the first file is read. Without it the allocations are not counted.
+ */
+void enable_stage_memory();
+
+/**
+ * A function that counts an allocation that does not come from operator new
+ * (e.g. a mapping) for the stage of the calling thread.
+ *
+ * @param[in] bytes The size in bytes.
+ */
+void record_stage_allocation(size_t bytes);
+
+/**
+ * A function that counts the free of memory of record_stage_allocation.
+ *
+ * @param[in] bytes The size in bytes.
+ */
+void record_stage_free(size_t bytes);
+
+/**
+ * A function that sets the counters of all stages back to zero, e.g. at the
+ * start of a file. The live bytes are kept.
+ */
+void reset_stage_memory();
+
+/**
+ * @return The allocations of all stages since reset_stage_memory.
+ */
+StageMemoryReport stage_memory_report();
+
+/**
+ * A function that prints the allocations of all stages of a file (to stderr).
+ *
+ * @param[in] file The name of the file
+ * @param[in] report The allocations
+ * @param[in] format The format of the report
+ */
+void output_stage_memory_report(const std::string &file,
+                                const StageMemoryReport &report,
+                                StageReportFormat format);
+
+/**
+ * Attributes the allocations of the calling thread to a stage while it exists.
+ * The previous stage is restored afterwards, so scopes can be nested.
+ */
+class StageScope {
+public:
+  explicit StageScope(Stage stage);
+  ~StageScope();
+
+  StageScope(const StageScope &) = delete;
+  StageScope &operator=(const StageScope &) = delete;
+
+private:
+  Stage previous;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "timeline.hpp"
+#include "buffer_pool.hpp"
+#include "sample_format.hpp"
+#include "stage_memory.hpp"
+#include <cstring>
+
+void Timeline::append(const SampleBuffer<float> &samples, size_t first,
+                      size_t frames) {
+  if (frames == 0) {
+    return;
+  }
+  parts.push_back({&samples, first, frames, nullptr});
+  total_frames += frames;
+  return;
+}
+
+void Timeline::append(const SampleBuffer<float> &samples) {
+  append(samples, 0, samples.frames());
+  return;
+}
+
+void Timeline::append_encoded(const char *bytes, size_t frames) {
+  if (frames == 0) {
+    return;
+  }
+  parts.push_back({nullptr, 0, frames, bytes});
+  total_frames += frames;
+  return;
+}
+
+void EncodedTimeline::release() {
+  for (auto &buffer : buffers) {
+    local_buffer_pool().release(std::move(buffer));
+  }
+  buffers.clear();
+  slices.clear();
+  return;
+}
+
+void update_data_size(WAVHeader &wav, const Timeline &timeline) {
+  wav.data_size = timeline.frames() * wav.block_align;
+  update_wav_size(wav);
+  return;
+}
+
+EncodedTimeline encode_timeline(const WAVHeader &wav,
+                                const Timeline &timeline) {
+  StageScope stage(Stage::write);
+
+  SampleFormat format = sample_format_of(wav);
+  Quantizer quantizer(format, wav.quantize_bits, wav.dither, wav.dither_key);
+  EncodedTimeline encoded;
+  encoded.buffers.reserve(timeline.segments().size());
+
+  for (const auto &segment : timeline.segments()) {
+    uint64_t size = static_cast<uint64_t>(segment.frames) * wav.block_align;
+    if (segment.encoded) {
+      quantizer.skip(segment.frames * wav.num_channels);
+      encoded.slices.push_back({segment.encoded, static_cast<size_t>(size)});
+      continue;
+    }
+
+    std::vector<char> bytes =
+        local_buffer_pool().acquire_bytes(static_cast<size_t>(size));
+    quantizer.encode(*segment.samples, segment.first, segment.frames,
+                     bytes.data());
+    encoded.buffers.push_back(std::move(bytes));
+    encoded.slices.push_back(
+        {encoded.buffers.back().data(), encoded.buffers.back().size()});
+  }
+  return encoded;
+}
+
+void write_wav_file(WAVHeader &wav, const Timeline &timeline,
+                    std::string filename, bool direct_io) {
+  StageScope stage(Stage::write);
+  OutputFile out_file(filename, direct_io);
+
+  update_data_size(wav, timeline);
+  std::vector<char> header = serialize_wav_header(wav);
+  EncodedTimeline samples = encode_timeline(wav, timeline);
+  std::vector<char> trailer = serialize_wav_trailer(wav);
+
+  // Header, segments and trailing chunks in one system call
+  std::vector<IOSlice> slices;
+  slices.reserve(samples.slices.size() + 2);
+  slices.push_back({header.data(), header.size()});
+  slices.insert(slices.end(), samples.slices.begin(), samples.slices.end());
+  slices.push_back({trailer.data(), trailer.size()});
+
+  out_file.preallocate(header.size() + wav.data_size + trailer.size());
+  out_file.write(slices);
+  out_file.close();
+  samples.release();
+  return;
+}
+
+void write_wav_file(WAVHeader &wav, const Timeline &timeline,
+                    std::vector<char> &buffer) {
+  StageScope stage(Stage::write);
+  update_data_size(wav, timeline);
+  std::vector<char> header = serialize_wav_header(wav);
+  std::vector<char> trailer = serialize_wav_trailer(wav);
+
+  size_t used = buffer.size();
+  buffer.resize(used + header.size() + wav.data_size + trailer.size());
+  char *target = buffer.data() + used;
+  std::memcpy(target, header.data(), header.size());
+  target += header.size();
+
+  // The segments are encoded directly into the buffer
+  SampleFormat format = sample_format_of(wav);
+  Quantizer quantizer(format, wav.quantize_bits, wav.dither, wav.dither_key);
+  for (const auto &segment : timeline.segments()) {
+    size_t size = segment.frames * wav.block_align;
+    if (segment.encoded) {
+      quantizer.skip(segment.frames * wav.num_channels);
+      std::memcpy(target, segment.encoded, size);
+    } else {
+      quantizer.encode(*segment.samples, segment.first, segment.frames, target);
+    }
+    target += size;
+  }
+
+  std::memcpy(target, trailer.data(), trailer.size());
+  return;
+}
@@ -0,0 +1,129 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+#include "filehandler.hpp"
+#include "sample_buffer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A part of the output: frames of an existing buffer or frames that are already
+ * encoded in the format of the output.
+ */
+struct Segment {
+  const SampleBuffer<float> *samples; // The source (nullptr if not decoded)
+  size_t first;                       // The first frame of the source
+  size_t frames;                      // The number of frames
+  const char *encoded = nullptr;      // The encoded frames (nullptr if none)
+};
+
+/**
+ * The samples of an output file as a list of segments that reference existing
+ * buffers (e.g. the needle sounds and the filtered track). Appending a segment
+ * does not copy samples, so the cost does not depend on the size of the
+ * buffers. The buffers have to outlive the timeline.
+ */
+class Timeline {
+public:
+  /**
+   * A function that appends frames of a buffer.
+   *
+   * @param[in] samples The buffer.
+   * @param[in] first The first frame.
+   * @param[in] frames The number of frames.
+   */
+  void append(const SampleBuffer<float> &samples, size_t first, size_t frames);
+
+  /**
+   * A function that appends all frames of a buffer.
+   *
+   * @param[in] samples The buffer.
+   */
+  void append(const SampleBuffer<float> &samples);
+
+  /**
+   * A function that appends frames that are already encoded in the format of
+   * the output. They are written as they are.
+   *
+   * @param[in] bytes The encoded frames.
+   * @param[in] frames The number of frames.
+   */
+  void append_encoded(const char *bytes, size_t frames);
+
+  /**
+   * @return The number of frames of all segments.
+   */
+  uint64_t frames() const { return total_frames; }
+
+  /**
+   * @return The segments in order.
+   */
+  const std::vector<Segment> &segments() const { return parts; }
+
+private:
+  std::vector<Segment> parts;
+  uint64_t total_frames = 0;
+};
+
+/**
+ * The encoded samples of a Timeline as slices for a vectored write. Encoded
+ * segments are not copied, their slices point to their bytes.
+ */
+struct EncodedTimeline {
+  std::vector<std::vector<char>> buffers; // The encoded segments
+  std::vector<IOSlice> slices;            // The data chunk in order
+
+  /**
+   * A function that returns the buffers to the local_buffer_pool. The slices
+   * are invalid afterwards.
+   */
+  void release();
+};
+
+/**
+ * A function that sets data_size and wav_size of the header to the size of the
+ * timeline.
+ *
+ * @param[out] wav The header of the output file.
+ * @param[in] timeline The samples of the output file.
+ */
+void update_data_size(WAVHeader &wav, const Timeline &timeline);
+
+/**
+ * A function that encodes the segments of a timeline into the byte layout of
+ * the header. One Quantizer is used for all segments, so they are rounded as
+ * if they were one buffer.
+ *
+ * @param[in] wav The header of the output file.
+ * @param[in] timeline The samples of the output file.
+ * @return The encoded segments.
+ */
+EncodedTimeline encode_timeline(const WAVHeader &wav,
+                                const Timeline &timeline);
+
+/**
+ * A function that writes a wav-file whose samples are given by a timeline. The
+ * header, the segments and the trailing chunks are written with one vectored
+ * write.
+ *
+ * @param[out] wav The header of the output file (its sizes are updated).
+ * @param[in] timeline The samples of the output file.
+ * @param[in] filename The path of the new file.
+ * @param[in] direct_io Whether to bypass the page cache.
+ */
+void write_wav_file(WAVHeader &wav, const Timeline &timeline,
+                    std::string filename, bool direct_io = false);
+
+/**
+ * A function that appends a wav-file whose samples are given by a timeline to
+ * a buffer. The segments are encoded directly into the buffer.
+ *
+ * @param[out] wav The header of the output file (its sizes are updated).
+ * @param[in] timeline The samples of the output file.
+ * @param[out] buffer The buffer the file is appended to.
+ */
+void write_wav_file(WAVHeader &wav, const Timeline &timeline,
+                    std::vector<char> &buffer);
+
+#endif
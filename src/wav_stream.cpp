@@ -0,0 +1,197 @@
+#include "wav_stream.hpp"
+#include "riff.hpp"
+#include "stage_memory.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+
+WavStreamReader::WavStreamReader(const std::string &file_path,
+                                 bool direct_io) {
+  StageScope stage(Stage::read);
+  // Named pipes and process substitutions (/dev/fd/...) are read like stdin
+  std::error_code error;
+  seekable = file_path != "-" &&
+             std::filesystem::is_regular_file(file_path, error);
+
+  // Without support for direct I/O the file is read as usual
+  if (direct_io && seekable) {
+    direct = std::make_unique<DirectReadBuf>(file_path);
+  }
+
+  if (file_path == "-") {
+    in = &std::cin;
+  } else if (direct && direct->is_open()) {
+    direct_in = std::make_unique<std::istream>(direct.get());
+    in = direct_in.get();
+  } else {
+    file.open(file_path, std::ios::binary);
+    if (!file) {
+      throw "Failed to open input file.\n";
+    }
+    in = &file;
+  }
+
+  char riff_header[12];
+  if (!in->read(riff_header, sizeof(riff_header))) {
+    throw "File seams to be currupted!\n";
+  }
+  parse_riff_header(riff_header, wav);
+
+  // The size of a pipe is unknown, its chunks are read up to the data chunk
+  uint64_t size = std::numeric_limits<uint64_t>::max();
+  if (seekable) {
+    in->seekg(0, std::ios::end);
+    size = static_cast<uint64_t>(in->tellg());
+    in->seekg(sizeof(riff_header));
+  }
+
+  wav.chunks = index_riff_chunks(*in, size);
+  const RIFFChunk *fmt = find_riff_chunk(wav.chunks, "fmt ");
+  const RIFFChunk *ds64 = find_riff_chunk(wav.chunks, "ds64");
+  bool rf64 = ds64 != nullptr;
+  parse_wav_chunks(fmt ? fmt->payload.data() : nullptr,
+                   ds64 ? ds64->payload.data() : nullptr, wav);
+
+  format = sample_format_of(wav);
+
+  const RIFFChunk *data = find_riff_chunk(wav.chunks, "data");
+  data_offset = data->offset;
+  if (seekable) {
+    in->clear();
+    in->seekg(static_cast<std::streamoff>(data_offset));
+  } else if (!rf64 && (wav.data_size == riff_size_in_ds64 ||
+                       wav.data_size == 0)) {
+    // Programs that write to a pipe leave a placeholder as size
+    wav.data_size = unknown_data_size;
+    remaining_frames = std::numeric_limits<uint64_t>::max();
+    return;
+  }
+
+  total_frames = wav.data_size / wav.block_align;
+  remaining_frames = total_frames;
+}
+
+size_t WavStreamReader::read(SampleBuffer<float> &samples, size_t frames) {
+  StageScope stage(Stage::read);
+  size_t count = read_encoded(frames);
+  decode_samples(encoded.data(), count, format, samples, 0);
+  return count;
+}
+
+void WavStreamReader::seek(uint64_t frame) {
+  StageScope stage(Stage::read);
+  if (seekable) {
+    frame = std::min(frame, total_frames);
+    in->clear();
+    in->seekg(
+        static_cast<std::streamoff>(data_offset + frame * wav.block_align));
+    remaining_frames = total_frames - frame;
+    return;
+  }
+
+  // A pipe is read up to the frame, the frames are not decoded
+  constexpr size_t block_frames = 1 << 16;
+  uint64_t position = wav.data_size == unknown_data_size
+                          ? total_frames
+                          : total_frames - remaining_frames;
+  while (position < frame) {
+    size_t count = read_encoded(static_cast<size_t>(
+        std::min<uint64_t>(block_frames, frame - position)));
+    if (count == 0) {
+      break;
+    }
+    position += count;
+  }
+}
+
+// Reads the next frames into encoded and returns their number
+size_t WavStreamReader::read_encoded(size_t frames) {
+  size_t count = static_cast<size_t>(
+      std::min<uint64_t>(frames, remaining_frames));
+  if (count == 0) {
+    return 0;
+  }
+
+  encoded.resize(count * wav.block_align);
+  in->read(encoded.data(), static_cast<std::streamsize>(encoded.size()));
+  if (!*in) {
+    if (wav.data_size != unknown_data_size || in->bad()) {
+      throw "Error reading the WAV file data.\n";
+    }
+
+    // A pipe without size ends with its last complete frame
+    count = static_cast<size_t>(in->gcount()) / wav.block_align;
+    remaining_frames = count;
+  }
+
+  remaining_frames -= count;
+  total_frames += wav.data_size == unknown_data_size ? count : 0;
+  return count;
+}
+
+WavStreamWriter::WavStreamWriter(const std::string &file_path,
+                                 const WAVHeader &header, bool direct_io)
+    : file(file_path, direct_io), wav(header),
+      quantizer(sample_format_of(header), header.quantize_bits, header.dither,
+                header.dither_key) {
+  StageScope stage(Stage::write);
+  wav.data.clear();
+  seekable = file.seekable();
+
+  // Without a size the chunks after the samples would be read as samples
+  if (!seekable && wav.data_size == unknown_data_size) {
+    std::stable_partition(
+        wav.chunks.begin(), wav.chunks.end(),
+        [](const RIFFChunk &chunk) { return !is_riff_chunk(chunk, "data"); });
+  }
+
+  update_wav_size(wav);
+  std::vector<char> serialized = serialize_wav_header(wav, seekable);
+  if (wav.data_size != unknown_data_size) {
+    file.preallocate(serialized.size() + wav.data_size +
+                     serialize_wav_trailer(wav).size());
+  }
+  file.write({{serialized.data(), serialized.size()}});
+}
+
+WavStreamWriter::~WavStreamWriter() {
+  if (!closed) {
+    try {
+      close();
+    } catch (const char *error) {
+      std::cerr << "Error: " << error << std::endl;
+    }
+  }
+}
+
+void WavStreamWriter::write(const SampleBuffer<float> &samples) {
+  StageScope stage(Stage::write);
+  encoded.resize(samples.frames() * wav.block_align);
+  quantizer.encode(samples, 0, samples.frames(), encoded.data());
+  file.write({{encoded.data(), encoded.size()}});
+  data_bytes += encoded.size();
+}
+
+void WavStreamWriter::start_at(uint64_t frame) {
+  quantizer.skip(frame * wav.num_channels);
+}
+
+void WavStreamWriter::close() {
+  StageScope stage(Stage::write);
+  closed = true;
+
+  // The sizes are only known now, so the header is written a second time. The
+  // reserved JUNK chunk becomes the ds64 chunk if the file exceeds 4 GiB. A
+  // pipe keeps the sizes (or placeholders) of the first header.
+  wav.data_size = data_bytes;
+  update_wav_size(wav);
+  std::vector<char> trailer = serialize_wav_trailer(wav);
+  file.write({{trailer.data(), trailer.size()}});
+  if (seekable) {
+    std::vector<char> serialized = serialize_wav_header(wav, true);
+    file.write_at(0, serialized.data(), serialized.size());
+  }
+  file.close();
+}
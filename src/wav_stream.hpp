@@ -0,0 +1,128 @@
+#ifndef WAV_STREAM_H
+#define WAV_STREAM_H
+#include "filehandler.hpp"
+#include "sample_format.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A reader that returns the samples of a wav-file block by block. Only the
+ * chunk headers and the metadata chunks are kept in memory. The path "-" reads
+ * from stdin. If a pipe only has a placeholder as size, data_size of the header
+ * is unknown_data_size and the samples are read up to the end of the pipe.
+ * With direct I/O the file is read in aligned blocks past the page cache.
+ */
+class WavStreamReader {
+public:
+  /**
+   * @param[in] file_path The path to the audiofile.
+   * @param[in] direct_io Whether to bypass the page cache.
+   */
+  explicit WavStreamReader(const std::string &file_path,
+                           bool direct_io = false);
+
+  /**
+   * @return The parsed header (the data vector stays empty).
+   */
+  const WAVHeader &header() const { return wav; }
+
+  /**
+   * @return The number of frames in the data chunk (for pipes without size:
+   * the frames read so far).
+   */
+  uint64_t frames() const { return total_frames; }
+
+  /**
+   * A function that reads the next block of samples, decodes them to floats
+   * and splits them into channels.
+   *
+   * @param[out] samples The buffer for at least frames frames of all channels.
+   * @param[in] frames The maximum number of frames to read.
+   * @return The number of frames read (0 at the end of the data chunk).
+   */
+  size_t read(SampleBuffer<float> &samples, size_t frames);
+
+  /**
+   * A function that moves to a frame of the data chunk, so that the next read
+   * starts there. A file is not read up to the frame, a pipe is (it can only
+   * move forward).
+   *
+   * @param[in] frame The frame (frames after the end move to the end).
+   */
+  void seek(uint64_t frame);
+
+private:
+  size_t read_encoded(size_t frames);
+
+  std::ifstream file;
+  std::unique_ptr<DirectReadBuf> direct;  // The file with direct I/O
+  std::unique_ptr<std::istream> direct_in; // Stream on direct
+  std::istream *in;                        // file, direct_in or stdin
+  WAVHeader wav;
+  SampleFormat format;           // The encoding of the samples
+  std::vector<char> encoded;     // The block in the layout of the file
+  uint64_t total_frames = 0;     // Frames in the data chunk
+  uint64_t remaining_frames = 0; // Frames that were not read yet
+  uint64_t data_offset = 0;      // Offset of the first sample in the file
+  bool seekable = false;         // Whether the reader can seek (not a pipe)
+};
+
+/**
+ * A writer that writes the samples of a wav-file block by block. The header is
+ * written with the sizes of the given WAVHeader and patched on close. The path
+ * "-" writes to stdout, where the header can not be patched: it keeps the
+ * sizes of the given WAVHeader or placeholders if they are unknown.
+ */
+class WavStreamWriter {
+public:
+  /**
+   * @param[in] file_path The path of the new file.
+   * @param[in] header The format and the chunk index of the new file.
+   * @param[in] direct_io Whether to bypass the page cache.
+   */
+  WavStreamWriter(const std::string &file_path, const WAVHeader &header,
+                  bool direct_io = false);
+  ~WavStreamWriter();
+
+  WavStreamWriter(const WavStreamWriter &) = delete;
+  WavStreamWriter &operator=(const WavStreamWriter &) = delete;
+
+  /**
+   * A function that rounds, interleaves, encodes and appends a block of
+   * samples.
+   *
+   * @param[in] samples The frames to write (1.0 is full scale).
+   */
+  void write(const SampleBuffer<float> &samples);
+
+  /**
+   * A function that starts the output at a frame of a longer output, e.g. for
+   * an excerpt. Nothing is written, but the dither of the following frames is
+   * the same as in the longer output.
+   *
+   * @param[in] frame The index of the next frame in the longer output.
+   */
+  void start_at(uint64_t frame);
+
+  /**
+   * A function that writes the trailing chunks and patches the sizes in the
+   * header.
+   */
+  void close();
+
+private:
+  OutputFile file;
+  WAVHeader wav;
+  Quantizer quantizer;       // Rounds the samples to the output format
+  std::vector<char> encoded; // The block in the layout of the file
+  uint64_t data_bytes = 0;   // Bytes of samples written so far
+  bool seekable;           // Whether the header can be patched
+  bool closed = false;
+};
+
+#endif